@@ -0,0 +1,240 @@
+// The allocator of the live section.
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "Allocator.h"
+
+namespace {
+
+// The classes are 8 bytes apart up to here, then 4 per doubling up to kMaxSmallBlock.
+const FFS_Offset kMaxFineClass = 256;
+const DWORD kFineClasses = DWORD(kMaxFineClass / 8) - 1;
+const FFS_Offset kMinBlock = 16;
+
+// A free block of FFS_FreeLists::large.
+struct LargeBlock {
+  FFS_Offset next;
+  FFS_Offset bytes;
+};
+
+FFS_Offset ClassSize(DWORD size_class) {
+  if (size_class < kFineClasses)
+    return kMinBlock + FFS_Offset(size_class) * 8;
+  auto coarse = size_class - kFineClasses;
+  auto base = kMaxFineClass << (coarse / 4);
+  return base + FFS_Offset(coarse % 4 + 1) * (base / 4);
+}
+
+// The smallest class of at least |bytes|, which is at most kMaxSmallBlock.
+DWORD SizeClass(FFS_Offset bytes) {
+  if (bytes <= kMaxFineClass)
+    return (bytes <= kMinBlock) ? 0 : DWORD((bytes + 7) / 8) - 2;
+  DWORD size_class = kFineClasses;
+  auto base = kMaxFineClass;
+  while (bytes > base * 2) {
+    base *= 2;
+    size_class += 4;
+  }
+  return size_class + DWORD((bytes - base + base / 4 - 1) / (base / 4)) - 1;
+}
+
+template <typename T>
+T* At(FFS_Header* header, FFS_Offset offset) {
+  FFS_OffsetPtr<T> ptr = {offset};
+  return ptr.Get(header);
+}
+
+void PushSmall(FFS_Header* header, DWORD size_class, FFS_Offset offset) {
+  auto& lists = header->free_lists;
+  *At<FFS_Offset>(header, offset) = lists.small[size_class];
+  lists.small[size_class] = offset;
+  lists.free_bytes += ClassSize(size_class);
+}
+
+// Takes the first block of the list of |size_class| if it is at most at |max_offset|.
+FFS_Offset PopSmall(FFS_Header* header, DWORD size_class, ULONGLONG max_offset) {
+  auto& lists = header->free_lists;
+  auto offset = lists.small[size_class];
+  if (!offset || (ULONGLONG(offset) > max_offset))
+    return 0;
+  lists.small[size_class] = *At<FFS_Offset>(header, offset);
+  lists.free_bytes -= ClassSize(size_class);
+  return offset;
+}
+
+// Cuts the |bytes| at |offset|, at most kMaxSmallBlock, into the biggest blocks that fit.
+void CutSmall(FFS_Header* header, FFS_Offset offset, FFS_Offset bytes) {
+  while (bytes >= kMinBlock) {
+    auto size_class = SizeClass(bytes);
+    if (ClassSize(size_class) > bytes)
+      --size_class;
+    PushSmall(header, size_class, offset);
+    offset += ClassSize(size_class);
+    bytes -= ClassSize(size_class);
+  }
+}
+
+void InsertLarge(FFS_Header* header, FFS_Offset offset, FFS_Offset bytes) {
+  auto& lists = header->free_lists;
+  lists.free_bytes += bytes;
+  FFS_Offset prev = 0;
+  auto next = lists.large;
+  while (next && (next < offset)) {
+    prev = next;
+    next = At<LargeBlock>(header, next)->next;
+  }
+  if (next && (offset + bytes == next)) {
+    bytes += At<LargeBlock>(header, next)->bytes;
+    next = At<LargeBlock>(header, next)->next;
+  }
+  if (prev && (prev + At<LargeBlock>(header, prev)->bytes == offset)) {
+    At<LargeBlock>(header, prev)->bytes += bytes;
+    At<LargeBlock>(header, prev)->next = next;
+    return;
+  }
+  auto block = At<LargeBlock>(header, offset);
+  block->next = next;
+  block->bytes = bytes;
+  if (prev)
+    At<LargeBlock>(header, prev)->next = offset;
+  else
+    lists.large = offset;
+}
+
+// Cuts |bytes| from the end of a block of the large list, at most at |max_offset|: the smallest
+// one they fit in for a large block, which keeps the big ones for the big blocks, and the first
+// one for a small block. What is left of the block stays in the list.
+FFS_Offset TakeLarge(FFS_Header* header, FFS_Offset bytes, ULONGLONG max_offset) {
+  auto& lists = header->free_lists;
+  FFS_Offset* best = nullptr;
+  for (auto link = &lists.large; *link; link = &At<LargeBlock>(header, *link)->next) {
+    auto block = At<LargeBlock>(header, *link);
+    if ((block->bytes < bytes) || (ULONGLONG(*link + block->bytes - bytes) > max_offset))
+      continue;
+    if (!best || (block->bytes < At<LargeBlock>(header, *best)->bytes))
+      best = link;
+    if ((block->bytes == bytes) || (bytes <= kMaxSmallBlock))
+      break;
+  }
+  if (!best)
+    return 0;
+  auto offset = *best;
+  auto block = At<LargeBlock>(header, offset);
+  auto left = block->bytes - bytes;
+  lists.free_bytes -= bytes;
+  if (left >= kMinBlock) {
+    block->bytes = left;
+  } else {
+    *best = block->next;
+    lists.free_bytes -= left;
+  }
+  return offset + left;
+}
+
+// Merges the adjacent free blocks of all the lists, if any were freed since the last time. The
+// small blocks are not merged as they are freed, so once many of them were, a large block can
+// only fit in pieces. Returns whether any were merged.
+bool MergeFreeBlocks(FFS_Header* header) {
+  struct Block {
+    FFS_Offset offset;
+    FFS_Offset bytes;
+  };
+  auto& lists = header->free_lists;
+  if (!lists.unmerged_bytes)
+    return false;
+  std::vector<Block> blocks;
+  for (DWORD size_class = 0; size_class != FFS_kSizeClasses; ++size_class) {
+    for (auto offset = lists.small[size_class]; offset; offset = *At<FFS_Offset>(header, offset)) {
+      Block block = {offset, ClassSize(size_class)};
+      blocks.push_back(block);
+    }
+  }
+  for (auto offset = lists.large; offset; offset = At<LargeBlock>(header, offset)->next) {
+    Block block = {offset, At<LargeBlock>(header, offset)->bytes};
+    blocks.push_back(block);
+  }
+  std::sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) {
+    return a.offset < b.offset;
+  });
+  size_t merged = 0;
+  for (auto& block : blocks) {
+    if (merged && (blocks[merged - 1].offset + blocks[merged - 1].bytes == block.offset))
+      blocks[merged - 1].bytes += block.bytes;
+    else
+      blocks[merged++] = block;
+  }
+  if (merged == blocks.size()) {
+    lists.unmerged_bytes = 0;
+    return false;
+  }
+  lists = FFS_FreeLists();
+  // From the end, so each large block goes to the front of the list.
+  while (merged--)
+    FreeBlock(header, blocks[merged].offset, blocks[merged].bytes);
+  lists.unmerged_bytes = 0;
+  return true;
+}
+
+FFS_Offset Allocate(FFS_Header* header, size_t size, FFS_Offset bytes, ULONGLONG max_offset) {
+  bool small = bytes <= kMaxSmallBlock;
+  auto size_class = small ? SizeClass(bytes) : 0;
+  if (small) {
+    if (auto offset = PopSmall(header, size_class, max_offset))
+      return offset;
+  }
+  if (auto offset = TakeLarge(header, bytes, max_offset))
+    return offset;
+  auto offset = (header->used + 7) & ~FFS_Offset(7);
+  if ((offset <= size) && (size - offset >= bytes) && (ULONGLONG(offset) <= max_offset)) {
+    header->used = offset + bytes;
+    return offset;
+  }
+  if (small) {
+    for (auto larger = size_class + 1; larger != FFS_kSizeClasses; ++larger) {
+      if (auto offset = PopSmall(header, larger, max_offset)) {
+        // What is left is freed like any other piece, and can merge again.
+        header->free_lists.unmerged_bytes += ClassSize(larger) - bytes;
+        CutSmall(header, offset + bytes, ClassSize(larger) - bytes);
+        return offset;
+      }
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+FFS_Offset BlockSize(FFS_Offset bytes) {
+  if (bytes <= kMaxSmallBlock)
+    return ClassSize(SizeClass(bytes));
+  return (bytes + 7) & ~FFS_Offset(7);
+}
+
+FFS_Offset AllocateBlock(FFS_Header* header, size_t size, FFS_Offset bytes,
+                         ULONGLONG max_offset) {
+  bytes = BlockSize(bytes);
+  if (auto offset = Allocate(header, size, bytes, max_offset))
+    return offset;
+  if (!MergeFreeBlocks(header))
+    return 0;
+  return Allocate(header, size, bytes, max_offset);
+}
+
+void FreeBlock(FFS_Header* header, FFS_Offset offset, FFS_Offset bytes) {
+  bytes &= ~FFS_Offset(7);
+  if (!bytes)
+    return;
+  // The end of the bump region is given back to it, so the snapshots do not save it.
+  if (offset + bytes == header->used) {
+    header->used = offset;
+    return;
+  }
+  header->free_lists.unmerged_bytes += bytes;
+  if (bytes > kMaxSmallBlock)
+    InsertLarge(header, offset, bytes);
+  else
+    CutSmall(header, offset, bytes);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// The allocator of the live section, for the records, listings and index tables the server adds
+// after the scan. It works with offsets and keeps all its state in the section, in
+// FFS_Header::free_lists.
+//
+// The scan lays out the section up to FFS_Header::used and what the server adds goes past it, so
+// the section grows like a bump region. The memory the server frees, the blocks it retired once
+// no client can be reading them, see Epoch.h, goes to free lists that are used before the bump
+// region grows:
+//   - the small blocks, up to kMaxSmallBlock bytes, are rounded up to a size class and go to the
+//     list of their class. A record or a small listing is a few hundred bytes, so the classes are
+//     8 bytes apart up to 256 bytes and then 4 per doubling, which wastes less than a quarter of
+//     a block.
+//   - the larger blocks, the index tables, the listings of big directories or the memory of a
+//     subtree removed at once, are kept whole in one list in offset order and merged with their
+//     neighbors as they are freed. A large block is cut from the end of the smallest one it fits
+//     in, and what is left stays in the list, so that it merges again.
+// A freed part of the section that is not a block, like an index the scan wrote, is cut into
+// blocks of the classes, losing the tail of less than 16 bytes. A small block whose list is empty
+// is cut from the first block of the large list, then from the bump region, then from a block of
+// a larger class. When none of them fits, the adjacent free blocks of all the lists are merged
+// and sorted again, so the section only runs out when the free memory is in pieces too small. A
+// block freed at the end of the bump region goes back to it.
+//
+// Only the server allocates and frees, on one thread. The clients never read a free block.
+
+#include "FastFileStats.h"
+
+// The larger blocks are not rounded to a size class.
+const FFS_Offset kMaxSmallBlock = 4096;
+
+// For AllocateBlock(), when the block can be anywhere.
+const ULONGLONG kAnyOffset = ~0ULL;
+
+// The bytes a block of |bytes| takes: its size class, or |bytes| rounded to 8 for a large one.
+FFS_Offset BlockSize(FFS_Offset bytes);
+
+// Returns the offset of a block of BlockSize(|bytes|), 8 byte aligned and at most |max_offset|, in
+// the live section at |header|, which is |size| bytes. Returns 0 if there is no room.
+FFS_Offset AllocateBlock(FFS_Header* header, size_t size, FFS_Offset bytes, ULONGLONG max_offset);
+
+// Frees the |bytes| at |offset|, 8 byte aligned, which no client can read anymore. A block from
+// AllocateBlock() is freed whole with its BlockSize(), any other part of the section with its
+// size.
+void FreeBlock(FFS_Header* header, FFS_Offset offset, FFS_Offset bytes);
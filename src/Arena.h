@@ -0,0 +1,49 @@
+#pragma once
+
+// Bump allocator for the directory listings read by one scan worker.
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// A listing (a run) is always contiguous, if it does not fit in the current chunk it is moved to
+// a new one. That is fine because records only have relative links at this point.
+class Arena {
+ public:
+  Arena() : run_(nullptr), cur_(nullptr), end_(nullptr) {}
+
+  void BeginRun() { run_ = cur_; }
+
+  // Returns room for a full WIN32_FIND_DATA at the end of the current run.
+  WIN32_FIND_DATA* Next() {
+    if (size_t(end_ - cur_) < sizeof(WIN32_FIND_DATA))
+      Grow();
+    return reinterpret_cast<WIN32_FIND_DATA*>(cur_);
+  }
+
+  void Advance(WIN32_FIND_DATA* next) { cur_ = reinterpret_cast<BYTE*>(next); }
+
+  const BYTE* run() const { return run_; }
+  DWORD run_size() const { return DWORD(cur_ - run_); }
+
+ private:
+  // Arena memory is allocated in chunks of this size, or bigger if a single listing needs it.
+  static const size_t kChunkSize = 1024 * 1024 * 4;
+
+  void Grow() {
+    size_t used = cur_ - run_;
+    size_t size = std::max(kChunkSize, used * 2 + sizeof(WIN32_FIND_DATA));
+    chunks_.emplace_back(new BYTE[size]);
+    auto chunk = chunks_.back().get();
+    if (used)
+      memcpy(chunk, run_, used);
+    run_ = chunk;
+    cur_ = chunk + used;
+    end_ = chunk + size;
+  }
+
+  std::vector<std::unique_ptr<BYTE[]>> chunks_;
+  BYTE* run_;
+  BYTE* cur_;
+  BYTE* end_;
+};
@@ -0,0 +1,1177 @@
+// Microbenchmarks of the section.
+
+#include "stdafx.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if !defined(_WIN32)
+#include <time.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Allocator.h"
+#include "Benchmarks.h"
+#include "DirIndex.h"
+#include "DirReader.h"
+#include "Epoch.h"
+#include "FastFileStats.h"
+#include "Hash.h"
+#include "Layout.h"
+#include "LeafIndex.h"
+#include "Lookup.h"
+#include "PerfectHash.h"
+#include "Scanner.h"
+#include "Section.h"
+#include "Update.h"
+#include "Utf8.h"
+
+#if defined(FFS_COUNT_ALLOCATIONS)
+namespace {
+
+// The operator new calls of the whole process, so that BenchmarkLookups() can check that the
+// lookups make none. Only the bench build (make bench) defines FFS_COUNT_ALLOCATIONS: the servers
+// keep the allocator of the runtime.
+std::atomic<size_t> allocations(0);
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto memory = malloc(size ? size : 1))
+    return memory;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+#endif
+
+namespace {
+
+// How long each measurement runs at least.
+const double kMinRunUs = 100 * 1000;
+
+double NowUs() {
+#if defined(_WIN32)
+  LARGE_INTEGER freq, now;
+  ::QueryPerformanceFrequency(&freq);
+  ::QueryPerformanceCounter(&now);
+  return double(now.QuadPart) * 1000000.0 / double(freq.QuadPart);
+#else
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+#endif
+}
+
+void Report(const char* format, ...) {
+  char msg[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(msg, sizeof(msg), format, args);
+  va_end(args);
+#if defined(_WIN32)
+  ::OutputDebugStringA(msg);
+#else
+  fputs(msg, stdout);
+#endif
+}
+
+// What GetLeaf() did before the directories had a sorted index.
+template <typename Nodes, typename Char>
+DWORD WalkLeaf(const Nodes& nodes, DWORD dot_node, const std::basic_string<Char>& name) {
+  for (auto curr = nodes.Next(dot_node); curr; curr = nodes.Next(curr)) {
+    if (nodes.NameIs(curr, name.c_str(), name.size()))
+      return curr;
+  }
+  return 0;
+}
+
+bool HasUtf8Names(const FFS_Header* header) {
+  return (header->layout == FFS_kLayoutColumns) && (header->columns.names != FFS_kNamesWide);
+}
+
+// The names to look up, in both encodings so each section is timed with its own.
+struct Probe {
+  const FFS_Dir* dir;
+  std::wstring name;
+  std::string utf8;
+};
+
+DWORD WalkLeaf(const FFS_Header* header, const Probe& probe) {
+  if (HasUtf8Names(header) && (header->columns.names == FFS_kNamesFrontCoded))
+    return WalkLeaf(FrontCodedColumnNodes(header), probe.dir->anchor, probe.utf8);
+  if (HasUtf8Names(header))
+    return WalkLeaf(Utf8ColumnNodes(header), probe.dir->anchor, probe.utf8);
+  if (header->layout == FFS_kLayoutColumns)
+    return WalkLeaf(WideColumnNodes(header), probe.dir->anchor, probe.name);
+  return WalkLeaf(RecordNodes(header), probe.dir->anchor, probe.name);
+}
+
+DWORD GetLeaf(const FFS_Header* header, const Probe& probe) {
+  if (HasUtf8Names(header))
+    return GetLeaf(header, probe.dir, Utf8View(probe.utf8));
+  return GetLeaf(header, probe.dir, probe.name);
+}
+
+// Returns the nanoseconds per call of |lookup| over |probes|, which should all be found.
+template <typename Item, typename Lookup>
+double TimeLookups(const std::vector<Item>& probes, Lookup lookup) {
+  size_t calls = 0;
+  size_t found = 0;
+  auto before = NowUs();
+  double elapsed;
+  do {
+    for (auto& probe : probes)
+      found += lookup(probe) ? 1 : 0;
+    calls += probes.size();
+    elapsed = NowUs() - before;
+  } while (elapsed < kMinRunUs);
+  if (found != calls)
+    Report("ffs: error: %llu of %llu lookups found nothing\n",
+           (unsigned long long)(calls - found), (unsigned long long)calls);
+  return elapsed * 1000.0 / double(calls);
+}
+
+
+// Returns the nanoseconds per path of GetNodes() over |paths|, which should all be found.
+template <typename View>
+double TimeBatches(const FFS_Header* header, const std::vector<View>& paths) {
+  std::vector<DWORD> nodes(paths.size());
+  size_t calls = 0;
+  size_t found = 0;
+  auto before = NowUs();
+  double elapsed;
+  do {
+    GetNodes(header, paths.data(), paths.size(), nodes.data());
+    for (auto node : nodes)
+      found += node ? 1 : 0;
+    calls += paths.size();
+    elapsed = NowUs() - before;
+  } while (elapsed < kMinRunUs);
+  if (found != calls)
+    Report("ffs: error: %llu of %llu lookups found nothing\n",
+           (unsigned long long)(calls - found), (unsigned long long)calls);
+  return elapsed * 1000.0 / double(calls);
+}
+
+// Keeps the hashes of TimeHashes() from being optimized out.
+volatile DWORD hash_sink;
+
+// Hashes |names| with |hash| until kMinRunUs have passed. Returns the nanoseconds per name.
+template <typename Char, typename Hash>
+double TimeHashes(const std::vector<std::basic_string<Char>>& names, Hash hash) {
+  size_t calls = 0;
+  DWORD sum = 0;
+  auto before = NowUs();
+  double elapsed;
+  do {
+    for (auto& name : names)
+      sum += hash(name);
+    calls += names.size();
+    elapsed = NowUs() - before;
+  } while (elapsed < kMinRunUs);
+  hash_sink = sum;
+  return elapsed * 1000.0 / double(calls);
+}
+
+// The average number of slots looked at to find each of |hashes| in an open addressing table of
+// |slot_count| slots, probed linearly from the low bits like the directory index and the name
+// table. Sets |*longest| to the most slots any of them takes.
+double AverageProbes(const std::vector<DWORD>& hashes, DWORD slot_count, DWORD* longest) {
+  std::vector<bool> used(slot_count);
+  size_t probes = 0;
+  *longest = 0;
+  for (auto hash : hashes) {
+    DWORD probe = 1;
+    auto slot = hash & (slot_count - 1);
+    for (; used[slot]; slot = (slot + 1) & (slot_count - 1))
+      ++probe;
+    used[slot] = true;
+    probes += probe;
+    *longest = std::max(*longest, probe);
+  }
+  return double(probes) / double(hashes.size());
+}
+
+// Times |policy| over the names and the directory paths of a tree in one encoding, and reports
+// how far the directory index and the name table of the columns probe with it.
+template <typename Char>
+void ReportHashes(const char* policy_name, DWORD policy, const char* encoding,
+                  const std::vector<std::basic_string<Char>>& names,
+                  const std::vector<std::basic_string<Char>>& paths) {
+  typedef std::basic_string<Char> String;
+  size_t bytes = 0;
+  for (auto& name : names)
+    bytes += name.size() * sizeof(Char);
+  auto name_ns = TimeHashes(names, [policy](const String& name) {
+    return NameHash(policy, name.c_str(), name.size());
+  });
+  auto path_ns = TimeHashes(paths, [policy](const String& path) {
+    return PathHash(policy, path.c_str(), path.size());
+  });
+
+  std::vector<DWORD> dir_hashes;
+  for (auto& path : paths)
+    dir_hashes.push_back(PathHash(policy, path.c_str(), path.size()));
+  DWORD dir_longest;
+  auto dir_probes = AverageProbes(dir_hashes, DirSlotCount(DWORD(paths.size())), &dir_longest);
+  std::sort(dir_hashes.begin(), dir_hashes.end());
+  auto collisions = DWORD(dir_hashes.size() -
+                          (std::unique(dir_hashes.begin(), dir_hashes.end()) - dir_hashes.begin()));
+
+  // The name table of NameInterner has the distinct names, in twice as many slots.
+  std::vector<String> distinct(names);
+  std::sort(distinct.begin(), distinct.end());
+  distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+  std::vector<DWORD> name_hashes;
+  for (auto& name : distinct)
+    name_hashes.push_back(NameHash(policy, name.c_str(), name.size()));
+  DWORD slots = 2;
+  while (slots < distinct.size() * 2)
+    slots *= 2;
+  DWORD name_longest;
+  auto name_probes = AverageProbes(name_hashes, slots, &name_longest);
+
+  Report("ffs: %s over %u %s names: %.1f ns per name, %.0f MB/s, %.0f ns per dir path\n",
+         policy_name, DWORD(names.size()), encoding, name_ns,
+         double(bytes) * 1000.0 / (name_ns * double(names.size())), path_ns);
+  Report("ffs:   %u dirs: %.2f probes, %u at most, %u equal hashes; %u distinct names: "
+         "%.2f probes, %u at most\n", DWORD(paths.size()), dir_probes, dir_longest, collisions,
+         DWORD(distinct.size()), name_probes, name_longest);
+}
+
+// Looks up every directory of |header| in its directory index and reports the slots probed per
+// lookup, and how many other directories were read on the way, each one a likely cache miss:
+// with the fingerprints of the slots, with whole hashes in the slots, and with no hash in them,
+// which reads every directory probed.
+void ReportDirReads(const FFS_Header* header) {
+  auto table = header->dir_slots.Get(header);
+  auto mask = table->slot_count - 1;
+  auto dirs = header->dir_table.Get(header);
+  size_t probes = 0;
+  size_t fingerprint_reads = 0;
+  size_t hash_reads = 0;
+  for (DWORD ix = 0; ix != header->dir_count; ++ix) {
+    auto hash = dirs[ix].hash;
+    auto wanted = header->dir_table + FFS_Offset(ix) * sizeof(FFS_Dir);
+    for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+      auto packed = table->slots[slot].packed;
+      if (!packed)
+        __debugbreak();
+      ++probes;
+      FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(packed)};
+      if ((packed ^ dir) == DirSlotFingerprint(hash))
+        ++fingerprint_reads;
+      if (dir.Get(header)->hash == hash)
+        ++hash_reads;
+      if (dir == wanted)
+        break;
+    }
+  }
+  // Each lookup reads its own directory once.
+  auto lookups = header->dir_count;
+  Report("ffs: %u dirs in %u slots: %.3f probes per lookup, other dirs read: %u with %u-bit "
+         "fingerprints, %u with whole hashes, %u without\n", lookups, table->slot_count,
+         double(probes) / double(std::max<DWORD>(1, lookups)), DWORD(fingerprint_reads - lookups),
+         64 - FFS_kDirSlotOffsetBits, DWORD(hash_reads - lookups), DWORD(probes - lookups));
+}
+
+// A node to look up in the leaf index.
+struct Leaf {
+  const FFS_Dir* dir;
+  DWORD node;
+  DWORD name_hash;
+};
+
+// The leaf at |entry| of |dir|, with the name hash the leaf index has for it.
+Leaf ReadLeaf(const FFS_Header* header, const FFS_Dir* dir, DWORD entry) {
+  auto node = dir->index.Get(header)[entry];
+  WIN32_FIND_DATA w32fd;
+  ReadNode(header, node, &w32fd);
+  std::wstring name(w32fd.cFileName);
+  auto utf8 = ToUtf8(name);
+  Leaf leaf = {dir, node,
+               HasUtf8Names(header) ? NameHash(header->hash_policy, utf8.c_str(), utf8.size()) :
+                                      NameHash(header->hash_policy, name.c_str(), name.size())};
+  return leaf;
+}
+
+// Full paths of |count| nodes spread over the whole tree of |header|, in both encodings. Sets
+// |*newest| to the newest write time among them.
+void SamplePaths(const FFS_Header* header, size_t count, std::vector<std::wstring>* paths,
+                 std::vector<std::string>* utf8_paths, ULONGLONG* newest) {
+  std::mt19937 random(1543);
+  auto dirs = header->dir_table.Get(header);
+  WIN32_FIND_DATA w32fd;
+  for (size_t probe = 0; probe != count; ++probe) {
+    auto dir = &dirs[random() % header->dir_count];
+    if (!dir->count)
+      continue;
+    auto index = dir->index.Get(header);
+    std::wstring path;
+    for (auto node = index[random() % dir->count]; node; node = w32fd.dwReserved0) {
+      ReadNode(header, node, &w32fd);
+      path = path.empty() ? std::wstring(w32fd.cFileName) :
+                            std::wstring(w32fd.cFileName) + kPathSep + path;
+      *newest = std::max(*newest, ToULL(w32fd.ftLastWriteTime));
+    }
+    paths->push_back(path);
+    utf8_paths->push_back(ToUtf8(path));
+  }
+}
+
+// Returns the nanoseconds per GetNode() of the paths, which must all be found, in the encoding
+// of |header|.
+double TimePaths(const FFS_Header* header, const std::vector<std::wstring>& paths,
+                 const std::vector<std::string>& utf8_paths) {
+  if (HasUtf8Names(header)) {
+    return TimeLookups(utf8_paths, [header](const std::string& path) {
+      return GetNode(header, Utf8View(path));
+    });
+  }
+  return TimeLookups(paths, [header](const std::wstring& path) {
+    return GetNode(header, path);
+  });
+}
+
+// Gives |node|, in the listing of |dir|, |value| as both its size and its write time, which is
+// what BenchmarkGenerations() checks the reads against.
+void SetStressFields(FFS_Header* header, FFS_Dir* dir, DWORD node, ULONGLONG value) {
+  WIN32_FIND_DATA w32fd;
+  ReadNode(header, node, &w32fd);
+  w32fd.ftLastWriteTime = ToFileTime(value);
+  w32fd.nFileSizeHigh = DWORD(value >> 32);
+  w32fd.nFileSizeLow = DWORD(value);
+  WriteNodeFields(header, dir, node, w32fd);
+}
+
+// Tells if |w32fd| has half of a write of SetStressFields().
+bool IsTorn(const WIN32_FIND_DATA& w32fd) {
+  return ToULL(w32fd.ftLastWriteTime) !=
+         ((ULONGLONG(w32fd.nFileSizeHigh) << 32) | w32fd.nFileSizeLow);
+}
+
+}  // namespace
+
+void BenchmarkLookups(const FFS_Header* header) {
+  // Directory sizes are grouped up to these many entries.
+  const DWORD kGroups[] = {8, 64, 512, 4096, 32768, 0xFFFFFFFF};
+  // The walk is quadratic, so the big groups get fewer probes.
+  const size_t kMaxCompares = 20 * 1000 * 1000;
+  const size_t kMaxProbes = 100 * 1000;
+
+  auto dirs = header->dir_table.Get(header);
+  std::mt19937 random(1543);
+
+  DWORD low = 1;
+  for (auto high : kGroups) {
+    std::vector<const FFS_Dir*> group;
+    size_t entries = 0;
+    DWORD largest = 0;
+    for (DWORD ix = 0; ix != header->dir_count; ++ix) {
+      if ((dirs[ix].count >= low) && (dirs[ix].count <= high)) {
+        group.push_back(&dirs[ix]);
+        entries += dirs[ix].count;
+        largest = std::max(largest, dirs[ix].count);
+      }
+    }
+    if (group.empty()) {
+      low = high + 1;
+      continue;
+    }
+
+    auto average = std::max<size_t>(1, entries / group.size());
+    auto wanted = std::min(kMaxProbes, kMaxCompares / average);
+    auto stride = std::max<size_t>(1, entries / wanted);
+    std::vector<Probe> probes;
+    size_t seen = 0;
+    for (auto dir : group) {
+      auto index = dir->index.Get(header);
+      for (DWORD ix = 0; ix != dir->count; ++ix, ++seen) {
+        if (seen % stride)
+          continue;
+        WIN32_FIND_DATA w32fd;
+        ReadNode(header, index[ix], &w32fd);
+        Probe probe = {dir, w32fd.cFileName, ToUtf8(w32fd.cFileName)};
+        probes.push_back(probe);
+      }
+    }
+    std::shuffle(probes.begin(), probes.end(), random);
+
+    auto sorted = TimeLookups(probes, [header](const Probe& probe) {
+      return GetLeaf(header, probe);
+    });
+    auto walk = TimeLookups(probes, [header](const Probe& probe) {
+      return WalkLeaf(header, probe);
+    });
+    Report("ffs: %u dirs with %u to %u entries: %.0f ns per lookup, %.0f ns walking\n",
+           DWORD(group.size()), low, largest, sorted, walk);
+    low = high + 1;
+  }
+
+  // Whole paths in both encodings, one of which is converted on each lookup.
+  std::vector<std::wstring> paths;
+  std::vector<std::string> utf8_paths;
+  ULONGLONG newest = 0;
+  SamplePaths(header, kMaxProbes, &paths, &utf8_paths, &newest);
+  std::vector<WideView> wide_views;
+  std::vector<Utf8View> utf8_views;
+  for (size_t ix = 0; ix != paths.size(); ++ix) {
+    // The longer ones are converted on the heap.
+    if (paths[ix].size() > kLookupStackUnits || utf8_paths[ix].size() > kLookupStackUnits)
+      continue;
+    wide_views.push_back(paths[ix]);
+    utf8_views.push_back(utf8_paths[ix]);
+  }
+#if defined(FFS_COUNT_ALLOCATIONS)
+  auto before_wide = allocations.load();
+#endif
+  auto wide_ns = TimeLookups(wide_views, [header](WideView path) {
+    return GetNode(header, path);
+  });
+#if defined(FFS_COUNT_ALLOCATIONS)
+  auto before_utf8 = allocations.load();
+#endif
+  auto utf8_ns = TimeLookups(utf8_views, [header](Utf8View path) {
+    return GetNode(header, path);
+  });
+  Report("ffs: %u path lookups: %.0f ns wide and %.0f ns utf-8\n",
+         DWORD(wide_views.size()), wide_ns, utf8_ns);
+#if defined(FFS_COUNT_ALLOCATIONS)
+  auto after = allocations.load();
+  Report("ffs: %u and %u allocations in the lookups\n", DWORD(before_utf8 - before_wide),
+         DWORD(after - before_utf8));
+  if (after != before_wide)
+    __debugbreak();
+#endif
+  Report("ffs: same paths in batches: %.0f ns wide and %.0f ns utf-8\n",
+         TimeBatches(header, wide_views), TimeBatches(header, utf8_views));
+
+  ReportDirReads(header);
+
+  // Indexes the directories again one at a time in a copy of the section, starting from the
+  // smallest table, so every growth of the index is in the time. The copy has room for all the
+  // tables it grows through, as AllocateBlock() hands them out. Same for the nodes with the leaf
+  // index.
+  FFS_Offset tables_size = DirSlotsSize(16) + 8;
+  for (DWORD slots = 32; slots <= DirSlotCount(header->dir_count); slots *= 2)
+    tables_size += BlockSize(DirSlotsSize(slots));
+  if (header->leaf_slots) {
+    tables_size += LeafSlotsSize(16) + 8;
+    for (DWORD slots = 32; slots <= LeafSlotCount(header->num_nodes); slots *= 2)
+      tables_size += BlockSize(LeafSlotsSize(slots));
+  }
+  auto size = size_t(header->used + tables_size + 8);
+  std::vector<ULONGLONG> copy_mem((size + 7) / 8);
+  auto copy = reinterpret_cast<FFS_Header*>(copy_mem.data());
+  memcpy(copy, header, size_t(header->used));
+  // The lookups below go to the index even if the section is frozen.
+  copy->frozen_dirs.key_count = 0;
+  copy->frozen_leaves.key_count = 0;
+  auto first = (copy->used + 7) & ~FFS_Offset(7);
+  InitDirSlots(reinterpret_cast<FFS_DirSlots*>(reinterpret_cast<BYTE*>(copy) + first), 16);
+  copy->dir_slots = first;
+  copy->used = first + DirSlotsSize(16);
+  auto before = NowUs();
+  for (DWORD ix = 0; ix != copy->dir_count; ++ix) {
+    if (!IndexDir(copy, size, copy->dir_table + FFS_Offset(ix) * sizeof(FFS_Dir))) {
+      Report("ffs: the copy has no room to index the directories again\n");
+      return;
+    }
+  }
+  auto add_ns = (NowUs() - before) * 1000.0 / double(copy->dir_count);
+  auto copy_dirs = copy->dir_table.Get(copy);
+  for (DWORD ix = 0; ix != copy->dir_count; ++ix) {
+    DirCandidates candidates(copy, copy_dirs[ix].hash);
+    auto dir = candidates.Next();
+    while (dir && (dir != &copy_dirs[ix]))
+      dir = candidates.Next();
+    if (!dir)
+      __debugbreak();
+  }
+  Report("ffs: %u dirs indexed one at a time: %.0f ns each, growing from 16 to %u slots\n",
+         copy->dir_count, add_ns, copy->dir_slots.Get(copy)->slot_count);
+  if (!header->leaf_slots)
+    return;
+
+  std::vector<Leaf> leaves;
+  for (DWORD ix = 0; ix != copy->dir_count; ++ix) {
+    for (DWORD entry = 0; entry != copy_dirs[ix].count; ++entry)
+      leaves.push_back(ReadLeaf(copy, &copy_dirs[ix], entry));
+  }
+  first = (copy->used + 7) & ~FFS_Offset(7);
+  InitLeafSlots(reinterpret_cast<FFS_LeafSlots*>(reinterpret_cast<BYTE*>(copy) + first), 16);
+  copy->leaf_slots = first;
+  copy->used = first + LeafSlotsSize(16);
+  before = NowUs();
+  for (auto& leaf : leaves) {
+    if (!IndexLeaf(copy, size, leaf.dir, leaf.node, leaf.name_hash)) {
+      Report("ffs: the copy has no room to index the nodes again\n");
+      return;
+    }
+  }
+  add_ns = (NowUs() - before) * 1000.0 / double(leaves.size());
+  for (auto& leaf : leaves) {
+    LeafCandidates candidates(copy, leaf.dir, leaf.name_hash);
+    auto node = candidates.Next();
+    while (node && (node != leaf.node))
+      node = candidates.Next();
+    if (!node)
+      __debugbreak();
+  }
+  Report("ffs: %u nodes indexed one at a time: %.0f ns each, growing from 16 to %u slots\n",
+         DWORD(leaves.size()), add_ns, copy->leaf_slots.Get(copy)->slot_count);
+}
+
+void BenchmarkLayouts(const wchar_t* top_dir, const ScanOptions& options) {
+  struct Variant {
+    const char* name;
+    DWORD layout;
+    DWORD names;
+    DWORD fields;
+    bool leaf_index;
+  };
+  const Variant kVariants[] = {
+    {"records", FFS_kLayoutRecords, FFS_kNamesWide, FFS_kAllFields, false},
+    {"leaf indexed records", FFS_kLayoutRecords, FFS_kNamesWide, FFS_kAllFields, true},
+    {"columns", FFS_kLayoutColumns, FFS_kNamesWide, FFS_kAllFields, false},
+    {"client fields columns", FFS_kLayoutColumns, FFS_kNamesWide, FFS_kClientFields, false},
+#if !defined(_WIN32)
+    {"utf-8 columns", FFS_kLayoutColumns, FFS_kNamesUtf8, FFS_kAllFields, false},
+    {"leaf indexed utf-8 columns", FFS_kLayoutColumns, FFS_kNamesUtf8, FFS_kAllFields, true},
+    {"front coded columns", FFS_kLayoutColumns, FFS_kNamesFrontCoded, FFS_kAllFields, false},
+    {"client fields utf-8 columns", FFS_kLayoutColumns, FFS_kNamesUtf8, FFS_kClientFields,
+     false},
+#endif
+  };
+  const size_t kProbes = 100 * 1000;
+
+  // The paths to look up are the same for all the layouts, taken from the first one.
+  std::vector<std::wstring> paths;
+  std::vector<std::string> utf8_paths;
+  ULONGLONG newest = 0;
+  for (auto& variant : kVariants) {
+    std::unique_ptr<BYTE[]> section(new BYTE[kMaxSharedSize]);
+    auto header = reinterpret_cast<const FFS_Header*>(section.get());
+    ScanOptions pass = options;
+    pass.layout = variant.layout;
+    pass.names = variant.names;
+    pass.fields = variant.fields;
+    pass.leaf_index = variant.leaf_index;
+    auto before = NowUs();
+    if (!CreateFFS(section.get(), kMaxSharedSize, top_dir, pass))
+      __debugbreak();
+    auto scan_ms = (NowUs() - before) / 1000.0;
+
+    // The newest time among the paths is so the scan below finds a handful of nodes.
+    if (paths.empty())
+      SamplePaths(header, kProbes, &paths, &utf8_paths, &newest);
+    auto lookup_ns = TimePaths(header, paths, utf8_paths);
+
+    std::vector<DWORD> modified;
+    size_t scans = 0;
+    before = NowUs();
+    double elapsed;
+    do {
+      modified.clear();
+      FindModifiedAfter(header, newest, &modified);
+      ++scans;
+      elapsed = NowUs() - before;
+    } while (elapsed < kMinRunUs);
+
+    Report("ffs: %s layout: %llu bytes, scan %.0f ms, %.0f ns per path lookup, "
+           "%.2f ms to find %u modified nodes\n", variant.name, (unsigned long long)header->used,
+           scan_ms, lookup_ns, elapsed / 1000.0 / double(scans), DWORD(modified.size()));
+    if (header->layout == FFS_kLayoutColumns) {
+      auto& columns = header->columns;
+      Report("ffs: %.1f bytes per node of fields and links, %.1f of everything\n",
+             double(columns.name_pool - columns.attributes) / double(columns.count),
+             double(header->used) / double(columns.count));
+    }
+    if (HasUtf8Names(header) && (header->columns.names == FFS_kNamesFrontCoded)) {
+      Report("ffs: %u nodes, %u bytes of front coded names with a restart every %u\n",
+             header->columns.count - 1, header->columns.name_pool_size,
+             header->columns.restart_interval);
+    } else if (header->layout == FFS_kLayoutColumns) {
+      Report("ffs: %u distinct names for %u nodes, %u bytes of names and %u of name table\n",
+             header->columns.name_count, header->columns.count - 1,
+             DWORD(header->columns.name_pool_size *
+                   (HasUtf8Names(header) ? 1 : sizeof(wchar_t))),
+             DWORD(header->columns.name_table_size * sizeof(FFS_NameSlot)));
+    }
+  }
+}
+
+void BenchmarkHashes(const FFS_Header* header) {
+  // The names of all the nodes and the paths of all the directories.
+  std::vector<std::wstring> names;
+  std::vector<std::wstring> paths;
+  auto dirs = header->dir_table.Get(header);
+  WIN32_FIND_DATA w32fd;
+  for (DWORD ix = 0; ix != header->dir_count; ++ix) {
+    auto index = dirs[ix].index.Get(header);
+    for (DWORD entry = 0; entry != dirs[ix].count; ++entry) {
+      ReadNode(header, index[entry], &w32fd);
+      names.push_back(w32fd.cFileName);
+    }
+    std::wstring path;
+    ReadNode(header, dirs[ix].anchor, &w32fd);
+    for (auto node = w32fd.dwReserved0; node; node = w32fd.dwReserved0) {
+      ReadNode(header, node, &w32fd);
+      path = path.empty() ? std::wstring(w32fd.cFileName) :
+                            std::wstring(w32fd.cFileName) + kPathSep + path;
+    }
+    paths.push_back(path);
+  }
+  std::vector<std::string> utf8_names;
+  for (auto& name : names)
+    utf8_names.push_back(ToUtf8(name));
+  std::vector<std::string> utf8_paths;
+  for (auto& path : paths)
+    utf8_paths.push_back(ToUtf8(path));
+
+  struct Policy {
+    const char* name;
+    DWORD policy;
+  };
+  const Policy kPolicies[] = {
+    {"fnv-1a", FFS_kHashFnv1a},
+    {"wy", FFS_kHashWy},
+    {"crc32c", FFS_kHashCrc32c},
+  };
+  Report("ffs: crc32c %s the crc32 instruction\n",
+         HasCrc32Instruction() ? "with" : "without");
+  for (auto& policy : kPolicies) {
+    ReportHashes(policy.name, policy.policy, "wide", names, paths);
+    ReportHashes(policy.name, policy.policy, "utf-8", utf8_names, utf8_paths);
+  }
+}
+
+void BenchmarkFreeze(const FFS_Header* header) {
+  const size_t kProbes = 100 * 1000;
+
+  // The perfect hashes go in a copy of the section, unfrozen first if it is frozen already. They
+  // take a slot and about a byte of pilots per key.
+  DWORD leaf_count = header->leaf_slots ? header->leaf_slots.Get(header)->leaf_count : 0;
+  auto extra = FFS_Offset(header->dir_count) * (sizeof(FFS_DirSlot) + 1) +
+               FFS_Offset(leaf_count) * (sizeof(FFS_LeafSlot) + 1);
+  auto size = size_t(header->used + extra + 64);
+  std::vector<ULONGLONG> copy_mem((size + 7) / 8);
+  auto copy = reinterpret_cast<FFS_Header*>(copy_mem.data());
+  memcpy(copy, header, size_t(header->used));
+  copy->frozen_dirs.key_count = 0;
+  copy->frozen_leaves.key_count = 0;
+  copy->status = FFS_kFinished;
+  auto used = copy->used;
+  auto before = NowUs();
+  if (!FreezeFFS(copy, size))
+    __debugbreak();
+  auto freeze_ms = (NowUs() - before) / 1000.0;
+
+  auto& frozen_dirs = copy->frozen_dirs;
+  auto& frozen_leaves = copy->frozen_leaves;
+  DWORD shared_dirs = 0;
+  auto dir_slots = FFS_OffsetPtr<FFS_DirSlot>{frozen_dirs.slots}.Get(copy);
+  for (DWORD ix = 0; ix != frozen_dirs.key_count; ++ix)
+    shared_dirs += DirSlotOffset(dir_slots[ix].packed) ? 0 : 1;
+  DWORD shared_leaves = 0;
+  auto leaf_slots = FFS_OffsetPtr<FFS_LeafSlot>{frozen_leaves.slots}.Get(copy);
+  for (DWORD ix = 0; ix != frozen_leaves.key_count; ++ix)
+    shared_leaves += leaf_slots[ix].node ? 0 : 1;
+  auto keys = frozen_dirs.key_count + frozen_leaves.key_count;
+  Report("ffs: froze %u dir hashes and %u leaf hashes in %.1f ms, %.2f bytes per key, "
+         "%u and %u of them shared\n", frozen_dirs.key_count, frozen_leaves.key_count,
+         freeze_ms, double(copy->used - used) / double(std::max<DWORD>(1, keys)), shared_dirs,
+         shared_leaves);
+
+  // Every directory, a sample of the leaves and a sample of the paths, looked up through the
+  // index and then through the perfect hashes of the same copy.
+  std::mt19937 random(1543);
+  auto copy_dirs = copy->dir_table.Get(copy);
+  std::vector<const FFS_Dir*> dirs;
+  for (DWORD ix = 0; ix != copy->dir_count; ++ix)
+    dirs.push_back(&copy_dirs[ix]);
+  std::shuffle(dirs.begin(), dirs.end(), random);
+  std::vector<Leaf> leaves;
+  for (size_t probe = 0; leaf_count && (probe != kProbes); ++probe) {
+    auto dir = &copy_dirs[random() % copy->dir_count];
+    if (dir->count)
+      leaves.push_back(ReadLeaf(copy, dir, DWORD(random() % dir->count)));
+  }
+  std::vector<std::wstring> paths;
+  std::vector<std::string> utf8_paths;
+  ULONGLONG newest = 0;
+  SamplePaths(copy, kProbes, &paths, &utf8_paths, &newest);
+
+  auto find_dir = [copy](const FFS_Dir* wanted) {
+    DirCandidates candidates(copy, wanted->hash);
+    auto dir = candidates.Next();
+    while (dir && (dir != wanted))
+      dir = candidates.Next();
+    return dir;
+  };
+  auto find_leaf = [copy](const Leaf& leaf) {
+    LeafCandidates candidates(copy, leaf.dir, leaf.name_hash);
+    auto node = candidates.Next();
+    while (node && (node != leaf.node))
+      node = candidates.Next();
+    return node;
+  };
+  double dir_ns[2];
+  double leaf_ns[2] = {};
+  double path_ns[2];
+  const DWORD key_counts[2][2] = {
+    {0, 0},
+    {frozen_dirs.key_count, frozen_leaves.key_count},
+  };
+  for (int frozen = 0; frozen != 2; ++frozen) {
+    frozen_dirs.key_count = key_counts[frozen][0];
+    frozen_leaves.key_count = key_counts[frozen][1];
+    dir_ns[frozen] = TimeLookups(dirs, find_dir);
+    if (!leaves.empty())
+      leaf_ns[frozen] = TimeLookups(leaves, find_leaf);
+    path_ns[frozen] = TimePaths(copy, paths, utf8_paths);
+  }
+  Report("ffs: dir by hash %.0f ns with the index, %.0f ns frozen\n", dir_ns[0], dir_ns[1]);
+  if (!leaves.empty()) {
+    Report("ffs: leaf by hash %.0f ns with the index, %.0f ns frozen\n", leaf_ns[0],
+           leaf_ns[1]);
+  }
+  Report("ffs: %.0f ns per path lookup with the index, %.0f ns frozen\n", path_ns[0],
+         path_ns[1]);
+}
+
+void BenchmarkGenerations(const FFS_Header* header) {
+  // Few nodes, so that the writer keeps coming back to the ones the readers are on.
+  const size_t kNodes = 64;
+  const double kRunUs = 10 * kMinRunUs;
+
+  std::vector<ULONGLONG> copy_mem(size_t(header->used + 7) / 8);
+  auto copy = reinterpret_cast<FFS_Header*>(copy_mem.data());
+  memcpy(copy, header, size_t(header->used));
+  std::vector<std::wstring> paths;
+  std::vector<std::string> utf8_paths;
+  ULONGLONG newest = 0;
+  SamplePaths(copy, kNodes, &paths, &utf8_paths, &newest);
+  struct Target {
+    FFS_Dir* dir;
+    DWORD node;
+  };
+  std::vector<Target> targets;
+  for (auto& path : paths) {
+    const FFS_Dir* dir = nullptr;
+    auto node = GetNode(copy, path, &dir);
+    if (!node)
+      __debugbreak();
+    Target target = {const_cast<FFS_Dir*>(dir), node};
+    targets.push_back(target);
+    SetStressFields(copy, target.dir, target.node, 0);
+  }
+
+  // One writer that never stops, and the readers on the other cores, or one that takes turns
+  // with it on a single core. The first pass reads the nodes without the generations, to show
+  // that the test does catch the torn reads where the host lets them happen.
+  auto reader_count = std::max(2U, std::thread::hardware_concurrency()) - 1;
+  auto utf8 = HasUtf8Names(copy);
+  for (int consistent = 0; consistent != 2; ++consistent) {
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> reads(0);
+    std::atomic<size_t> torn(0);
+    ULONGLONG writes = 0;
+    std::thread writer([&]() {
+      std::mt19937 random(1543);
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto& target = targets[random() % targets.size()];
+        // Both halves of each field change on every write.
+        SetStressFields(copy, target.dir, target.node, ++writes * 0x100000001ULL);
+      }
+    });
+    std::vector<std::thread> readers;
+    for (unsigned ix = 0; ix != reader_count; ++ix) {
+      readers.emplace_back([&]() {
+        size_t local_reads = 0;
+        size_t local_torn = 0;
+        WIN32_FIND_DATA w32fd;
+        while (!stop.load(std::memory_order_relaxed)) {
+          for (size_t node = 0; node != targets.size(); ++node) {
+            if (!consistent)
+              ReadNode(copy, targets[node].node, &w32fd);
+            else if ((utf8 ? ReadPath(copy, Utf8View(utf8_paths[node]), &w32fd) :
+                             ReadPath(copy, paths[node], &w32fd)) != kPathRead)
+              __debugbreak();
+            local_torn += IsTorn(w32fd) ? 1 : 0;
+          }
+          local_reads += targets.size();
+        }
+        reads += local_reads;
+        torn += local_torn;
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(ULONGLONG(kRunUs)));
+    stop = true;
+    writer.join();
+    for (auto& reader : readers)
+      reader.join();
+    if (consistent && torn)
+      __debugbreak();
+    auto read_ns = kRunUs * 1000.0 * reader_count / double(std::max<size_t>(1, reads));
+    Report("ffs: %s: %llu reads on %u threads, %.0f ns each, %llu torn, under %llu writes\n",
+           consistent ? "ReadPath()" : "ReadNode() without the generations",
+           (unsigned long long)reads, reader_count, read_ns, (unsigned long long)torn,
+           (unsigned long long)writes);
+  }
+}
+
+void BenchmarkUpdates(const FFS_Header* header) {
+  const size_t kSamples = 1024;
+  const size_t kTargets = 64;
+  const double kRunUs = 10 * kMinRunUs;
+  // Reclaim() ends a batch of changes, like a batch of notifications in the server.
+  const size_t kBatch = 16;
+
+  // The copy has room for the nodes added back, on top of what its indexes can grow into.
+  auto size = size_t(header->used) + 16 * 1024 * 1024;
+  std::vector<ULONGLONG> copy_mem((size + 7) / 8);
+  auto copy = reinterpret_cast<FFS_Header*>(copy_mem.data());
+  memcpy(copy, header, size_t(header->used));
+  for (auto& slot : copy->clients)
+    slot = FFS_ClientSlot();
+  std::vector<std::wstring> paths;
+  std::vector<std::string> utf8_paths;
+  ULONGLONG newest = 0;
+  SamplePaths(copy, kSamples, &paths, &utf8_paths, &newest);
+
+  // The writer removes and adds back files, which leaves the other paths where they are.
+  struct Target {
+    std::wstring path;
+    std::string utf8_path;
+    WIN32_FIND_DATA w32fd;
+  };
+  std::vector<Target> targets;
+  std::vector<size_t> stable;
+  for (size_t ix = 0; ix != paths.size(); ++ix) {
+    auto is_target = std::any_of(targets.begin(), targets.end(), [&](const Target& target) {
+      return target.path == paths[ix];
+    });
+    Target target = {paths[ix], utf8_paths[ix]};
+    ReadNode(copy, GetNode(copy, paths[ix]), &target.w32fd);
+    if (!is_target && (targets.size() != kTargets) &&
+        !(target.w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+      targets.push_back(target);
+    else if (!is_target)
+      stable.push_back(ix);
+  }
+  if (targets.empty() || stable.empty())
+    return;
+
+  auto reader_count = std::max(2U, std::thread::hardware_concurrency()) - 1;
+  auto utf8 = HasUtf8Names(copy);
+  auto used = copy->used;
+  std::atomic<bool> stop(false);
+  std::atomic<size_t> reads(0);
+  std::atomic<size_t> mismatches(0);
+  ULONGLONG removes = 0;
+  ULONGLONG adds = 0;
+  Updater updater(copy, size);
+  std::thread writer([&]() {
+    std::mt19937 random(1543);
+    std::vector<bool> present(targets.size(), true);
+    for (size_t op = 1; !stop.load(std::memory_order_relaxed); ++op) {
+      auto pick = random() % targets.size();
+      auto& target = targets[pick];
+      if (present[pick]) {
+        present[pick] = !updater.RemoveNode(target.path);
+        removes += present[pick] ? 0 : 1;
+      } else {
+        // Only the records take new nodes, the columns stay without.
+        present[pick] = updater.AddNode(target.path, target.w32fd);
+        adds += present[pick] ? 1 : 0;
+      }
+      if (!(op % kBatch))
+        updater.Reclaim();
+    }
+  });
+  // Each reader checks that what it finds is the node it looked up, which it would not be if the
+  // server had reused memory the reader was still in.
+  std::vector<std::thread> readers;
+  for (unsigned ix = 0; ix != reader_count; ++ix) {
+    readers.emplace_back([&]() {
+      auto slot = JoinEpochs(copy);
+      if (slot == kNoEpochSlot)
+        __debugbreak();
+      size_t local_reads = 0;
+      size_t local_mismatches = 0;
+      WIN32_FIND_DATA w32fd;
+      auto read = [&](size_t ix) {
+        return (utf8 ? ReadPath(copy, Utf8View(utf8_paths[ix]), &w32fd) :
+                       ReadPath(copy, paths[ix], &w32fd)) == kPathRead;
+      };
+      auto named = [&](const std::wstring& path) {
+        auto name = path.substr(path.rfind(kPathSep) + 1);
+        return name == w32fd.cFileName;
+      };
+      while (!stop.load(std::memory_order_relaxed)) {
+        EnterEpoch(copy, slot);
+        for (auto ix : stable) {
+          if (!read(ix) || !named(paths[ix]))
+            ++local_mismatches;
+        }
+        ExitEpoch(copy, slot);
+        EnterEpoch(copy, slot);
+        for (auto& target : targets) {
+          auto found = utf8 ? ReadPath(copy, Utf8View(target.utf8_path), &w32fd) :
+                              ReadPath(copy, target.path, &w32fd);
+          if ((found == kPathRead) &&
+              (!named(target.path) || (w32fd.nFileSizeLow != target.w32fd.nFileSizeLow)))
+            ++local_mismatches;
+        }
+        ExitEpoch(copy, slot);
+        local_reads += stable.size() + targets.size();
+      }
+      LeaveEpochs(copy, slot);
+      reads += local_reads;
+      mismatches += local_mismatches;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::microseconds(ULONGLONG(kRunUs)));
+  stop = true;
+  writer.join();
+  for (auto& reader : readers)
+    reader.join();
+  if (mismatches)
+    __debugbreak();
+  updater.Reclaim();
+  auto ops = removes + adds;
+  Report("ffs: %llu removes and %llu adds, %.0f ns each, under %llu reads on %u threads\n",
+         (unsigned long long)removes, (unsigned long long)adds,
+         kRunUs * 1000.0 / double(std::max<ULONGLONG>(1, ops)), (unsigned long long)reads,
+         reader_count);
+  Report("ffs: %.1f MB reused, %.1f MB still retired, the section grew by %.1f MB, "
+         "%llu mismatches\n",
+         double(updater.reused_bytes()) / 1e6, double(updater.retired_bytes()) / 1e6,
+         double(copy->used - used) / 1e6, (unsigned long long)mismatches.load());
+}
+
+void BenchmarkModified(const FFS_Header* header) {
+  const size_t kEvents = 10000;
+
+  std::vector<ULONGLONG> copy_mem(size_t(header->used + 7) / 8);
+  auto copy = reinterpret_cast<FFS_Header*>(copy_mem.data());
+  memcpy(copy, header, size_t(header->used));
+  std::vector<std::wstring> paths;
+  std::vector<std::string> utf8_paths;
+  ULONGLONG newest = 0;
+  SamplePaths(copy, kEvents, &paths, &utf8_paths, &newest);
+  // A path sampled twice would only be stale, and written, the first time.
+  std::set<std::wstring> sampled;
+  size_t unique = 0;
+  for (size_t ix = 0; ix != paths.size(); ++ix) {
+    if (!sampled.insert(paths[ix]).second)
+      continue;
+    paths[unique].swap(paths[ix]);
+    utf8_paths[unique].swap(utf8_paths[ix]);
+    ++unique;
+  }
+  paths.resize(unique);
+  utf8_paths.resize(unique);
+  if (paths.empty())
+    return;
+
+  // The stat alone, which every notification pays, whatever the section does with it.
+  WIN32_FIND_DATA w32fd;
+  auto before = NowUs();
+  for (auto& path : paths)
+    StatPath(path, &w32fd);
+  auto stat_ns = (NowUs() - before) * 1000.0 / double(paths.size());
+
+  // Each event is what the server does for a modified notification, see UpdateModified(): the
+  // lookup, the stat, and the write unless nothing changed. The first pass has the files as the
+  // scan saw them, so nothing is written. Before the second the write times in the section are
+  // set back, so every event writes, and is checked through ReadPath() once it is visible.
+  auto utf8 = HasUtf8Names(copy);
+  for (int stale = 0; stale != 2; ++stale) {
+    if (stale) {
+      for (auto& path : paths) {
+        const FFS_Dir* dir = nullptr;
+        auto node = GetNode(copy, path, &dir);
+        ReadNode(copy, node, &w32fd);
+        w32fd.ftLastWriteTime = ToFileTime(0);
+        WriteNodeFields(copy, const_cast<FFS_Dir*>(dir), node, w32fd);
+      }
+    }
+    std::vector<double> latencies;
+    size_t writes = 0;
+    for (size_t ix = 0; ix != paths.size(); ++ix) {
+      auto notified = NowUs();
+      const FFS_Dir* dir = nullptr;
+      auto node = GetNode(copy, paths[ix], &dir);
+      if (!node || !StatPath(paths[ix], &w32fd))
+        continue;
+      bool wrote = RefreshNodeFields(copy, const_cast<FFS_Dir*>(dir), node, w32fd);
+      latencies.push_back((NowUs() - notified) * 1000.0);
+      if (!wrote)
+        continue;
+      ++writes;
+      WIN32_FIND_DATA seen;
+      auto found = utf8 ? ReadPath(copy, Utf8View(utf8_paths[ix]), &seen) :
+                          ReadPath(copy, paths[ix], &seen);
+      if ((found != kPathRead) || (ToULL(seen.ftLastWriteTime) != ToULL(w32fd.ftLastWriteTime)))
+        __debugbreak();
+    }
+    if (latencies.empty())
+      return;
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (auto latency : latencies)
+      total += latency;
+    Report("ffs: %u modified events %s, %u written: %.0f ns on average from the notification to "
+           "the clients, %.0f ns at the median, %.0f ns at p99\n", DWORD(latencies.size()),
+           stale ? "with stale fields" : "with the fields as scanned", DWORD(writes),
+           total / double(latencies.size()), latencies[latencies.size() / 2],
+           latencies[latencies.size() * 99 / 100]);
+  }
+  Report("ffs: of which %.0f ns is the stat\n", stat_ns);
+}
+
+void BenchmarkAllocator(const FFS_Header* header) {
+  const size_t kMaxBlocks = 200000;
+  const size_t kLargeBlocks = 256;
+  const FFS_Offset kMaxLargeBlock = 256 * 1024;
+  const size_t kChurnStep = 10000;
+
+  // The small blocks have the sizes the server allocates for the section: a record per node, as
+  // big as its name, and a listing per directory.
+  std::vector<FFS_Offset> sizes;
+  auto dirs = header->dir_table.Get(header);
+  WIN32_FIND_DATA w32fd;
+  for (DWORD dir = 0; (dir != header->dir_count) && (sizes.size() < kMaxBlocks); ++dir) {
+    sizes.push_back(FFS_Offset(sizeof(FFS_Dir)) + FFS_Offset(dirs[dir].count) * sizeof(DWORD));
+    auto index = dirs[dir].index.Get(header);
+    for (DWORD entry = 0; (entry != dirs[dir].count) && (sizes.size() < kMaxBlocks); ++entry) {
+      ReadNode(header, index[entry], &w32fd);
+      sizes.push_back(FFS_Offset(offsetof(WIN32_FIND_DATA, cFileName) +
+                                 (wcslen(w32fd.cFileName) + 1) * sizeof(wchar_t)));
+    }
+  }
+  std::mt19937 random(2087);
+  std::shuffle(sizes.begin(), sizes.end(), random);
+  std::vector<FFS_Offset> large_sizes;
+  while (large_sizes.size() != kLargeBlocks)
+    large_sizes.push_back(kMaxSmallBlock + 8 + random() % (kMaxLargeBlock - kMaxSmallBlock));
+
+  // Each pass gets an empty section twice as big as its blocks.
+  auto live_bytes = [](const std::vector<FFS_Offset>& blocks) {
+    FFS_Offset total = 0;
+    for (auto bytes : blocks)
+      total += BlockSize(bytes);
+    return total;
+  };
+  std::vector<ULONGLONG> section_mem;
+  auto empty_section = [&](const std::vector<FFS_Offset>& blocks, size_t* size) {
+    *size = sizeof(FFS_Header) + size_t(live_bytes(blocks)) * 2;
+    section_mem.assign((*size + 7) / 8, 0);
+    auto section = reinterpret_cast<FFS_Header*>(section_mem.data());
+    section->used = sizeof(FFS_Header);
+    return section;
+  };
+
+  // Allocates all the blocks from the bump region, frees them in another order and allocates
+  // them again from the free lists.
+  size_t size = 0;
+  std::vector<FFS_Offset> offsets(sizes.size());
+  std::vector<size_t> order(sizes.size());
+  for (size_t ix = 0; ix != order.size(); ++ix)
+    order[ix] = ix;
+  std::shuffle(order.begin(), order.end(), random);
+  double bump_us = 0;
+  double free_us = 0;
+  double reuse_us = 0;
+  FFS_Offset bump_used = 0;
+  FFS_Offset reuse_used = 0;
+  size_t rounds = 0;
+  do {
+    auto section = empty_section(sizes, &size);
+    auto start = NowUs();
+    for (size_t ix = 0; ix != sizes.size(); ++ix)
+      offsets[ix] = AllocateBlock(section, size, sizes[ix], kAnyOffset);
+    auto allocated = NowUs();
+    bump_used = section->used;
+    for (auto ix : order)
+      FreeBlock(section, offsets[ix], BlockSize(sizes[ix]));
+    auto freed = NowUs();
+    for (size_t ix = 0; ix != sizes.size(); ++ix)
+      offsets[ix] = AllocateBlock(section, size, sizes[ix], kAnyOffset);
+    reuse_us += NowUs() - freed;
+    free_us += freed - allocated;
+    bump_us += allocated - start;
+    reuse_used = section->used;
+    if (std::find(offsets.begin(), offsets.end(), 0) != offsets.end())
+      __debugbreak();
+    ++rounds;
+  } while (bump_us + free_us + reuse_us < kMinRunUs);
+  auto per_block = [&](double us) { return us * 1000.0 / double(rounds * sizes.size()); };
+  Report("ffs: %u small blocks of %.1f MB: %.1f ns per allocation from the bump region, %.1f ns "
+         "per free, %.1f ns per allocation from the free lists, the section grew by %.1f MB "
+         "the second time\n", DWORD(sizes.size()), double(live_bytes(sizes)) / 1e6,
+         per_block(bump_us), per_block(free_us), per_block(reuse_us),
+         double(reuse_used - bump_used) / 1e6);
+
+  // The steady state of the server: a block is freed and another of a random size allocated, so
+  // the live memory stays about the same and the free lists have to cover the sizes that change.
+  auto churn = [&](const char* what, std::vector<FFS_Offset>* blocks) {
+    const std::vector<FFS_Offset> pool(*blocks);
+    auto section = empty_section(*blocks, &size);
+    std::vector<FFS_Offset> block_offsets(blocks->size());
+    for (size_t ix = 0; ix != blocks->size(); ++ix)
+      block_offsets[ix] = AllocateBlock(section, size, (*blocks)[ix], kAnyOffset);
+    ULONGLONG pairs = 0;
+    auto start = NowUs();
+    do {
+      for (size_t step = 0; step != kChurnStep; ++step) {
+        auto ix = random() % blocks->size();
+        FreeBlock(section, block_offsets[ix], BlockSize((*blocks)[ix]));
+        (*blocks)[ix] = pool[random() % pool.size()];
+        block_offsets[ix] = AllocateBlock(section, size, (*blocks)[ix], kAnyOffset);
+        if (!block_offsets[ix])
+          __debugbreak();
+      }
+      pairs += kChurnStep;
+    } while (NowUs() - start < kMinRunUs);
+    auto churn_ns = (NowUs() - start) * 1000.0 / double(pairs);
+    // The same with the heap of the process, for reference.
+    std::vector<std::unique_ptr<BYTE[]>> heap(blocks->size());
+    for (size_t ix = 0; ix != blocks->size(); ++ix)
+      heap[ix].reset(new BYTE[size_t((*blocks)[ix])]);
+    auto heap_start = NowUs();
+    for (ULONGLONG pair = 0; pair != pairs; ++pair) {
+      auto ix = random() % blocks->size();
+      heap[ix].reset();
+      heap[ix].reset(new BYTE[size_t(pool[random() % pool.size()])]);
+    }
+    auto heap_ns = (NowUs() - heap_start) * 1000.0 / double(pairs);
+    Report("ffs: %s: %.1f ns per free and allocation, %.1f ns with the heap; the section has "
+           "%.1f MB for %.1f MB of live blocks and %.1f MB in the free lists\n", what, churn_ns,
+           heap_ns, double(section->used - sizeof(FFS_Header)) / 1e6,
+           double(live_bytes(*blocks)) / 1e6, double(section->free_lists.free_bytes) / 1e6);
+  };
+  churn("small blocks", &sizes);
+  churn("large blocks", &large_sizes);
+}
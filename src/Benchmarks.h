@@ -0,0 +1,54 @@
+#pragma once
+
+// Microbenchmarks of the section, run by the servers with the --bench-* switches. The results
+// go to stdout, or to the debugger output on Windows.
+
+struct FFS_Header;
+struct ScanOptions;
+
+// Times GetLeaf() on the directories of |header|, grouped by their number of entries, against
+// a walk of the sibling list, times GetNode() in both encodings and, in the bench build, checks
+// that it does not allocate, times GetNodes() on the same paths, counts the directories the
+// directory index reads per lookup, and times the adds to the directory index and the leaf index.
+void BenchmarkLookups(const FFS_Header* header);
+
+// Builds the section for |top_dir| with each layout, with UTF-8 names on Linux and with the leaf
+// index, and compares their size, the time of GetNode() and the time of FindModifiedAfter(),
+// which only reads one field of every node.
+void BenchmarkLayouts(const wchar_t* top_dir, const ScanOptions& options);
+
+// Times each FFS_HashPolicy over the names and the directory paths of |header|, both wide and
+// UTF-8, and reports how far each one makes the directory index and the name table probe.
+void BenchmarkHashes(const FFS_Header* header);
+
+// Freezes a copy of |header|, see FreezeFFS(), and reports how long that takes and how much the
+// perfect hashes take, then times the lookups of the directories, of the leaves if there is a
+// leaf index, and of whole paths, through the index and through the perfect hashes.
+void BenchmarkFreeze(const FFS_Header* header);
+
+// Checks the generations under load, see BeginRead(): a thread keeps writing the size and the
+// write time of a few nodes of a copy of |header|, both the same value, while the others read
+// them with ReadPath(), and any read that sees them differ breaks. Reports the reads, and the
+// torn reads of a pass that reads the nodes without the generations.
+void BenchmarkGenerations(const FFS_Header* header);
+
+// Checks the epochs under load, see Epoch.h: a thread keeps removing and adding back files of a
+// copy of |header| through an Updater, while the others look up those files and others with
+// ReadPath() inside epochs, and any read that finds another node than the one it looked up
+// breaks. Reports the time of the changes and how much of the memory they retired was reused.
+// The columns have no room for new nodes, so with them the files are only removed.
+void BenchmarkUpdates(const FFS_Header* header);
+
+// Times what the server does for a notification that a file was modified, see UpdateModified(),
+// on a copy of |header|: the lookup, the stat, and the write of the fields when they changed. The
+// events, on distinct paths, are timed one by one from the notification to the clients seeing
+// the new fields, once with the fields as the scan left them, which are not written again, and
+// once with stale ones, which all are.
+void BenchmarkModified(const FFS_Header* header);
+
+// Times the allocator of the section, see Allocator.h, on an empty section, with blocks of the
+// sizes of the records and the listings of |header|: allocating them all from the bump region,
+// freeing them and allocating them again from the free lists. Then frees and allocates blocks of
+// random sizes, small ones and large ones, and reports the time of each pair, against the heap,
+// and how much bigger than the live blocks the section got.
+void BenchmarkAllocator(const FFS_Header* header);
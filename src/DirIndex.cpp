@@ -0,0 +1,90 @@
+// The directory index of the section.
+
+#include "stdafx.h"
+
+#include "Allocator.h"
+#include "DirIndex.h"
+
+DWORD DirSlotCount(DWORD dirs) {
+  DWORD slots = 16;
+  while (slots < dirs * 2)
+    slots *= 2;
+  return slots;
+}
+
+FFS_Offset DirSlotsSize(DWORD slot_count) {
+  return sizeof(FFS_DirSlots) + FFS_Offset(slot_count - 1) * sizeof(FFS_DirSlot);
+}
+
+void InitDirSlots(FFS_DirSlots* table, DWORD slot_count) {
+  memset(table, 0, size_t(DirSlotsSize(slot_count)));
+  table->slot_count = slot_count;
+}
+
+void InsertDirSlot(FFS_DirSlots* table, DWORD hash, FFS_Offset dir) {
+  auto mask = table->slot_count - 1;
+  auto slot = hash & mask;
+  while (table->slots[slot].packed)
+    slot = (slot + 1) & mask;
+  // The FFS_Dir has to be written by the time a client sees the slot.
+  StoreRelease(&table->slots[slot].packed, DirSlotFingerprint(hash) | dir);
+  ++table->dir_count;
+}
+
+bool IndexDir(FFS_Header* header, size_t size, FFS_Offset dir) {
+  auto table = header->dir_slots.Get(header);
+  if ((table->dir_count + table->removed_count + 1) * 2 > table->slot_count) {
+    // The new table is filled before it is published, so no client sees it half done. The old
+    // one is left as it is for the clients that are still in it, until the caller retires it.
+    // The clients read it without locks, so the slots of the removed directories cannot be
+    // dropped in place: the new table is the same size when the ones left take a quarter of it
+    // at most, which leaves room for as many more before it is replaced again.
+    auto slot_count = table->slot_count;
+    if ((table->dir_count + 1) * 4 > slot_count)
+      slot_count *= 2;
+    auto offset = AllocateBlock(header, size, DirSlotsSize(slot_count), kAnyOffset);
+    if (!offset)
+      return false;
+    auto rebuilt = reinterpret_cast<FFS_DirSlots*>(reinterpret_cast<BYTE*>(header) + offset);
+    InitDirSlots(rebuilt, slot_count);
+    // The slots only have part of the hash, the rest is in the directories.
+    for (DWORD ix = 0; ix != table->slot_count; ++ix) {
+      FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(table->slots[ix].packed)};
+      if (dir)
+        InsertDirSlot(rebuilt, dir.Get(header)->hash, dir);
+    }
+    StoreRelease(&header->dir_slots.offset, offset);
+    table = rebuilt;
+  }
+  FFS_OffsetPtr<FFS_Dir> added = {dir};
+  InsertDirSlot(table, added.Get(header)->hash, dir);
+  return true;
+}
+
+void ReplaceDir(FFS_Header* header, FFS_Offset old_dir, FFS_Offset new_dir) {
+  auto table = header->dir_slots.Get(header);
+  FFS_OffsetPtr<FFS_Dir> dir = {new_dir};
+  auto fingerprint = DirSlotFingerprint(dir.Get(header)->hash);
+  auto mask = table->slot_count - 1;
+  for (auto slot = dir.Get(header)->hash & mask; table->slots[slot].packed;
+       slot = (slot + 1) & mask) {
+    if (table->slots[slot].packed == (fingerprint | old_dir)) {
+      StoreRelease(&table->slots[slot].packed, fingerprint | new_dir);
+      return;
+    }
+  }
+}
+
+void UnindexDir(FFS_Header* header, DWORD hash, FFS_Offset dir) {
+  auto table = header->dir_slots.Get(header);
+  auto fingerprint = DirSlotFingerprint(hash);
+  auto mask = table->slot_count - 1;
+  for (auto slot = hash & mask; table->slots[slot].packed; slot = (slot + 1) & mask) {
+    if (table->slots[slot].packed == (fingerprint | dir)) {
+      StoreRelease(&table->slots[slot].packed, kDirSlotFingerprintMask);
+      --table->dir_count;
+      ++table->removed_count;
+      return;
+    }
+  }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+// The directory index of the section, see FFS_DirSlots.
+//
+// The server is the only writer. It fills the first table at the end of the scan and then adds
+// the directories it learns about with IndexDir(), which grows the table as needed. The clients
+// only read it, through DirCandidates, and never wait for the server: the table they start with
+// stays valid for as long as they use it.
+
+#include "FastFileStats.h"
+#include "PerfectHash.h"
+#include "Section.h"
+
+// The slots of a table for |dirs| directories, a power of 2 at least twice as many.
+DWORD DirSlotCount(DWORD dirs);
+
+// The bytes of a table of |slot_count| slots.
+FFS_Offset DirSlotsSize(DWORD slot_count);
+
+// Writes an empty table of |slot_count| slots at |table|.
+void InitDirSlots(FFS_DirSlots* table, DWORD slot_count);
+
+const ULONGLONG kDirSlotFingerprintMask = ~((ULONGLONG(1) << FFS_kDirSlotOffsetBits) - 1);
+
+// The fingerprint bits of a slot for a directory with |hash|, see FFS_DirSlot.
+inline ULONGLONG DirSlotFingerprint(DWORD hash) {
+  return (ULONGLONG(hash) >> (32 - (64 - FFS_kDirSlotOffsetBits))) << FFS_kDirSlotOffsetBits;
+}
+
+// The FFS_Dir offset of the slot |packed|.
+inline FFS_Offset DirSlotOffset(ULONGLONG packed) {
+  return FFS_Offset(packed & ((ULONGLONG(1) << FFS_kDirSlotOffsetBits) - 1));
+}
+
+// Adds the FFS_Dir at |dir|, with |hash|, to |table|. The table must stay at most half full.
+void InsertDirSlot(FFS_DirSlots* table, DWORD hash, FFS_Offset dir);
+
+// Adds the FFS_Dir at |dir| to the index of the live section at |header|, which is |size| bytes.
+// A full table is replaced by a new one from AllocateBlock(), without the removed directories,
+// see FFS_DirSlots, and the old one is the caller's to retire. Returns false if there is no room;
+// the directory is not indexed then.
+bool IndexDir(FFS_Header* header, size_t size, FFS_Offset dir);
+
+// Points the slot of the FFS_Dir at |old_dir|, in the directory index of the live section at
+// |header|, to the copy of it at |new_dir|. The clients see the one or the other.
+void ReplaceDir(FFS_Header* header, FFS_Offset old_dir, FFS_Offset new_dir);
+
+// Removes the FFS_Dir at |dir|, indexed with |hash|, from the directory index of the live section
+// at |header|. Its slot stays in the probe chains, with no FFS_Dir and a fingerprint no probe
+// needs to skip, until the table is replaced.
+void UnindexDir(FFS_Header* header, DWORD hash, FFS_Offset dir);
+
+// Prefetches the slot a lookup of |hash| reads first, or its pilot in a frozen section.
+inline void PrefetchDirSlot(const FFS_Header* header, DWORD hash) {
+  if (LoadAcquire(&header->frozen_dirs.key_count)) {
+    PrefetchPerfectHash(header, header->frozen_dirs, hash);
+    return;
+  }
+  FFS_OffsetPtr<FFS_DirSlots> table = {LoadAcquire(&header->dir_slots.offset)};
+  auto slots = table.Get(header);
+  Prefetch(&slots->slots[hash & (slots->slot_count - 1)]);
+}
+
+// The directories of the index with a given hash, in probe order. The table is read once, so a
+// table published meanwhile is only seen by the next lookup. Only the directories whose
+// fingerprint matches are read, to compare their whole hash.
+//
+// In a frozen section the perfect hash has the one slot to look at. Only the hashes that several
+// directories share go on to the index.
+class DirCandidates {
+ public:
+  DirCandidates(const FFS_Header* header, DWORD hash)
+      : header_(header), slots_(nullptr), frozen_(0), fingerprint_(DirSlotFingerprint(hash)),
+        hash_(hash), mask_(0), slot_(0) {
+    if (LoadAcquire(&header->frozen_dirs.key_count)) {
+      auto& perfect = header->frozen_dirs;
+      FFS_OffsetPtr<FFS_DirSlot> slots = {perfect.slots};
+      frozen_ = slots.Get(header)[PerfectHashSlot(header, perfect, hash)].packed;
+      if (DirSlotOffset(frozen_) || ((frozen_ & kDirSlotFingerprintMask) != fingerprint_))
+        return;
+    }
+    FFS_OffsetPtr<FFS_DirSlots> table = {LoadAcquire(&header->dir_slots.offset)};
+    slots_ = table.Get(header)->slots;
+    mask_ = table.Get(header)->slot_count - 1;
+    slot_ = hash & mask_;
+  }
+
+  // Prefetches the directory of the next slot, which is usually the one Next() returns.
+  void Prefetch() const {
+    auto packed = slots_ ? LoadAcquire(&slots_[slot_].packed) : frozen_;
+    if (DirSlotOffset(packed))
+      ::Prefetch(FFS_OffsetPtr<FFS_Dir>{DirSlotOffset(packed)}.Get(header_));
+  }
+
+  // Returns the next directory with the hash, or null once an empty slot is reached.
+  const FFS_Dir* Next() {
+    if (!slots_) {
+      auto packed = frozen_;
+      frozen_ = 0;
+      return Matching(packed);
+    }
+    while (true) {
+      auto packed = LoadAcquire(&slots_[slot_].packed);
+      if (!packed)
+        return nullptr;
+      slot_ = (slot_ + 1) & mask_;
+      if (auto dir = Matching(packed))
+        return dir;
+    }
+  }
+
+ private:
+  // The directory of the slot |packed| if it has the hash.
+  const FFS_Dir* Matching(ULONGLONG packed) const {
+    if ((packed & kDirSlotFingerprintMask) != fingerprint_)
+      return nullptr;
+    FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(packed)};
+    if (!dir || (dir.Get(header_)->hash != hash_))
+      return nullptr;
+    return dir.Get(header_);
+  }
+
+  const FFS_Header* header_;
+  const FFS_DirSlot* slots_;    // null with a frozen slot.
+  ULONGLONG frozen_;
+  ULONGLONG fingerprint_;
+  DWORD hash_;
+  DWORD mask_;
+  DWORD slot_;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+// Platform specific directory reading for the scanner and the updates. DirReaderWin.cpp uses
+// FindFirstFile and DirReaderLinux.cpp uses getdents64 plus the StatEngine.
+
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "PathFilter.h"
+#include "Section.h"
+
+class Arena;
+
+struct DirListing {
+  // Set by the caller, the filter and the state of the directory in it. Can be null.
+  const PathFilter* filter;
+  const PathFilter::State* filter_state;
+  // Subdirectories to scan next, with the offset and the position of their entry within the
+  // listing. Filled by the scanner once the listing is sorted.
+  std::vector<std::tuple<std::wstring, DWORD, DWORD>> dirs;
+  DWORD entries;
+  DWORD reparse_points;
+  DWORD filtered;
+};
+
+// Tells if the entry |name| is to be left out of |listing|. The "." and ".." entries are always
+// kept.
+inline bool IsFilteredOut(DirListing* listing, const wchar_t* name, bool is_dir) {
+  if (!listing->filter || !AddDir(name))
+    return false;
+  if (!listing->filter->Excludes(*listing->filter_state, name, is_dir))
+    return false;
+  ++listing->filtered;
+  return true;
+}
+
+// Reads the entries of the directory |path| as section records into a new run of |arena|. The
+// first record is the directory itself (the "." entry) and dwReserved0 is left as 0. Entries
+// that the filter of |listing| excludes are left out. Returns false if the directory cannot be
+// read in whole.
+bool ReadDirectory(const std::wstring& path, Arena* arena, DirListing* listing);
+
+// Reads the metadata of the file or directory at |path| into |w32fd|. The name and the links are
+// left alone. Returns false if |path| does not exist.
+bool StatPath(const std::wstring& path, WIN32_FIND_DATA* w32fd);
@@ -0,0 +1,189 @@
+// Directory reading with getdents64.
+//
+// Each directory is opened once and its entries are pulled with getdents64 into a large buffer,
+// so reading a directory takes a handful of syscalls regardless of its size. The records for a
+// buffer full of entries are laid out first and then the whole batch is stat'ed relative to the
+// directory fd by the StatEngine, which writes the metadata into the records. The records have
+// the same format FindNextFileW produces on Windows.
+
+#include "stdafx.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "Arena.h"
+#include "DirReader.h"
+#include "Section.h"
+#include "StatEngine.h"
+#include "Utf8.h"
+
+namespace {
+
+// Big enough for a few thousand entries per getdents64 call.
+const size_t kDentsBufferSize = 256 * 1024;
+
+// The kernel layout, glibc does not expose it.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+// The per thread state of the reader.
+struct ReaderState {
+  std::unique_ptr<char[]> buffer;
+  std::vector<StatRequest> requests;
+  // For each request, if the filter still has to see the entry once its type is known.
+  std::vector<bool> untyped;
+  StatEngine engine;
+
+  ReaderState() : buffer(new char[kDentsBufferSize]) {}
+};
+
+// FILETIME counts 100ns intervals since 1601-01-01.
+FILETIME ToFileTime(const struct statx_timestamp& ts) {
+  const uint64_t kEpochDelta = 11644473600ULL;
+  uint64_t ft = (uint64_t(ts.tv_sec) + kEpochDelta) * 10000000ULL + ts.tv_nsec / 100;
+  FILETIME result = {DWORD(ft), DWORD(ft >> 32)};
+  return result;
+}
+
+DWORD ToAttributes(const struct statx& stx, const char* name) {
+  DWORD attributes = 0;
+  if (S_ISDIR(stx.stx_mode))
+    attributes |= FILE_ATTRIBUTE_DIRECTORY;
+  else if (S_ISLNK(stx.stx_mode))
+    attributes |= FILE_ATTRIBUTE_REPARSE_POINT;
+  if (!(stx.stx_mode & S_IWUSR))
+    attributes |= FILE_ATTRIBUTE_READONLY;
+  if (name[0] == '.' && name[1] != 0 && !(name[1] == '.' && name[2] == 0))
+    attributes |= FILE_ATTRIBUTE_HIDDEN;
+  return attributes ? attributes : FILE_ATTRIBUTE_NORMAL;
+}
+
+// Fills everything but the name and the links.
+void FillRecord(const struct statx& stx, const char* name, WIN32_FIND_DATA* w32fd) {
+  w32fd->dwFileAttributes = ToAttributes(stx, name);
+  w32fd->ftCreationTime = ToFileTime((stx.stx_mask & STATX_BTIME) ? stx.stx_btime : stx.stx_ctime);
+  w32fd->ftLastAccessTime = ToFileTime(stx.stx_atime);
+  w32fd->ftLastWriteTime = ToFileTime(stx.stx_mtime);
+  w32fd->nFileSizeHigh = DWORD(stx.stx_size >> 32);
+  w32fd->nFileSizeLow = DWORD(stx.stx_size);
+}
+
+// Size of a record once AdvanceNext() has run on it.
+size_t RecordSize(const WIN32_FIND_DATA* w32fd) {
+  return reinterpret_cast<const BYTE*>(AdvanceNext(w32fd)) - reinterpret_cast<const BYTE*>(w32fd);
+}
+
+}  // namespace
+
+bool ReadDirectory(const std::wstring& path, Arena* arena, DirListing* listing) {
+  static thread_local ReaderState state;
+
+  int dfd = ::openat(AT_FDCWD, ToUtf8(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0)
+    return false;
+
+  // The directory itself goes first, like the "." entry that FindFirstFile returns.
+  StatRequest self = {dfd, "."};
+  state.engine.Stat(&self, 1);
+  if (self.error) {
+    ::close(dfd);
+    return false;
+  }
+  arena->BeginRun();
+  auto w32fd = arena->Next();
+  FillRecord(self.stx, self.name, w32fd);
+  w32fd->dwReserved0 = 0;
+  wcscpy_s(w32fd->cFileName, L".");
+  ++listing->entries;
+  arena->Advance(AdvanceNext(w32fd));
+
+  while (true) {
+    auto bytes = ::syscall(SYS_getdents64, dfd, state.buffer.get(), kDentsBufferSize);
+    if (!bytes)
+      break;
+    // A listing cut short would be taken for the whole directory.
+    if (bytes < 0) {
+      ::close(dfd);
+      return false;
+    }
+
+    // Lay out the records for the batch with just the names. The records can still move while
+    // the run grows, so they are located by their offset within the run.
+    auto batch_start = arena->run_size();
+    state.requests.clear();
+    state.untyped.clear();
+    for (long pos = 0; pos < bytes;) {
+      auto dent = reinterpret_cast<linux_dirent64*>(state.buffer.get() + pos);
+      pos += dent->d_reclen;
+
+      const char* name = dent->d_name;
+      if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+        continue;
+
+      // Most file systems give the type, which saves stat'ing the entries that are left out.
+      w32fd = arena->Next();
+      w32fd->dwReserved0 = 0;
+      auto len = DecodeUtf8(name, strlen(name), w32fd->cFileName);
+      bool untyped = (dent->d_type == DT_UNKNOWN);
+      if (!untyped && IsFilteredOut(listing, w32fd->cFileName, dent->d_type == DT_DIR))
+        continue;
+      arena->Advance(AdvanceNext(w32fd, len));
+
+      StatRequest req = {dfd, name};
+      state.requests.push_back(req);
+      state.untyped.push_back(untyped);
+    }
+
+    state.engine.Stat(state.requests.data(), state.requests.size());
+
+    // Fill in the metadata, dropping the entries that went away since getdents64.
+    auto rec = const_cast<BYTE*>(arena->run()) + batch_start;
+    auto out = rec;
+    for (size_t ix = 0; ix != state.requests.size(); ++ix) {
+      auto& req = state.requests[ix];
+      w32fd = reinterpret_cast<WIN32_FIND_DATA*>(rec);
+      auto size = RecordSize(w32fd);
+      rec += size;
+      if (req.error)
+        continue;
+      if (state.untyped[ix] && IsFilteredOut(listing, w32fd->cFileName, S_ISDIR(req.stx.stx_mode)))
+        continue;
+      if (out != reinterpret_cast<BYTE*>(w32fd))
+        memmove(out, w32fd, size);
+      w32fd = reinterpret_cast<WIN32_FIND_DATA*>(out);
+      out += size;
+
+      FillRecord(req.stx, req.name, w32fd);
+      if (w32fd->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+        ++listing->reparse_points;
+      ++listing->entries;
+    }
+    arena->Advance(reinterpret_cast<WIN32_FIND_DATA*>(out));
+  }
+
+  ::close(dfd);
+  return true;
+}
+
+bool StatPath(const std::wstring& path, WIN32_FIND_DATA* w32fd) {
+  static thread_local StatEngine engine;
+
+  auto utf8 = ToUtf8(path);
+  auto name = utf8.substr(utf8.rfind('/') + 1);
+  StatRequest req = {AT_FDCWD, utf8.c_str()};
+  engine.Stat(&req, 1);
+  if (req.error)
+    return false;
+  FillRecord(req.stx, name.c_str(), w32fd);
+  return true;
+}
@@ -0,0 +1,49 @@
+// Directory reading with FindFirstFile / FindNextFile. The records that FindNextFileW writes are
+// truncated in place to the section format.
+
+#include "stdafx.h"
+
+#include "Arena.h"
+#include "DirReader.h"
+#include "Section.h"
+
+bool ReadDirectory(const std::wstring& path, Arena* arena, DirListing* listing) {
+  arena->BeginRun();
+  auto w32fd = arena->Next();
+
+  auto wildc = path + L"\\*";
+  auto fff = ::FindFirstFileW(wildc.c_str(), w32fd);
+  if (fff == INVALID_HANDLE_VALUE)
+    return false;
+
+  do {
+    if (IsFilteredOut(listing, w32fd->cFileName,
+                      (w32fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0))
+      continue;
+    w32fd->dwReserved0 = 0;
+
+    if (w32fd->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+      ++listing->reparse_points;
+
+    ++listing->entries;
+    arena->Advance(AdvanceNext(w32fd));
+    w32fd = arena->Next();
+  } while (::FindNextFileW(fff, w32fd));
+
+  bool complete = ::GetLastError() == ERROR_NO_MORE_FILES;
+  ::FindClose(fff);
+  return complete;
+}
+
+bool StatPath(const std::wstring& path, WIN32_FIND_DATA* w32fd) {
+  WIN32_FILE_ATTRIBUTE_DATA fad;
+  if (!::GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fad))
+    return false;
+  w32fd->dwFileAttributes = fad.dwFileAttributes;
+  w32fd->ftCreationTime = fad.ftCreationTime;
+  w32fd->ftLastAccessTime = fad.ftLastAccessTime;
+  w32fd->ftLastWriteTime = fad.ftLastWriteTime;
+  w32fd->nFileSizeHigh = fad.nFileSizeHigh;
+  w32fd->nFileSizeLow = fad.nFileSizeLow;
+  return true;
+}
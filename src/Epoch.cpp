@@ -0,0 +1,96 @@
+// Epochs of the live section.
+
+#include "stdafx.h"
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "Epoch.h"
+
+namespace {
+
+DWORD CurrentProcess() {
+#if defined(_WIN32)
+  return ::GetCurrentProcessId();
+#else
+  return DWORD(::getpid());
+#endif
+}
+
+bool IsProcessAlive(DWORD process) {
+#if defined(_WIN32)
+  auto handle = ::OpenProcess(SYNCHRONIZE, FALSE, process);
+  if (!handle)
+    return ::GetLastError() == ERROR_ACCESS_DENIED;
+  bool alive = ::WaitForSingleObject(handle, 0) == WAIT_TIMEOUT;
+  ::CloseHandle(handle);
+  return alive;
+#else
+  return (::kill(pid_t(process), 0) == 0) || (errno == EPERM);
+#endif
+}
+
+// Tells if epoch |a| is before epoch |b|.
+bool Before(DWORD a, DWORD b) {
+  return int(a - b) < 0;
+}
+
+}  // namespace
+
+void SetServerProcess(FFS_Header* header) {
+  StoreRelease(&header->server_process, CurrentProcess());
+}
+
+bool IsServerAlive(const FFS_Header* header) {
+  return IsProcessAlive(LoadAcquire(&header->server_process));
+}
+
+DWORD JoinEpochs(FFS_Header* header) {
+  auto process = CurrentProcess();
+  for (DWORD slot = 0; slot != FFS_kMaxClients; ++slot) {
+    if (!CompareExchange(&header->clients[slot].process, 0, process))
+      return slot;
+  }
+  return kNoEpochSlot;
+}
+
+void LeaveEpochs(FFS_Header* header, DWORD slot) {
+  StoreRelease(&header->clients[slot].process, 0);
+}
+
+void EpochReclaimer::Retire(FFS_Offset offset, FFS_Offset bytes) {
+  Retired retired = {{offset, bytes}, LoadAcquire(&header_->epoch)};
+  retired_.push_back(retired);
+}
+
+void EpochReclaimer::Reclaim(std::vector<SectionBlock>* freed) {
+  if (retired_.empty())
+    return;
+  // A client that enters from now on gets the new epoch and cannot find the retired blocks. 0 is
+  // for the slots that are not in an epoch.
+  auto epoch = header_->epoch + 1;
+  Exchange(&header_->epoch, epoch ? epoch : 1);
+
+  // The oldest epoch a client is still reading in holds back the blocks retired in it and after.
+  auto oldest = retired_.back().epoch + 1;
+  for (auto& slot : header_->clients) {
+    auto entered = LoadAcquire(&slot.epoch);
+    if (!entered || !Before(entered, oldest))
+      continue;
+    auto process = LoadAcquire(&slot.process);
+    if (process && !IsProcessAlive(process)) {
+      // The client died while reading, nobody else uses its slot.
+      StoreRelease(&slot.epoch, 0);
+      StoreRelease(&slot.process, 0);
+      continue;
+    }
+    oldest = entered;
+  }
+  size_t done = 0;
+  while ((done != retired_.size()) && Before(retired_[done].epoch, oldest))
+    freed->push_back(retired_[done++].block);
+  retired_.erase(retired_.begin(), retired_.begin() + done);
+}
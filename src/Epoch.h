@@ -0,0 +1,79 @@
+#pragma once
+
+// Epochs, for the memory of the live section that the server frees while clients in other
+// processes may still be reading it, like the index of a listing it replaced. See
+// FFS_ClientSlot.
+//
+// A client thread takes a slot once with JoinEpochs(). Before each read of the section it calls
+// EnterEpoch(), which copies FFS_Header::epoch to its slot, and after it ExitEpoch(). The server
+// unpublishes a block first, then retires it with the current epoch, see EpochReclaimer. Once it
+// has advanced the epoch past that one, a client that enters can no longer find the block, so
+// the block can be reused once every client that is reading entered after it was retired. The
+// clients never wait for the server nor the server for the clients; a client that stays in an
+// epoch only holds back the reuse of memory.
+//
+// The epochs wrap around after 2^32 advances and are compared as signed differences.
+
+#include <vector>
+
+#include "FastFileStats.h"
+#include "Section.h"
+
+// Makes the calling process the server of the section at |header|, see IsServerAlive().
+void SetServerProcess(FFS_Header* header);
+
+// Tells if the server of the section at |header| is still running. A server that died in the
+// middle of a write left its generation odd for good, so the clients that wait for it to end ask
+// this every so often, see BeginRead().
+bool IsServerAlive(const FFS_Header* header);
+
+// Returned by JoinEpochs() when all the slots are taken.
+const DWORD kNoEpochSlot = 0xFFFFFFFF;
+
+// Takes a free slot of FFS_Header::clients for the calling thread. Returns its index, or
+// kNoEpochSlot if they are all taken; the client must not read the live section then.
+DWORD JoinEpochs(FFS_Header* header);
+
+// Frees the slot, which must not be in an epoch.
+void LeaveEpochs(FFS_Header* header, DWORD slot);
+
+inline void EnterEpoch(FFS_Header* header, DWORD slot) {
+  // The exchange is a full barrier: the reads that follow cannot be done before the server can
+  // see the epoch in the slot.
+  Exchange(&header->clients[slot].epoch, LoadAcquire(&header->epoch));
+}
+
+inline void ExitEpoch(FFS_Header* header, DWORD slot) {
+  StoreRelease(&header->clients[slot].epoch, 0);
+}
+
+// A part of the section the server freed, or can reuse.
+struct SectionBlock {
+  FFS_Offset offset;
+  FFS_Offset bytes;
+};
+
+// The blocks the server retired and that clients may still read. Only used by the server.
+class EpochReclaimer {
+ public:
+  explicit EpochReclaimer(FFS_Header* header) : header_(header) {}
+
+  // Retires the block at |offset|, which no client can find anymore.
+  void Retire(FFS_Offset offset, FFS_Offset bytes);
+
+  // Advances the epoch and appends to |freed| the retired blocks that no client can be reading
+  // anymore. The slots of the processes that exited while in an epoch are freed on the way.
+  void Reclaim(std::vector<SectionBlock>* freed);
+
+  // The blocks retired and not reclaimed yet.
+  size_t retired() const { return retired_.size(); }
+
+ private:
+  struct Retired {
+    SectionBlock block;
+    DWORD epoch;
+  };
+
+  FFS_Header* header_;
+  std::vector<Retired> retired_;  // oldest first.
+};
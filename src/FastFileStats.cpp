@@ -8,17 +8,22 @@
 // Clients are expected to map this shared section and use it to speed up directory enumeration
 // and file stat'ing.  The shared section can be big, in the order of 30 MB for the chromium
 // source tree, at its initial state. As mutations happen to the tree, it can grow all the way to
-// the value of kMaxSharedSize.
+// the size given with --section-mb, 300 MB by default. The memory of what the updates remove is
+// reused for what they add, see Allocator.h.
 //
 // The basic block of the shared section is a lite version of WIN32_FIND_DATA. The SDK version of
 // this structure is over 512 bytes (!) so the lite version only extends to the string size of the 
 // cFileName member. Which in average gives us 9x smaller footprint for large trees.
 //
 // When the server starts it does an initial pass enumerating every file in the tree given as input
-// and then enters in monitor mode using ReadDirectoryChangesW.
+// and then enters in monitor mode using ReadDirectoryChangesW. The initial pass reads directories
+// on a pool of threads, see Scanner.cpp. With --snapshot the section is also saved to disk and
+// the initial pass only revalidates the saved copy, see Snapshot.h.
+// The snapshot file can also be mapped read-only and queried in place by tools that don't need
+// a running server; the lookups are in Lookup.cpp.
 //
 // Along with the basic blocks, there are 3 main navigational structures in the shared section:
-// 1- Directory hashtable : given a directory name hash, it will point to the set of directories
+// 1- Directory hashtable : given a directory path hash, it will point to the directories
 //                          basic blocks that have the same hash.
 // 2- Parent linked list  : given a directory basic block, it points to the parent directory.
 // 3- Sibling linked list : given a basic block it will give you the next basic block of the same
@@ -26,7 +31,8 @@
 //
 // #2 is constructed using dwReserved0
 // #3 is constructed using dwReserved1 and dwReserved0
-// #1 is stand-alone and lives at the end of the initial pass.
+// #1 is stand-alone, written at the end of the initial pass and grown as directories are
+//    added, see DirIndex.h.
 //
 // With these 3 primitives we expect to be able to do all querys and updates needed.
 //
@@ -63,33 +69,49 @@
 //
 //  The hash table points to the start of each hash-row vector (which is the set of all entities
 //  with the same hash, and it is terminated by a 0). Each hash-row vector entry points to the
-//  first entry (dot file) of each directory. Each entry (WIN32_FIND_DATA) has two pointers: one
+//  first entry (dot file) of each directory. The rows have since been replaced by a single open
+//  addressing table of (hash, directory) slots, FFS_DirSlots, so finding a directory probes a
+//  slot or two instead of walking a row. Each entry (WIN32_FIND_DATA) has two pointers: one
 //  to the next entry on the same directory and one to the entry that represents the parent.
 //
 //  Each entry cFileName member only contains the path component. Only the root entry (which bwt
 //  is fake) contains the full volume path.
 //
+//  The entries of each directory are sorted by name after the dot entry, and the index
+//  entries actually point to an FFS_Dir for the directory which, besides the dot entry, has a
+//  sorted index of the entry offsets so lookups in a directory are a binary search. Updates
+//  have to keep the index sorted.
+//
+//  The above is the records layout. With --layout=columns the same nodes are kept as a struct of
+//  arrays instead, one array per field plus a pool for the names, and the links and the offsets
+//  in the FFS_Dir and the indexes are node numbers. Scans over one field, like the files modified
+//  after a time, only touch that array then. See FFS_Layout and Layout.h.
+//
 //  TODO:
-//  1- implement updates in UpdateModified()
-//      to do this, a custom memory allocator might be needed that manages blocks in the shared
-//      section.
-//  2- implement the client.
+//  1- implement the client.
 //
 
 #include "stdafx.h"
 
+#include <algorithm>
+#include <sstream>
 #include <string>
-#include <tuple>
 #include <vector>
 
 #include "resource.h"
+#include "Benchmarks.h"
+#include "DirReader.h"
 #include "FastFileStats.h"
+#include "Lookup.h"
+#include "PathFilter.h"
+#include "PerfectHash.h"
+#include "Scanner.h"
+#include "Section.h"
+#include "Snapshot.h"
+#include "Update.h"
 
 #define PARANOID 1
 
-// All shared data must fit in 300MB.
-const DWORD kMaxSharedSize = 1024 * 1024 * 300;
-
 const auto kFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
                       FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION |
                       FILE_NOTIFY_CHANGE_SIZE;
@@ -104,278 +126,144 @@ T VerifyNot(T actual, U error) {
   __assume(0);
 }
 
-bool EndsWith(const std::wstring& full, const std::wstring& ending) {
-  if (full.length() < ending.length())
+// Refreshes |node|, in the listing of |dir|, from |path|. The clients see the change as soon as
+// it is written, see WriteNodeFields(). Most notifications repeat what the section has already,
+// a write is often notified several times, and those are not written again. Returns whether it
+// wrote.
+bool UpdateModified(FFS_Header* header, FFS_Dir* dir, DWORD node, const std::wstring& path) {
+  WIN32_FIND_DATA newfd;
+  if (!StatPath(path, &newfd))
     return false;
-
-  return (0 == full.compare(full.length() - ending.length(), ending.length(), ending));
-}
-
-// adapted to start from the back.
-DWORD Hash_FNV1a_32(const BYTE* bp, size_t len) {
-  auto be = bp + len - 1;
-  DWORD hval = 0x811c9dc5UL;
-  while (bp <= be) {
-    hval ^= (DWORD)*be--;
-    hval += (hval << 1) + (hval << 4) + (hval << 7) +
-            (hval << 8) + (hval << 24);
-  }
-  return hval;
+  return RefreshNodeFields(header, dir, node, newfd);
 }
 
-DWORD FileHash(const std::wstring& fname) {
-  return Hash_FNV1a_32(reinterpret_cast<const BYTE*>(&fname[0]), fname.size() * sizeof(wchar_t));
-}
+struct Context {
+  FFS_Header* ffs_header;
+  HANDLE top_dir;
+  // Changes to the paths the filter excludes are dropped. Can be null.
+  const PathFilter* filter;
+  Updater updater;
+  // The old path of a rename, until the notification with the new one.
+  std::wstring rename_from;
+  // Set when the section changed since the last snapshot.
+  bool dirty;
+  // Notifications dropped because of the filter.
+  DWORD filtered;
+  // The notifications that changed the section, and the time from their arrival to the end of
+  // their write, when the clients see them, in QueryPerformanceCounter() ticks.
+  DWORD applied;
+  LONGLONG latency_ticks;
+  LONGLONG max_latency_ticks;
+  BYTE io_buff[1024 * 16];
+};
 
-bool AddDir(const wchar_t* name) {
-  if (name[0] != '.')
-    return true;
-  if (name[1] == 0)
+// Reads the metadata of the node added at |path| into |w32fd|. Returns false if it is gone
+// already or the filter excludes it, which for a directory is only known now. The last
+// |relative| units of |path| are relative to the top directory.
+bool StatAdded(Context* ctx, const std::wstring& path, size_t relative, WIN32_FIND_DATA* w32fd) {
+  if (!StatPath(path, w32fd))
     return false;
-  if (name[1] != '.')
+  if (!ctx->filter || !(w32fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
     return true;
-  return false;
-}
-
-WIN32_FIND_DATA* AdvanceNext(WIN32_FIND_DATA* current) {
-  DWORD len = (wcslen(current->cFileName) + 1) * sizeof(wchar_t);
-  len = (len + 8 ) & ~7;
-  current->dwReserved1 = len;
-  return reinterpret_cast<WIN32_FIND_DATA*>(
-      reinterpret_cast<BYTE*>(&current->cFileName[0]) + len);
+  return !ctx->filter->ExcludesPath(path.c_str() + path.size() - relative, relative, true);
 }
 
-const WIN32_FIND_DATA* AdvanceNext(const WIN32_FIND_DATA* current) {
-  if (!current->dwReserved1)
-    __debugbreak();
-  return reinterpret_cast<const WIN32_FIND_DATA*>(
-      reinterpret_cast<const BYTE*>(&current->cFileName[0]) + current->dwReserved1);
-}
-
-bool CreateFFS(BYTE* const start, DWORD size, const wchar_t* top_dir) {
-  auto mem = start;
-  auto header = reinterpret_cast<FFS_Header*>(mem);
-  *header = FFS_Header{FFS_kMagic, FFS_kVersion, FFS_kBooting, 0, 0, 0};
-  mem += sizeof(*header);
-
-  typedef std::tuple<std::wstring, DWORD> Entry;
-
-  std::vector<Entry> pending_dirs;
-  std::vector<Entry> found_dirs;
-  std::vector<DWORD> dir_offsets[FFS_BucketCount];
-
-  DWORD all_count = 0;
-  DWORD dir_count = 0;
-  DWORD pending_fixes = 0;
-  DWORD reparse_count = 0;
-
-  // The first node is a fake node with the root so we don't have special cases.
-  auto w32fd = reinterpret_cast<WIN32_FIND_DATA*>(mem);
-  w32fd->dwFileAttributes = -1;
-  w32fd->dwReserved0 = 0;
-  w32fd->dwReserved1 = 0;
-  wcscpy_s(w32fd->cFileName, top_dir);
-  header->root_offset = DWORD(w32fd) - DWORD(start);
-
-  pending_dirs.emplace_back(top_dir, header->root_offset);
-  w32fd = AdvanceNext(w32fd);
-
-  while (pending_dirs.size()) {
-    for (auto& e : pending_dirs) {
-      auto wildc = std::get<0>(e) + L"\\*";
-      auto fff = ::FindFirstFileW(wildc.c_str(), w32fd);
-      if (fff == INVALID_HANDLE_VALUE) {
-        ++pending_fixes;
-        continue;
-      }
-      ++all_count;
-      // stuff the offset to the parent directory.
-      w32fd->dwReserved0 = std::get<1>(e);
-
-      auto hash = FileHash(std::get<0>(e));
-      dir_offsets[hash % FFS_BucketCount].emplace_back(DWORD(w32fd) - DWORD(start));
-      w32fd = AdvanceNext(w32fd);
-
-      while (::FindNextFileW(fff, w32fd)) {
-        // stuff the offset to the parent directory.
-        w32fd->dwReserved0 = std::get<1>(e);
-
-        if (w32fd->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
-          ++reparse_count;
-        } else if (w32fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-          if (AddDir(w32fd->cFileName)) {
-            found_dirs.emplace_back((std::get<0>(e) + L"\\") + w32fd->cFileName,
-                                    DWORD(w32fd) - DWORD(start));
-            ++dir_count;
-          }
-        }
-
-        ++all_count;
-        w32fd = AdvanceNext(w32fd);
+// Returns whether the section changed. Only the renames get here for the paths the filter
+// excludes, |excluded|, since their other half may be in the section.
+bool ApplyChange(Context* ctx, const std::wstring& path, size_t relative, DWORD action,
+                 bool excluded) {
+  // regarless of the notification, see if we have it.
+  const FFS_Dir* dir = nullptr;
+  auto node = GetNode(ctx->ffs_header, path, &dir);
+  WIN32_FIND_DATA w32fd;
+
+  bool changed = false;
+  switch (action) {
+    case FILE_ACTION_ADDED:
+      // A directory can come with its content, when it is copied or moved in.
+      if (StatAdded(ctx, path, relative, &w32fd))
+        changed = ctx->updater.AddTree(path, w32fd, ctx->filter, relative);
+      break;
+    case FILE_ACTION_REMOVED:
+      if (node)
+        changed = ctx->updater.RemoveNode(path);
+      break;
+    case FILE_ACTION_MODIFIED:
+      if (node)
+        changed = UpdateModified(ctx->ffs_header, const_cast<FFS_Dir*>(dir), node, path);
+      break;
+    case FILE_ACTION_RENAMED_OLD_NAME:
+      // A node moved in from an excluded path is added like one moved in from outside the tree.
+      ctx->rename_from = excluded ? std::wstring() : path;
+      break;
+    case FILE_ACTION_RENAMED_NEW_NAME:
+      // A node moved in from outside the tree, or from a path the section leaves out, has no old
+      // name in the section. One moved out, or to a path the section leaves out, has no new one.
+      if (excluded || !StatAdded(ctx, path, relative, &w32fd)) {
+        if (!ctx->rename_from.empty())
+          changed = ctx->updater.RemoveNode(ctx->rename_from);
+      } else if (ctx->rename_from.empty() || !GetNode(ctx->ffs_header, ctx->rename_from)) {
+        changed = ctx->updater.AddTree(path, w32fd, ctx->filter, relative);
+      } else {
+        // A node that could not be moved is gone from its old path, and is read again from the
+        // tree, like one moved in.
+        if (!ctx->updater.RenameNode(ctx->rename_from, path, w32fd))
+          ctx->updater.AddTree(path, w32fd, ctx->filter, relative);
+        changed = true;
       }
-
-      ::FindClose(fff);
-    }
-
-    pending_dirs.swap(found_dirs);
-    found_dirs.clear();
-  }
-
-
-  header->bytes = DWORD(w32fd) - DWORD(start);
-  header->num_dirs = dir_count;
-  header->num_nodes = all_count;
-  header->status = FFS_kUpdating;
-
-  // create each hash-row:
-  auto next = reinterpret_cast<ULONG_PTR>(w32fd) + 16;
-  next &= 0xfffffff0;
-  auto next_offset = reinterpret_cast<DWORD*>(next);
-  *next_offset = 0xAA55AA55;
-  ++next_offset;
-
-  int ix = 0;
-  for (auto& dof : dir_offsets) {
-    header->hash_tbl[ix++] = DWORD(next_offset) - DWORD(start);
-    for (auto& dir : dof) {
-      *next_offset = dir;
-      ++next_offset;
-    }
-    *next_offset = 0;
-    ++next_offset;
-  }
-  
-  // |next_offset| contains the first free block left in the shared section.
-  header->status = FFS_kFinished;
-  return true;
-}
-
-bool MatchesDirChain(DWORD start, const WIN32_FIND_DATA* w32fd, const std::wstring& path) {
-  std::wstring term(w32fd->cFileName);
-  if (!EndsWith(path, term))
-    return false;
-  if (!w32fd->dwReserved0) {
-    // reached the root of our data. this is the fake node that contains the absolute path
-    // the the root of the enumeration.
-    return (path == w32fd->cFileName);
-  }
-  // recurse.
-  auto remains = std::wstring(path, 0, path.size() - term.size() - 1);
-  auto nfd = reinterpret_cast<WIN32_FIND_DATA*>(w32fd->dwReserved0 + start);
-  return MatchesDirChain(start, nfd, remains);
-}
-
-const WIN32_FIND_DATA* GetDirectory(const FFS_Header* header, const std::wstring& path) {
-  if (path.empty())
-    return nullptr;
-
-  auto hash = FileHash(path);
-  auto start = DWORD(header);
-  auto head = reinterpret_cast<const DWORD*>(header->hash_tbl[hash % FFS_BucketCount] + start);
-
-  while (*head) {
-    auto curr_dir = reinterpret_cast<const WIN32_FIND_DATA*>(*head + start);
-    if ((curr_dir->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
-      __debugbreak();
-
-    auto parent = reinterpret_cast<const WIN32_FIND_DATA*>(curr_dir->dwReserved0 + start);
-    if (MatchesDirChain(start, parent, path))
-      return curr_dir;
-    // move to next node with the same hash.
-    ++head;
-  }
-  // no more nodes with same hash.
-  return nullptr;
-}
-
-const WIN32_FIND_DATA* GetLeaf(const WIN32_FIND_DATA* dot_node, const std::wstring& name) {
-  DWORD group_id = dot_node->dwReserved0;
-  auto curr  = AdvanceNext(dot_node);
-  while (curr->dwReserved0 == group_id) {
-    if (name == curr->cFileName)
-      return curr;
-    curr = AdvanceNext(curr);
-  }
-  return nullptr;
-}
-
-const WIN32_FIND_DATA* GetNode(const FFS_Header* header, const std::wstring& path) {
-  if (path.size() < 3)
-    return nullptr;
-  if (path[1] != L':')
-    return nullptr;
-  if (path[path.size() - 1] == L'\\') {
-    auto rez = path.substr(0, path.size() - 1);
-    return GetDirectory(header, rez);
+      ctx->rename_from.clear();
+      break;
   }
-
-  auto trail = path.rfind(L'\\');
-  if (trail == std::wstring::npos)
-    return nullptr;
-  auto dir = path.substr(0, trail);
-  auto leaf = path.substr(trail + 1);
-  auto w32fd = GetDirectory(header, dir);
-  if (!w32fd)
-    return nullptr;
-  if (!w32fd->dwReserved0)
-    return nullptr;                      // $$$ fix this.
-  return GetLeaf(w32fd, leaf);
+  return changed;
 }
 
-void UpdateModified(FFS_Header* header, WIN32_FIND_DATA* oldfd) {
-  WIN32_FIND_DATA newfd;
-  auto fff = ::FindFirstFileW(oldfd->cFileName, &newfd);
-  ::FindClose(fff);
-  int count = 0;
-
-  if (oldfd->ftLastWriteTime.dwLowDateTime != newfd.ftLastWriteTime.dwLowDateTime)
-    count += 1;
-  if (oldfd->ftLastWriteTime.dwHighDateTime != newfd.ftLastWriteTime.dwHighDateTime)
-    count += 2;
-  if (oldfd->nFileSizeHigh != newfd.nFileSizeHigh)
-    count += 4;
-  if (oldfd->nFileSizeLow != newfd.nFileSizeLow)
-    count += 8;
-}
-
-struct Context {
-  FFS_Header* ffs_header;
-  HANDLE top_dir;
-  BYTE io_buff[1024 * 16];
-};
-
 void CALLBACK ChangesCompletionCB(DWORD error, DWORD bytes, OVERLAPPED* ov) {
   if (!bytes)
     return;
+  LARGE_INTEGER notified;
+  ::QueryPerformanceCounter(&notified);
   auto ctx = reinterpret_cast<Context*>(ov->hEvent);
-  static std::wstring root = std::wstring(reinterpret_cast<WIN32_FIND_DATA*>(
-      ctx->ffs_header->root_offset + DWORD(ctx->ffs_header))->cFileName) + L"\\";
+  // A frozen section is not updated anymore, so there is no need to watch the tree either.
+  if (ctx->ffs_header->status == FFS_kFrozen)
+    return;
+  static std::wstring root;
+  if (root.empty()) {
+    WIN32_FIND_DATA root_node;
+    ReadNode(ctx->ffs_header, ctx->ffs_header->root_offset, &root_node);
+    root = std::wstring(root_node.cFileName) + L"\\";
+  }
 
   auto fni = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(ctx->io_buff);
   if (!fni->FileNameLength)
     return;
 
-  ctx->ffs_header->status = FFS_kUpdating;
+  // The status only tells that updates are under way; the clients that need a consistent view of
+  // a node read it through the generations, see ReadPath().
+  StoreRelease(&ctx->ffs_header->status, DWORD(FFS_kUpdating));
+  ctx->dirty = true;
 
   int count = 0;
   while (true) {
     ++count;
-    // regarless of the notification, see if we have it.
-    auto path = root + std::wstring(fni->FileName, fni->FileNameLength / sizeof(wchar_t));
-    auto node = GetNode(ctx->ffs_header, path);
-
-    switch (fni->Action) {
-      case FILE_ACTION_ADDED:
-        break;
-      case FILE_ACTION_REMOVED:
-        break;
-      case FILE_ACTION_MODIFIED:
-        UpdateModified(ctx->ffs_header, const_cast<WIN32_FIND_DATA*>(node));
-        break;
-      case FILE_ACTION_RENAMED_OLD_NAME:
-        break;
-      case FILE_ACTION_RENAMED_NEW_NAME:
-        break;
+    // The names are relative to the top directory, like the filter patterns. Whether the name is
+    // a directory is not known here, but the excluded directories are not in the section so
+    // only the changes to their children matter.
+    // The two halves of a rename go through even when one is excluded, so that a node moved to an
+    // excluded path is removed and the next rename does not pair up with a stale old name.
+    auto len = fni->FileNameLength / sizeof(wchar_t);
+    bool excluded = ctx->filter && ctx->filter->ExcludesPath(fni->FileName, len, false);
+    bool rename = (fni->Action == FILE_ACTION_RENAMED_OLD_NAME) ||
+                  (fni->Action == FILE_ACTION_RENAMED_NEW_NAME);
+    if (excluded)
+      ++ctx->filtered;
+    if ((!excluded || rename) &&
+        ApplyChange(ctx, root + std::wstring(fni->FileName, len), len, fni->Action, excluded)) {
+      LARGE_INTEGER visible;
+      ::QueryPerformanceCounter(&visible);
+      auto latency = visible.QuadPart - notified.QuadPart;
+      ++ctx->applied;
+      ctx->latency_ticks += latency;
+      ctx->max_latency_ticks = std::max(ctx->max_latency_ticks, latency);
     }
 
     if (!fni->NextEntryOffset)
@@ -384,30 +272,49 @@ void CALLBACK ChangesCompletionCB(DWORD error, DWORD bytes, OVERLAPPED* ov) {
         reinterpret_cast<BYTE*>(fni) + fni->NextEntryOffset);
   }
 
+  // The memory the batch retired is reused once the clients are done with it.
+  ctx->updater.Reclaim();
+  StoreRelease(&ctx->ffs_header->status, DWORD(FFS_kFinished));
+
   // subscribe again.
   ::ReadDirectoryChangesW(ctx->top_dir, ctx->io_buff, sizeof(ctx->io_buff),
                           TRUE, kFilter,  NULL, ov, &ChangesCompletionCB);
 }
 
-bool StartWatchingTree(const wchar_t* dir, FFS_Header* ffs_header) {
+Context* StartWatchingTree(const wchar_t* dir, FFS_Header* ffs_header, size_t size,
+                           const PathFilter* filter) {
   auto kShareAll = FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE;
   auto dir_handle = ::CreateFileW(dir, GENERIC_READ, kShareAll, 
       NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
 
   if (dir_handle == INVALID_HANDLE_VALUE)
-    return false;
-  auto ctx = new Context {ffs_header, dir_handle};
+    return nullptr;
+  auto ctx = new Context {ffs_header, dir_handle, filter, Updater(ffs_header, size)};
   auto ov = new OVERLAPPED {0};
   ov->hEvent = HANDLE(ctx);
   if (!::ReadDirectoryChangesW(dir_handle, 
                                ctx->io_buff, sizeof(ctx->io_buff),
                                TRUE, kFilter,  NULL, ov, &ChangesCompletionCB))
-    return false;
-  return true;
+    return nullptr;
+  return ctx;
+}
+
+// Reports how long the changes took to reach the clients.
+void ReportLatency(const Context* ctx) {
+  if (!ctx->applied)
+    return;
+  LARGE_INTEGER freq;
+  ::QueryPerformanceFrequency(&freq);
+  wchar_t msg[160];
+  swprintf_s(msg, L"ffs: %u changes applied, %.1f us on average from the notification to the "
+             L"clients, %.1f us at most\n", ctx->applied,
+             double(ctx->latency_ticks) * 1e6 / double(ctx->applied * freq.QuadPart),
+             double(ctx->max_latency_ticks) * 1e6 / double(freq.QuadPart));
+  ::OutputDebugStringW(msg);
 }
 
 int Testing(const FFS_Header* header) {
-  auto fd1 = GetDirectory(header, L"f:\\src\\g0\\src\\athena");
+  auto fd1 = FindDir(header, L"f:\\src\\g0\\src\\athena");
   if (!fd1)
     __debugbreak();
   auto fd2 = GetNode(header, L"f:\\src\\g0\\src\\cc\\layers\\image_layer.h");
@@ -419,8 +326,170 @@ int Testing(const FFS_Header* header) {
   return 0;
 }
 
+// Times the initial scan with 1 to |options.threads| directory readers. A first untimed pass warms
+// up the file system cache so that all the timed passes see the same conditions.
+void BenchmarkScan(BYTE* start, size_t size, const wchar_t* dir, const ScanOptions& options) {
+  LARGE_INTEGER freq, before, after;
+  ::QueryPerformanceFrequency(&freq);
+  CreateFFS(start, size, dir, options);
+
+  for (DWORD threads = 1; threads <= options.threads; ++threads) {
+    ScanOptions pass = options;
+    pass.threads = threads;
+    ::QueryPerformanceCounter(&before);
+    if (!CreateFFS(start, size, dir, pass))
+      __debugbreak();
+    ::QueryPerformanceCounter(&after);
+
+    wchar_t msg[128];
+    swprintf_s(msg, L"ffs: scan with %u threads took %llu ms\n", threads,
+               (after.QuadPart - before.QuadPart) * 1000 / freq.QuadPart);
+    ::OutputDebugStringW(msg);
+  }
+}
+
+struct Options {
+  ScanOptions scan;
+  PathFilter filter;
+  bool bench_scan;
+  bool bench_lookup;
+  bool bench_layouts;
+  bool bench_hashes;
+  bool bench_freeze;
+  bool bench_generations;
+  bool bench_updates;
+  bool bench_modified;
+  bool bench_alloc;
+  bool freeze;
+  bool stop;
+  std::wstring snapshot;
+  DWORD checkpoint_ms;
+  size_t section_size;
+};
+
+bool IsSwitch(const std::wstring& arg, const wchar_t* name, std::wstring* value) {
+  auto len = wcslen(name);
+  if (arg.compare(0, len, name) != 0)
+    return false;
+  if (arg.size() == len)
+    return true;
+  if (arg[len] != L'=')
+    return false;
+  *value = arg.substr(len + 1);
+  return true;
+}
+
+// The command line is a list of switches:
+//   --threads=n       : number of threads for the initial scan, by default one per core.
+//   --bench-scan      : time the initial scan for 1 to n threads and exit.
+//   --bench-lookup    : time the lookups after the initial scan and exit.
+//   --bench-layouts   : compare the size and the lookups of both section layouts and exit.
+//   --bench-hashes    : time each hash policy on the names after the initial scan and exit.
+//   --bench-freeze    : time the freezing and the lookups it speeds up after the initial scan
+//                       and exit.
+//   --bench-generations : check that the clients never read a node half updated under a stream
+//                       of updates, see ReadPath(), and exit.
+//   --bench-updates   : check that the clients never read memory the server reused as it removes
+//                       and adds nodes, see Epoch.h, and exit.
+//   --bench-modified  : time the notifications that a file was modified, from their arrival to
+//                       the clients seeing the new fields, and exit.
+//   --bench-alloc     : time the allocator of the section, see Allocator.h, and exit.
+//   --layout=name     : "records" or "columns", see FFS_Layout. Records by default. The changes
+//                       to the tree are not applied to the columns, see Update.h.
+//   --fields=client   : only store the fields the clients read, see FFS_Fields. Implies
+//                       --layout=columns.
+//   --hash=name       : "fnv1a", "wy" or "crc32c", how the names and the directories are
+//                       hashed, see FFS_HashPolicy. FNV-1a by default.
+//   --leaf-index      : also index the files by directory and name, see FFS_LeafSlots, which
+//                       takes 24 to 48 more bytes per node.
+//   --freeze          : freeze the section after the initial scan, see FreezeFFS(). The lookups
+//                       take a single probe but the changes to the tree are not applied anymore.
+//   --snapshot=file   : start from the snapshot in |file| if there is one, and save the section
+//                       to it every so often and when the server stops.
+//   --checkpoint=secs : how often to save the snapshot if there were changes, 5 minutes by
+//                       default.
+//   --exclude=pattern : leave the paths that match |pattern| out of the section, see
+//                       PathFilter.h for the syntax. Can be given many times.
+//   --include=pattern : keep the paths that match |pattern| even if an earlier --exclude
+//                       matches them.
+//   --section-mb=n    : size of the shared section, 300 MB by default. It is only reserved, the
+//                       pages are committed as the section fills. Over 4 GB needs the x64 build.
+//   --stop            : tell the running server to save its snapshot and exit.
+void ParseOptions(const wchar_t* cmd_line, Options* opts) {
+  opts->scan.threads = DefaultScanThreads();
+  opts->scan.filter = &opts->filter;
+  opts->bench_scan = false;
+  opts->bench_lookup = false;
+  opts->bench_layouts = false;
+  opts->bench_hashes = false;
+  opts->bench_freeze = false;
+  opts->bench_generations = false;
+  opts->bench_updates = false;
+  opts->bench_modified = false;
+  opts->bench_alloc = false;
+  opts->freeze = false;
+  opts->scan.layout = FFS_kLayoutRecords;
+  opts->scan.names = FFS_kNamesWide;
+  opts->scan.fields = FFS_kAllFields;
+  opts->scan.hash_policy = FFS_kHashFnv1a;
+  opts->scan.leaf_index = false;
+  opts->stop = false;
+  opts->checkpoint_ms = 5 * 60 * 1000;
+  opts->section_size = kMaxSharedSize;
+
+  std::wistringstream args(cmd_line ? cmd_line : L"");
+  std::wstring arg, value;
+  while (args >> arg) {
+    if (IsSwitch(arg, L"--threads", &value))
+      opts->scan.threads = std::max(1, _wtoi(value.c_str()));
+    else if (IsSwitch(arg, L"--bench-scan", &value))
+      opts->bench_scan = true;
+    else if (IsSwitch(arg, L"--bench-lookup", &value))
+      opts->bench_lookup = true;
+    else if (IsSwitch(arg, L"--bench-layouts", &value))
+      opts->bench_layouts = true;
+    else if (IsSwitch(arg, L"--bench-hashes", &value))
+      opts->bench_hashes = true;
+    else if (IsSwitch(arg, L"--bench-freeze", &value))
+      opts->bench_freeze = true;
+    else if (IsSwitch(arg, L"--bench-generations", &value))
+      opts->bench_generations = true;
+    else if (IsSwitch(arg, L"--bench-updates", &value))
+      opts->bench_updates = true;
+    else if (IsSwitch(arg, L"--bench-modified", &value))
+      opts->bench_modified = true;
+    else if (IsSwitch(arg, L"--bench-alloc", &value))
+      opts->bench_alloc = true;
+    else if (IsSwitch(arg, L"--layout", &value))
+      opts->scan.layout = (value == L"columns") ? FFS_kLayoutColumns : FFS_kLayoutRecords;
+    else if (IsSwitch(arg, L"--fields", &value))
+      opts->scan.fields = (value == L"client") ? FFS_kClientFields : FFS_kAllFields;
+    else if (IsSwitch(arg, L"--hash", &value))
+      opts->scan.hash_policy = (value == L"wy")     ? FFS_kHashWy :
+                               (value == L"crc32c") ? FFS_kHashCrc32c : FFS_kHashFnv1a;
+    else if (IsSwitch(arg, L"--leaf-index", &value))
+      opts->scan.leaf_index = true;
+    else if (IsSwitch(arg, L"--freeze", &value))
+      opts->freeze = true;
+    else if (IsSwitch(arg, L"--snapshot", &value))
+      opts->snapshot = value;
+    else if (IsSwitch(arg, L"--checkpoint", &value))
+      opts->checkpoint_ms = std::max(1, _wtoi(value.c_str())) * 1000;
+    else if (IsSwitch(arg, L"--exclude", &value))
+      opts->filter.Add(value, false);
+    else if (IsSwitch(arg, L"--include", &value))
+      opts->filter.Add(value, true);
+    else if (IsSwitch(arg, L"--section-mb", &value))
+      opts->section_size = size_t(std::max(1, _wtoi(value.c_str()))) * 1024 * 1024;
+    else if (IsSwitch(arg, L"--stop", &value))
+      opts->stop = true;
+  }
+  if (opts->scan.fields != FFS_kAllFields)
+    opts->scan.layout = FFS_kLayoutColumns;
+}
+
 // The shared memory is demand-paged via SEH.
-int ExceptionFilter(EXCEPTION_POINTERS *ep, BYTE* start, DWORD max_size) {
+int ExceptionFilter(EXCEPTION_POINTERS *ep, BYTE* start, size_t max_size) {
   if (ep->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
     return EXCEPTION_CONTINUE_SEARCH;
   auto addr = reinterpret_cast<BYTE*>(ep->ExceptionRecord->ExceptionInformation[1]);
@@ -435,30 +504,111 @@ int ExceptionFilter(EXCEPTION_POINTERS *ep, BYTE* start, DWORD max_size) {
 
 int __stdcall wWinMain(HINSTANCE module, HINSTANCE, wchar_t* cc, int) {
   const wchar_t dir[] = L"f:\\src";
+  const wchar_t kSectionName[] = L"ffs_(f)!src";
+  const wchar_t kStopEventName[] = L"ffs_(f)!src_stop";
+
+  // Static because no object that needs unwinding can live in this function, see __try below.
+  static Options opts;
+  ParseOptions(cc, &opts);
+
+  if (opts.stop) {
+    auto stop = ::OpenEventW(EVENT_MODIFY_STATE, FALSE, kStopEventName);
+    return (stop && ::SetEvent(stop)) ? 0 : 1;
+  }
 
-  auto mmap = ::CreateFileMappingW(
-      INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_RESERVE, 0, kMaxSharedSize, L"ffs_(f)!src");
+  auto size = ULONGLONG(opts.section_size);
+  auto mmap = ::CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_RESERVE,
+                                   DWORD(size >> 32), DWORD(size), kSectionName);
   auto start = reinterpret_cast<BYTE*>(
-      ::MapViewOfFile(mmap, FILE_MAP_ALL_ACCESS, 0, 0, kMaxSharedSize));
+      ::MapViewOfFile(mmap, FILE_MAP_ALL_ACCESS, 0, 0, opts.section_size));
   if (!start)
     return 1;
 
   __try {
 
-    if (!StartWatchingTree(dir, reinterpret_cast<FFS_Header*>(start)))
-      return 2;
+    if (opts.bench_scan) {
+      BenchmarkScan(start, opts.section_size, dir, opts.scan);
+      return 0;
+    }
+    if (opts.bench_layouts) {
+      BenchmarkLayouts(dir, opts.scan);
+      return 0;
+    }
+
+    auto header = reinterpret_cast<FFS_Header*>(start);
+    // The columns have no room for the nodes the tree gains, see Update.h. Rather than drop them
+    // for good, the section stays as the scan found the tree.
+    Context* ctx = nullptr;
+    if (opts.scan.layout == FFS_kLayoutColumns) {
+      ::OutputDebugStringW(L"ffs: the columns cannot take new nodes, the tree is not watched\n");
+    } else {
+      ctx = StartWatchingTree(dir, header, opts.section_size,
+                              opts.filter.empty() ? nullptr : &opts.filter);
+      if (!ctx)
+        return 2;
+    }
 
-    if (!CreateFFS(start, kMaxSharedSize, dir))
-      return 3;
+    auto snapshot = opts.snapshot.empty() ? nullptr : opts.snapshot.c_str();
+    if (!snapshot || !LoadSnapshot(start, opts.section_size, dir, snapshot, opts.scan)) {
+      if (!CreateFFS(start, opts.section_size, dir, opts.scan))
+        return 3;
+    }
+    if (opts.bench_lookup) {
+      BenchmarkLookups(header);
+      return 0;
+    }
+    if (opts.bench_hashes) {
+      BenchmarkHashes(header);
+      return 0;
+    }
+    if (opts.bench_freeze) {
+      BenchmarkFreeze(header);
+      return 0;
+    }
+    if (opts.bench_generations) {
+      BenchmarkGenerations(header);
+      return 0;
+    }
+    if (opts.bench_updates) {
+      BenchmarkUpdates(header);
+      return 0;
+    }
+    if (opts.bench_modified) {
+      BenchmarkModified(header);
+      return 0;
+    }
+    if (opts.bench_alloc) {
+      BenchmarkAllocator(header);
+      return 0;
+    }
+    if (opts.freeze && !FreezeFFS(header, opts.section_size))
+      return 7;
+    if (snapshot)
+      SaveSnapshot(header, snapshot);
 
-    Testing(reinterpret_cast<FFS_Header*>(start));
+    Testing(header);
 
+    // The changes are applied by ChangesCompletionCB() on this thread while it waits, so the
+    // snapshot is always saved between updates.
+    auto stop = ::CreateEventW(NULL, TRUE, FALSE, kStopEventName);
+    auto last_save = ::GetTickCount64();
     while (true) {
-      ::SleepEx(INFINITE, TRUE);
+      auto wait = ::WaitForSingleObjectEx(stop, opts.checkpoint_ms, TRUE);
+      bool stopping = (wait == WAIT_OBJECT_0);
+      if (snapshot && ctx && ctx->dirty &&
+          (stopping || (::GetTickCount64() - last_save >= opts.checkpoint_ms))) {
+        if (SaveSnapshot(header, snapshot))
+          ctx->dirty = false;
+        last_save = ::GetTickCount64();
+      }
+      if (stopping) {
+        if (ctx)
+          ReportLatency(ctx);
+        return 0;
+      }
     }
-    return 0;
 
-  } __except (ExceptionFilter(GetExceptionInformation(), start, kMaxSharedSize)) {
+  } __except (ExceptionFilter(GetExceptionInformation(), start, opts.section_size)) {
     // Probably ran out of memory.
     return 6;
   }
@@ -1,21 +1,271 @@
 #pragma once
 
 enum FFS_Consts {
-  FFS_kVersion = 1,
-  FFS_BucketCount = 1543,
+  FFS_kVersion = 21,
   FFS_kMagic = 0x8855bed,
+  FFS_kMaxClients = 64,         // client slots, see FFS_ClientSlot.
+  FFS_kSizeClasses = 47,        // free lists of the small blocks, see FFS_FreeLists.
+};
+
+// The section only has offsets from FFS_Header, never pointers, so it can be mapped anywhere and
+// saved as it is. FFS_Offset is their width: 64 bits by default so the section can go over 4 GB,
+// or 32 bits when built with FFS_OFFSET_BITS=32, which makes the directory table smaller and the
+// fingerprints of the directory index wider, see FFS_DirSlot. FFS_Header::offset_size tells which
+// one a section has.
+//
+// The node refs are DWORDs either way. The records layout uses the record offsets as refs, so it
+// is limited to 4 GB of records; the columns use indexes and only the name pool is limited, to
+// 4G units.
+#if !defined(FFS_OFFSET_BITS)
+#define FFS_OFFSET_BITS 64
+#endif
+
+#if FFS_OFFSET_BITS == 64
+typedef ULONGLONG FFS_Offset;
+#elif FFS_OFFSET_BITS == 32
+typedef DWORD FFS_Offset;
+#else
+#error FFS_OFFSET_BITS must be 32 or 64
+#endif
+
+// An offset from FFS_Header to a T, 0 being none. It converts to and from the plain offset, and
+// Get() gives the T in the section at |header|. It has no constructors, so the structs of the
+// section stay aggregates and can be zero initialized.
+template <typename T, typename Offset = FFS_Offset>
+struct FFS_OffsetPtr {
+  Offset offset;
+
+  T* Get(void* header) const {
+    return reinterpret_cast<T*>(static_cast<unsigned char*>(header) + offset);
+  }
+
+  const T* Get(const void* header) const {
+    return reinterpret_cast<const T*>(static_cast<const unsigned char*>(header) + offset);
+  }
+
+  operator Offset() const { return offset; }
+
+  FFS_OffsetPtr& operator=(Offset value) {
+    offset = value;
+    return *this;
+  }
+};
+
+// How the nodes are stored. Each node is named by a DWORD ref, see Layout.h.
+enum FFS_Layout {
+  // Lite WIN32_FIND_DATA records, which are what FindFirstFile returns up to the name. The refs
+  // are the record offsets.
+  FFS_kLayoutRecords = 0,
+  // One array per field, see FFS_Columns. The refs are the indexes in the arrays.
+  FFS_kLayoutColumns = 1,
+};
+
+// How the names in the pool of FFS_kLayoutColumns are stored.
+enum FFS_NameEncoding {
+  // wchar_t, zero terminated. The positions are in wchar_t units.
+  FFS_kNamesWide = 0,
+  // UTF-8 after their length, see PutNameLength(), without a terminator. The positions are in
+  // bytes. Only for Linux, where wchar_t is 4 bytes and the UTF-8 order is the wcscmp() order.
+  // The directory hashes are over the UTF-8 names then.
+  FFS_kNamesUtf8 = 1,
+  // UTF-8, front coded within each listing: the entries have the number of bytes shared with the
+  // name before them and the rest of the name, see PutFrontCodedEntry(). The first entry of a
+  // listing and then one in every |restart_interval| sorted entries have the whole name, so the
+  // lookups can binary search those. The positions are in bytes and the names are not interned,
+  // there is no name table. Linux only, like FFS_kNamesUtf8, and the hashes are the same.
+  FFS_kNamesFrontCoded = 2,
+};
+
+// The fields of the nodes that the section stores, FFS_Header::fields. The clients only read the
+// attributes, the size and the modification time, so the columns can be built without the other
+// times; their offsets are 0 then and ReadNode() gives 0 for them. The records always have them
+// all, they are WIN32_FIND_DATA.
+enum FFS_Fields {
+  FFS_kFieldAttributes    = 1 << 0,
+  FFS_kFieldSize          = 1 << 1,
+  FFS_kFieldCreationTime  = 1 << 2,
+  FFS_kFieldAccessTime    = 1 << 3,
+  FFS_kFieldWriteTime     = 1 << 4,
+  // What the clients, the lookups and the revalidation need.
+  FFS_kClientFields       = FFS_kFieldAttributes | FFS_kFieldSize | FFS_kFieldWriteTime,
+  FFS_kAllFields          = FFS_kClientFields | FFS_kFieldCreationTime | FFS_kFieldAccessTime,
+};
+
+// The arrays of FFS_kLayoutColumns, each one aligned to 64 bytes. They have |count| entries; the
+// first one is not a node. The times are FILETIMEs as 64-bit numbers.
+//
+// The names are interned: each distinct name is in the pool once and the nodes with that name
+// have its position. The name table finds the position of a name, see FFS_NameSlot.
+struct FFS_NameSlot;
+
+struct FFS_Columns {
+  DWORD count;
+  DWORD names;                  // FFS_NameEncoding.
+  FFS_OffsetPtr<DWORD> attributes;
+  FFS_OffsetPtr<ULONGLONG> size;
+  FFS_OffsetPtr<ULONGLONG> creation_time;   // 0 if not stored.
+  FFS_OffsetPtr<ULONGLONG> access_time;     // 0 if not stored.
+  FFS_OffsetPtr<ULONGLONG> write_time;
+  FFS_OffsetPtr<DWORD> parent;              // parent refs.
+  FFS_OffsetPtr<DWORD> next;                // refs of the next node in the listing.
+  FFS_OffsetPtr<DWORD> name;                // name positions in the name pool.
+  FFS_OffsetPtr<BYTE> name_pool;            // the names, in units of the encoding.
+  FFS_OffsetPtr<FFS_NameSlot> name_table;
+  DWORD name_pool_size;         // in units of the encoding.
+  DWORD restart_interval;       // with FFS_kNamesFrontCoded.
+  DWORD name_table_size;        // slots, a power of 2.
+  DWORD name_count;             // distinct names.
+};
+
+// How the names are hashed for FFS_NameSlot::hash and FFS_Dir::hash, see Hash.h.
+enum FFS_HashPolicy {
+  FFS_kHashFnv1a = 0,           // FNV-1a over the units of the names.
+  FFS_kHashWy = 1,              // wyhash style, 64 bit multiplies over 8 byte words.
+  FFS_kHashCrc32c = 2,          // CRC32C of the bytes of the names.
+};
+
+// An open addressing table of the names in the pool, probed linearly from NameHash() modulo the
+// table size. Half of the slots at least are empty.
+struct FFS_NameSlot {
+  DWORD hash;                   // NameHash() of the name.
+  DWORD name;                   // position of the name in the pool plus 1, 0 if empty.
+};
+
+// A directory listing. The directory index points to these. The server does not change the count
+// and the index of a listing in place: it writes a new FFS_Dir with them and points the
+// directory index to it instead, so a client always reads a count that goes with its index. See
+// Update.h.
+struct FFS_Dir {
+  DWORD anchor;                 // ref of the "." node.
+  DWORD hash;                   // PathHash() of the full path, see CombineHash().
+  DWORD count;                  // entries, without the "." node.
+  DWORD generation;             // odd while the server writes the fields of the nodes of the
+                                // listing, see BeginWrite().
+  FFS_OffsetPtr<DWORD> index;   // |count| node refs, sorted by name.
+};
+
+// The directory index is an open addressing table of the directories, probed linearly from
+// FFS_Dir::hash modulo |slot_count|. It is at most half full so there is always an empty slot to
+// stop at. The slots are only ever filled, never moved or emptied, so the clients read it without
+// locks while the server adds to it. A slot is only rewritten to point to a new FFS_Dir for the
+// same directory, or to nothing, kDirSlotFingerprintMask, once the directory is removed or
+// renamed; a renamed directory gets a new slot for its new hash. When the table gets half full,
+// counting the slots of the removed directories, the server writes a new table without them and
+// publishes that one in FFS_Header::dir_slots. It is twice as big, or the same size when the
+// directories left only take a quarter of it. The old table stays as it was until it is
+// reclaimed, so a client still in it only misses the directories added since.
+// See DirIndex.h.
+//
+// A slot is one 64-bit word, written with a single store: the offset of the FFS_Dir in the low
+// FFS_kDirSlotOffsetBits and a fingerprint of its hash, the high bits of FFS_Dir::hash, above
+// them. The probes skip the slots whose fingerprint differs without reading the FFS_Dir. With
+// 64-bit offsets the fingerprint is 16 bits and the section is limited to 2^48 bytes; with 32-bit
+// offsets it is the whole hash.
+enum FFS_DirSlotConsts {
+#if FFS_OFFSET_BITS == 64
+  FFS_kDirSlotOffsetBits = 48,
+#else
+  FFS_kDirSlotOffsetBits = 32,
+#endif
+};
+
+struct FFS_DirSlot {
+  ULONGLONG packed;             // fingerprint and FFS_Dir offset, 0 while the slot is empty.
+};
+
+struct FFS_DirSlots {
+  DWORD slot_count;             // a power of 2.
+  DWORD dir_count;              // slots with a directory.
+  DWORD removed_count;          // slots of the removed directories.
+  DWORD pad0;
+  FFS_DirSlot slots[1];         // |slot_count| of them.
+};
+
+// The leaf index is optional, see ScanOptions::leaf_index. It has every node but the "." ones,
+// keyed by their directory and the NameHash() of their name, so GetNode() finds a file with a
+// probe in each index instead of a binary search of the listing. It is probed linearly from
+// CombineHash() of FFS_Dir::hash and the name hash, which is the PathHash() of the node, and is
+// filled and rewritten like the directory index: |node| is published last. See LeafIndex.h.
+struct FFS_LeafSlot {
+  DWORD hash;                   // CombineHash() of the directory and the name hashes.
+  DWORD dir;                    // FFS_Dir::anchor of the directory of |node|, 0 once the node
+                                // is removed.
+  DWORD node;                   // 0 while the slot is empty.
+};
+
+struct FFS_LeafSlots {
+  DWORD slot_count;             // a power of 2.
+  DWORD leaf_count;             // slots with a node.
+  DWORD removed_count;          // slots of the removed nodes.
+  FFS_LeafSlot slots[1];        // |slot_count| of them.
+};
+
+// A minimal perfect hash of the distinct directory hashes, or leaf hashes, of a frozen section,
+// see FFS_kFrozen and PerfectHash.h. It has one slot per hash and no empty ones: the hash picks a
+// bucket, the bucket has a pilot, and the hash and the pilot pick the slot. The slots are like
+// the ones of the index, an FFS_DirSlot or an FFS_LeafSlot. The few hashes that several
+// directories or nodes share get a slot without an offset or a node, and are looked up in the
+// index.
+struct FFS_PerfectHash {
+  DWORD key_count;              // distinct hashes and slots, 0 without a perfect hash.
+  DWORD bucket_count;
+  DWORD seed;
+  DWORD pad0;
+  FFS_OffsetPtr<DWORD> pilots;  // |bucket_count| of them.
+  FFS_Offset slots;             // |key_count| of them.
+};
+
+// A slot of FFS_Header::clients. Each client thread that reads the live section takes one, and
+// says in it which epoch it is reading in, so that the server does not reuse the memory it may
+// still be reading. See Epoch.h.
+struct FFS_ClientSlot {
+  DWORD process;                // id of the process that took the slot, 0 while it is free.
+  DWORD epoch;                  // FFS_Header::epoch when the client started reading, 0 while it
+                                // is not reading.
+};
+
+// The free memory of the live section, which the server hands out again for what it adds, see
+// Allocator.h. Each free block starts with the offset of the next one in its list, and the large
+// ones with their size after it. Only the server reads and writes them; the clients never see a
+// free block.
+struct FFS_FreeLists {
+  FFS_Offset small[FFS_kSizeClasses];   // a list of blocks of the same size per size class.
+  FFS_Offset large;             // the larger blocks and what is left of them, by offset.
+  FFS_Offset free_bytes;        // in all the lists.
+  FFS_Offset unmerged_bytes;    // freed since the adjacent blocks were last merged.
 };
 
 struct FFS_Header {
   DWORD magic;
   DWORD version;
+  DWORD offset_size;            // sizeof(FFS_Offset).
   DWORD status;
   DWORD num_nodes;
   DWORD num_dirs;
-  DWORD bytes;
-  DWORD root_offset;
-  DWORD pad0;
-  DWORD hash_tbl[FFS_BucketCount];
+  DWORD root_offset;            // ref of the root node.
+  DWORD filter;                 // PathFilter::fingerprint() of the patterns, 0 if none.
+  DWORD num_filtered;           // entries left out by the patterns in the last full scan. An
+                                // excluded directory counts as one.
+  DWORD dir_count;              // FFS_Dir entries in the table, one per directory listing.
+  DWORD layout;                 // FFS_Layout.
+  DWORD fields;                 // FFS_Fields stored.
+  DWORD hash_policy;            // FFS_HashPolicy of the hashes.
+  DWORD generation;             // odd while the server moves or relinks nodes, see BeginWrite().
+  FFS_Offset bytes;             // end of the nodes.
+  FFS_Offset used;
+  FFS_OffsetPtr<FFS_Dir> dir_table;
+  FFS_OffsetPtr<DWORD> dir_index;           // the sorted entry indexes of the directories.
+  FFS_Offset dir_slots_start;   // end of the sorted indexes, and the first directory index.
+  FFS_OffsetPtr<FFS_DirSlots> dir_slots;    // the directory index in use.
+  FFS_OffsetPtr<FFS_LeafSlots> leaf_slots;  // the leaf index in use, 0 without one.
+  FFS_PerfectHash frozen_dirs;  // with FFS_kFrozen.
+  FFS_PerfectHash frozen_leaves;  // with FFS_kFrozen and a leaf index.
+  FFS_Columns columns;          // with FFS_kLayoutColumns.
+  DWORD epoch;                  // advanced by the server as it frees memory, from 1.
+  DWORD nodes_added;            // records the server added after the scan, see Update.h.
+  DWORD server_process;         // id of the process of the server, see IsServerAlive().
+  FFS_ClientSlot clients[FFS_kMaxClients];
+  FFS_FreeLists free_lists;
 };
 
 enum FFS_Status {
@@ -24,5 +274,55 @@ enum FFS_Status {
   FFS_kError          = 2,
   FFS_kUpdating       = 3,
   FFS_kFinished       = 4,
+  // No more updates, and the lookups go through FFS_Header::frozen_dirs and frozen_leaves. See
+  // FreezeFFS().
   FFS_kFrozen         = 5,
 };
+
+// Snapshot files.
+//
+// A snapshot is the section image preceded by an FFS_FileHeader, padded so the image starts on a
+// page boundary. It can be mapped read-only and the FFS_Header at |image_offset| used in place.
+// The section table describes the parts of the image, each with a CRC32C of its bytes, so they
+// can be checked on their own. All the offsets in the table are from the start of the file.
+//
+// Alignment guarantees, relative to the start of the file:
+//   - the image, and so FFS_Header, is aligned to FFS_kFileAlignment.
+//   - every record and index entry is DWORD aligned, the index tables and the perfect hash slots
+//     8 bytes.
+//   - the FFS_Dir table is aligned to 16 bytes.
+enum FFS_FileConsts {
+  FFS_kFileMagic = 0x46534646,  // 'FFSF'
+  FFS_kFileVersion = 1,
+  FFS_kFileAlignment = 4096,
+  FFS_kMaxFileSections = 8,
+};
+
+enum FFS_FileSectionKind {
+  FFS_kSectionHeader = 1,       // the FFS_Header.
+  FFS_kSectionNodes = 2,        // the records, up to FFS_Header::dir_table.
+  FFS_kSectionDirSlots = 3,     // the index tables, perfect hashes and what the server added
+                                // since the scan, up to FFS_Header::used.
+  FFS_kSectionDirs = 4,         // the FFS_Dir table.
+  FFS_kSectionDirIndex = 5,     // the sorted entry indexes.
+};
+
+struct FFS_FileSection {
+  DWORD kind;
+  DWORD crc32c;
+  ULONGLONG offset;
+  ULONGLONG size;
+};
+
+struct FFS_FileHeader {
+  DWORD magic;
+  DWORD version;
+  DWORD header_size;            // sizeof(FFS_FileHeader).
+  DWORD header_crc32c;          // of this struct, with this field set to 0.
+  ULONGLONG file_size;
+  ULONGLONG image_offset;
+  ULONGLONG image_size;         // FFS_Header::used.
+  DWORD section_count;
+  DWORD pad0;
+  FFS_FileSection sections[FFS_kMaxFileSections];
+};
@@ -0,0 +1,386 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Linux main.
+//
+// There is no change monitoring on Linux yet. This builds the shared section for a tree in a POSIX
+// shared memory object, with the same format as the Windows server, and reports how long the scan
+// took so the scanner can be benchmarked on the build hosts. The object is removed when it exits.
+//
+// usage: ffs [--threads=n] [--bench-scan] [--bench-lookup] [--bench-layouts] [--bench-hashes]
+//            [--bench-freeze] [--bench-generations] [--bench-updates] [--bench-modified]
+//            [--bench-alloc] [--sync-stat] [--layout=records|columns] [--names=utf8|front]
+//            [--fields=client] [--hash=fnv1a|wy|crc32c] [--leaf-index] [--freeze]
+//            [--section-mb=n] [--snapshot=file] [--exclude=pattern] [--include=pattern] dir
+//        ffs --snapshot=file --query [--verify] path...
+//
+// --snapshot=file starts from the snapshot in |file| if there is one, like the Windows server, and
+// saves the section to it afterwards.
+//
+// --exclude and --include are the same as in the Windows server, see PathFilter.h.
+//
+// --query looks up the paths in the snapshot without scanning anything: the file is mapped
+// read-only and queried in place, all the paths together, see GetNodes(). --verify checks the
+// section checksums first. The top directory and the paths can be relative to the current
+// directory. The top directory is resolved with realpath() before the scan, and the paths are
+// made absolute.
+//
+// --bench-lookup times the lookups on the section once it is built, see Benchmarks.h.
+// --bench-generations checks that the clients never read a node half updated, see ReadPath().
+// --bench-updates checks that the clients never read memory the server reused, see Epoch.h.
+// --bench-modified times the notifications that a file was modified, from their arrival to the
+// clients seeing the new fields. --bench-alloc times the allocator of the section, see
+// Allocator.h.
+//
+// --layout picks the layout of the section, see FFS_Layout. --names=utf8 stores the names of the
+// columns as UTF-8 rather than as 4 byte wchar_t, see FFS_NameEncoding, and implies
+// --layout=columns. --names=front also front codes them, so that most names only take what they do
+// not share with the name before them. --fields=client leaves the creation and access times out
+// of the columns, see FFS_Fields, and implies --layout=columns. --bench-layouts builds the
+// section each way and compares them.
+//
+// --hash picks how the names and the directories are hashed, see FFS_HashPolicy. FNV-1a by
+// default. --bench-hashes times each one on the names of the section once it is built and
+// reports how evenly they spread.
+//
+// --leaf-index adds the leaf index to the section, see FFS_LeafSlots, so finding a file does not
+// depend on the size of its directory. It is left out by default to save memory.
+//
+// --freeze freezes the section once it is built, see FreezeFFS(), so that the snapshot saved has
+// the perfect hashes. --bench-freeze times the freezing and compares the lookups before and after.
+//
+// --section-mb sets the size of the shared memory object, 300 MB by default. It is sparse, so a big
+// one only costs what the section uses.
+//
+// --sync-stat makes the scanner use synchronous statx instead of io_uring, to compare the two. For
+// cold cache numbers drop the page cache (echo 3 > /proc/sys/vm/drop_caches) before each run.
+//
+
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Benchmarks.h"
+#include "FastFileStats.h"
+#include "Lookup.h"
+#include "PathFilter.h"
+#include "PerfectHash.h"
+#include "Scanner.h"
+#include "Section.h"
+#include "Snapshot.h"
+#include "StatEngine.h"
+#include "Utf8.h"
+
+namespace {
+
+struct Options {
+  ScanOptions scan;
+  PathFilter filter;
+  bool bench_scan;
+  bool bench_lookup;
+  bool bench_layouts;
+  bool bench_hashes;
+  bool bench_freeze;
+  bool bench_generations;
+  bool bench_updates;
+  bool bench_modified;
+  bool bench_alloc;
+  bool freeze;
+  bool query;
+  bool verify;
+  size_t section_size;
+  std::wstring snapshot;
+  std::wstring dir;
+  // The paths to query, or the top directory. As given, UTF-8.
+  std::vector<std::string> paths;
+};
+
+bool IsSwitch(const std::string& arg, const char* name, std::string* value) {
+  auto len = strlen(name);
+  if (arg.compare(0, len, name) != 0)
+    return false;
+  if (arg.size() == len)
+    return true;
+  if (arg[len] != '=')
+    return false;
+  *value = arg.substr(len + 1);
+  return true;
+}
+
+// |path| made absolute, relative to the current directory, and without the "." and ".."
+// components. The symbolic links stay, so a query for one finds the link. A trailing separator
+// stays too.
+std::string AbsolutePath(const std::string& path) {
+  std::string joined = path;
+  char cwd[PATH_MAX];
+  if ((path.empty() || (path[0] != '/')) && ::getcwd(cwd, sizeof(cwd)))
+    joined = std::string(cwd) + "/" + path;
+  std::string absolute;
+  size_t begin = 0;
+  while (begin < joined.size()) {
+    auto end = joined.find('/', begin);
+    if (end == std::string::npos)
+      end = joined.size();
+    auto name = joined.substr(begin, end - begin);
+    if (name == "..")
+      absolute.resize(std::min(absolute.size(), absolute.rfind('/')));
+    else if (!name.empty() && (name != "."))
+      absolute += "/" + name;
+    begin = end + 1;
+  }
+  // The root of the section is looked up with its trailing separator.
+  if (absolute.empty() || (joined[joined.size() - 1] == '/'))
+    absolute += "/";
+  return absolute;
+}
+
+// Returns false on a switch it does not know.
+bool ParseOptions(int argc, char* argv[], Options* opts) {
+  opts->scan.threads = DefaultScanThreads();
+  opts->scan.filter = &opts->filter;
+  opts->bench_scan = false;
+  opts->bench_lookup = false;
+  opts->bench_layouts = false;
+  opts->bench_hashes = false;
+  opts->bench_freeze = false;
+  opts->bench_generations = false;
+  opts->bench_updates = false;
+  opts->bench_modified = false;
+  opts->bench_alloc = false;
+  opts->freeze = false;
+  opts->scan.layout = FFS_kLayoutRecords;
+  opts->scan.names = FFS_kNamesWide;
+  opts->scan.fields = FFS_kAllFields;
+  opts->scan.hash_policy = FFS_kHashFnv1a;
+  opts->scan.leaf_index = false;
+  opts->query = false;
+  opts->verify = false;
+  opts->section_size = kMaxSharedSize;
+  std::string value;
+  for (int ix = 1; ix < argc; ++ix) {
+    std::string arg(argv[ix]);
+    if (IsSwitch(arg, "--threads", &value))
+      opts->scan.threads = std::max(1, atoi(value.c_str()));
+    else if (IsSwitch(arg, "--bench-scan", &value))
+      opts->bench_scan = true;
+    else if (IsSwitch(arg, "--bench-lookup", &value))
+      opts->bench_lookup = true;
+    else if (IsSwitch(arg, "--bench-layouts", &value))
+      opts->bench_layouts = true;
+    else if (IsSwitch(arg, "--bench-hashes", &value))
+      opts->bench_hashes = true;
+    else if (IsSwitch(arg, "--bench-freeze", &value))
+      opts->bench_freeze = true;
+    else if (IsSwitch(arg, "--bench-generations", &value))
+      opts->bench_generations = true;
+    else if (IsSwitch(arg, "--bench-updates", &value))
+      opts->bench_updates = true;
+    else if (IsSwitch(arg, "--bench-modified", &value))
+      opts->bench_modified = true;
+    else if (IsSwitch(arg, "--bench-alloc", &value))
+      opts->bench_alloc = true;
+    else if (IsSwitch(arg, "--layout", &value))
+      opts->scan.layout = (value == "columns") ? FFS_kLayoutColumns : FFS_kLayoutRecords;
+    else if (IsSwitch(arg, "--names", &value))
+      opts->scan.names = (value == "utf8")  ? FFS_kNamesUtf8 :
+                         (value == "front") ? FFS_kNamesFrontCoded : FFS_kNamesWide;
+    else if (IsSwitch(arg, "--fields", &value))
+      opts->scan.fields = (value == "client") ? FFS_kClientFields : FFS_kAllFields;
+    else if (IsSwitch(arg, "--hash", &value))
+      opts->scan.hash_policy = (value == "wy")     ? FFS_kHashWy :
+                               (value == "crc32c") ? FFS_kHashCrc32c : FFS_kHashFnv1a;
+    else if (IsSwitch(arg, "--leaf-index", &value))
+      opts->scan.leaf_index = true;
+    else if (IsSwitch(arg, "--freeze", &value))
+      opts->freeze = true;
+    else if (IsSwitch(arg, "--section-mb", &value))
+      opts->section_size = size_t(std::max(1, atoi(value.c_str()))) * 1024 * 1024;
+    else if (IsSwitch(arg, "--sync-stat", &value))
+      StatEngine::ForceSync(true);
+    else if (IsSwitch(arg, "--snapshot", &value))
+      opts->snapshot = FromUtf8(value);
+    else if (IsSwitch(arg, "--exclude", &value))
+      opts->filter.Add(FromUtf8(value), false);
+    else if (IsSwitch(arg, "--include", &value))
+      opts->filter.Add(FromUtf8(value), true);
+    else if (IsSwitch(arg, "--query", &value))
+      opts->query = true;
+    else if (IsSwitch(arg, "--verify", &value))
+      opts->verify = true;
+    else if (arg.compare(0, 2, "--") != 0)
+      opts->paths.push_back(arg);
+    else {
+      ::fprintf(stderr, "ffs: unknown switch %s\n", arg.c_str());
+      return false;
+    }
+  }
+  if ((opts->scan.names != FFS_kNamesWide) || (opts->scan.fields != FFS_kAllFields))
+    opts->scan.layout = FFS_kLayoutColumns;
+  // The lookups only take absolute paths, so the section has to be rooted at one.
+  char resolved[PATH_MAX];
+  if (!opts->query && !opts->paths.empty()) {
+    auto dir = opts->paths[0];
+    opts->dir = FromUtf8(::realpath(dir.c_str(), resolved) ? std::string(resolved) :
+                                                              AbsolutePath(dir));
+  }
+  // The section stores the top directory without the trailing separator.
+  while (opts->dir.size() > 1 && opts->dir[opts->dir.size() - 1] == kPathSep)
+    opts->dir.resize(opts->dir.size() - 1);
+  return true;
+}
+
+double NowMs() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Same as the --bench-scan of the Windows server.
+void BenchmarkScan(BYTE* start, size_t size, const wchar_t* dir, const ScanOptions& options) {
+  CreateFFS(start, size, dir, options);
+
+  for (DWORD threads = 1; threads <= options.threads; ++threads) {
+    ScanOptions pass = options;
+    pass.threads = threads;
+    auto before = NowMs();
+    if (!CreateFFS(start, size, dir, pass))
+      __debugbreak();
+    ::printf("ffs: scan with %u threads took %.0f ms\n", threads, NowMs() - before);
+  }
+}
+
+// The shared memory object is named after the top directory like the Windows section.
+std::string SectionName(const std::wstring& dir) {
+  std::string name = "/ffs_" + ToUtf8(dir);
+  for (size_t ix = 1; ix != name.size(); ++ix) {
+    if (name[ix] == '/')
+      name[ix] = '!';
+  }
+  return name;
+}
+
+// Removes the shared memory object when the driver exits, so that each run does not leave a
+// section behind in /dev/shm. A client that mapped it keeps its mapping.
+class SectionUnlinker {
+ public:
+  explicit SectionUnlinker(const std::string& name) : name_(name) {}
+  ~SectionUnlinker() { ::shm_unlink(name_.c_str()); }
+
+ private:
+  std::string name_;
+};
+
+// Prints the nodes for |paths| from the snapshot at |snapshot|.
+int Query(const std::wstring& snapshot, const std::vector<std::string>& paths, bool verify) {
+  SnapshotView view(snapshot.c_str(), verify);
+  if (!view.header()) {
+    ::fprintf(stderr, "ffs: %s is not a valid snapshot\n", ToUtf8(snapshot).c_str());
+    return 2;
+  }
+  std::vector<std::string> absolute_paths;
+  for (auto& path : paths)
+    absolute_paths.push_back(AbsolutePath(path));
+  std::vector<Utf8View> views(absolute_paths.begin(), absolute_paths.end());
+  std::vector<DWORD> nodes(paths.size());
+  GetNodes(view.header(), views.data(), views.size(), nodes.data());
+  for (size_t ix = 0; ix != paths.size(); ++ix) {
+    auto& path = paths[ix];
+    auto node = nodes[ix];
+    if (!node) {
+      ::printf("%s: not found\n", path.c_str());
+      continue;
+    }
+    WIN32_FIND_DATA found;
+    auto w32fd = &found;
+    ReadNode(view.header(), node, w32fd);
+    auto size = (ULONGLONG(w32fd->nFileSizeHigh) << 32) | w32fd->nFileSizeLow;
+    auto mtime = (ULONGLONG(w32fd->ftLastWriteTime.dwHighDateTime) << 32) |
+                 w32fd->ftLastWriteTime.dwLowDateTime;
+    ::printf("%s: attributes %#x, %llu bytes, modified %llu\n", path.c_str(),
+             w32fd->dwFileAttributes, (unsigned long long)size, (unsigned long long)mtime);
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options opts;
+  bool parsed = ParseOptions(argc, argv, &opts);
+  if (parsed && opts.query && !opts.snapshot.empty())
+    return Query(opts.snapshot, opts.paths, opts.verify);
+  if (!parsed || opts.dir.empty()) {
+    ::fprintf(stderr, "usage: ffs [--threads=n] [--bench-scan] [--bench-lookup] [--bench-layouts]\n"
+                      "           [--bench-hashes] [--bench-freeze] [--bench-generations]\n"
+                      "           [--bench-updates] [--bench-modified] [--bench-alloc]\n"
+                      "           [--sync-stat] [--layout=records|columns] [--names=utf8|front]\n"
+                      "           [--fields=client] [--hash=fnv1a|wy|crc32c] [--leaf-index]\n"
+                      "           [--freeze] [--section-mb=n] [--snapshot=file]\n"
+                      "           [--exclude=pattern] [--include=pattern] dir\n"
+                      "       ffs --snapshot=file --query [--verify] path...\n");
+    return 1;
+  }
+
+  auto name = SectionName(opts.dir);
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return 1;
+  SectionUnlinker unlinker(name);
+  if (::ftruncate(fd, off_t(opts.section_size)) != 0)
+    return 1;
+  auto start = reinterpret_cast<BYTE*>(::mmap(nullptr, opts.section_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_NORESERVE, fd, 0));
+  ::close(fd);
+  if (start == MAP_FAILED)
+    return 1;
+
+  if (opts.bench_scan) {
+    BenchmarkScan(start, opts.section_size, opts.dir.c_str(), opts.scan);
+    return 0;
+  }
+  if (opts.bench_layouts) {
+    BenchmarkLayouts(opts.dir.c_str(), opts.scan);
+    return 0;
+  }
+
+  auto before = NowMs();
+  auto snapshot = opts.snapshot.empty() ? nullptr : opts.snapshot.c_str();
+  bool warm = snapshot &&
+      LoadSnapshot(start, opts.section_size, opts.dir.c_str(), snapshot, opts.scan);
+  if (!warm && !CreateFFS(start, opts.section_size, opts.dir.c_str(), opts.scan))
+    return 3;
+
+  auto header = reinterpret_cast<const FFS_Header*>(start);
+  ::printf("ffs: %s has %u nodes, %u dirs, %llu bytes, %u filtered out. %s took %.0f ms\n",
+           name.c_str(), header->num_nodes, header->num_dirs, (unsigned long long)header->bytes,
+           header->num_filtered, warm ? "revalidation" : "scan", NowMs() - before);
+
+  if (opts.bench_lookup)
+    BenchmarkLookups(header);
+  if (opts.bench_hashes)
+    BenchmarkHashes(header);
+  if (opts.bench_freeze)
+    BenchmarkFreeze(header);
+  if (opts.bench_generations)
+    BenchmarkGenerations(header);
+  if (opts.bench_updates)
+    BenchmarkUpdates(header);
+  if (opts.bench_modified)
+    BenchmarkModified(header);
+  if (opts.bench_alloc)
+    BenchmarkAllocator(header);
+  if (opts.freeze && !FreezeFFS(reinterpret_cast<FFS_Header*>(start), opts.section_size))
+    return 5;
+
+  if (snapshot && !SaveSnapshot(header, snapshot))
+    return 4;
+  return 0;
+}
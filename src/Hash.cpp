@@ -0,0 +1,106 @@
+// The hash kernels that are not inline, see Hash.h.
+
+#include "stdafx.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <nmmintrin.h>
+#define FFS_CRC32_INSTRUCTION
+#endif
+
+#include "Hash.h"
+
+namespace {
+
+// Slicing-by-8 CRC32C, the tables are built once at startup.
+class Crc32cTables {
+ public:
+  Crc32cTables() {
+    for (DWORD ix = 0; ix != 256; ++ix) {
+      DWORD crc = ix;
+      for (int bit = 0; bit != 8; ++bit)
+        crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+      table_[0][ix] = crc;
+    }
+    for (int slice = 1; slice != 8; ++slice) {
+      for (DWORD ix = 0; ix != 256; ++ix) {
+        DWORD prev = table_[slice - 1][ix];
+        table_[slice][ix] = (prev >> 8) ^ table_[0][prev & 0xff];
+      }
+    }
+  }
+
+  DWORD Compute(const BYTE* data, size_t size) const {
+    DWORD crc = ~DWORD(0);
+    for (; size && (ULONG_PTR(data) & 7); --size)
+      crc = table_[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    for (; size >= 8; size -= 8, data += 8) {
+      DWORD lo, hi;
+      memcpy(&lo, data, 4);
+      memcpy(&hi, data + 4, 4);
+      lo ^= crc;
+      crc = table_[7][lo & 0xff] ^ table_[6][(lo >> 8) & 0xff] ^
+            table_[5][(lo >> 16) & 0xff] ^ table_[4][lo >> 24] ^
+            table_[3][hi & 0xff] ^ table_[2][(hi >> 8) & 0xff] ^
+            table_[1][(hi >> 16) & 0xff] ^ table_[0][hi >> 24];
+    }
+    for (; size; --size)
+      crc = table_[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+
+ private:
+  DWORD table_[8][256];
+};
+
+const Crc32cTables crc32c_tables;
+
+#if defined(FFS_CRC32_INSTRUCTION)
+
+bool DetectCrc32Instruction() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// The compiler is not told to use SSE 4.2 anywhere else, so only this function can have it.
+#if defined(__GNUC__)
+__attribute__((target("sse4.2")))
+#endif
+DWORD Crc32cInstruction(const BYTE* data, size_t size) {
+  ULONGLONG crc = ~DWORD(0);
+  for (; size >= 8; size -= 8, data += 8) {
+    ULONGLONG word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+  auto crc32 = DWORD(crc);
+  for (; size; --size)
+    crc32 = _mm_crc32_u8(crc32, *data++);
+  return ~crc32;
+}
+
+const bool has_crc32_instruction = DetectCrc32Instruction();
+
+#else
+
+const bool has_crc32_instruction = false;
+
+#endif
+
+}  // namespace
+
+DWORD Crc32c(const BYTE* data, size_t size) {
+#if defined(FFS_CRC32_INSTRUCTION)
+  if (has_crc32_instruction)
+    return Crc32cInstruction(data, size);
+#endif
+  return crc32c_tables.Compute(data, size);
+}
+
+bool HasCrc32Instruction() {
+  return has_crc32_instruction;
+}
@@ -0,0 +1,445 @@
+#pragma once
+
+// Read access to the nodes of the section in either layout, see FFS_Layout.
+//
+// A node is named by a DWORD ref, which is the offset of its record with FFS_kLayoutRecords and
+// its index in the columns with FFS_kLayoutColumns. 0 is never a node. The parent of a node is
+// the ref of the entry for its directory in the listing of the parent directory, and the parent
+// of the root node is 0. So is the parent of a node the server removed, see Update.h. The sibling
+// walks with Next() are only for the sections as the scan lays them out.
+//
+// The lookups are templates over these classes so each layout gets its own code. They all have
+// the same members. Char is the unit of the names: wchar_t, or char for the UTF-8 names of the
+// columns, see FFS_NameEncoding.
+//
+// Names are compared through a Key made once per lookup with MakeKey(). With the records it is
+// the name itself. The columns intern the names, so there the key also has the position of the
+// name in the pool and telling if a node has that name is an integer compare; a name that is
+// not in the pool is not in the tree at all. The front coded columns trade the interning for a
+// smaller pool: their names are decoded from the restart entry of their group on each compare.
+
+#include <algorithm>
+
+#include "FastFileStats.h"
+#include "Hash.h"
+#include "Section.h"
+#include "Utf8.h"
+
+inline ULONGLONG ToULL(const FILETIME& ft) {
+  return (ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+inline FILETIME ToFileTime(ULONGLONG time) {
+  FILETIME ft = {DWORD(time), DWORD(time >> 32)};
+  return ft;
+}
+
+// Compares the zero terminated |name| with the |len| units at |key|, like wcscmp().
+inline int CompareName(const wchar_t* name, const wchar_t* key, size_t len) {
+  auto cmp = wcsncmp(name, key, len);
+  if (cmp)
+    return cmp;
+  return name[len] ? 1 : 0;
+}
+
+// The UTF-8 names are compared as unsigned bytes, which is the order of the code points and so
+// the same order as wcscmp() where wchar_t is UTF-32.
+inline int CompareName(const char* name, size_t name_len, const char* key, size_t len) {
+  auto cmp = memcmp(name, key, std::min(name_len, len));
+  if (cmp)
+    return cmp;
+  return (name_len < len) ? -1 : (name_len > len) ? 1 : 0;
+}
+
+// The entries of the UTF-8 pool are the length of the name as a base 128 varint, low bits first,
+// then the name without a terminator.
+inline size_t PutNameLength(size_t len, char* dest) {
+  size_t out = 0;
+  for (; len >= 0x80; len >>= 7)
+    dest[out++] = char(0x80 | (len & 0x7F));
+  dest[out++] = char(len);
+  return out;
+}
+
+inline const char* GetNameLength(const char* src, size_t* len) {
+  auto bytes = reinterpret_cast<const unsigned char*>(src);
+  size_t value = 0;
+  int shift = 0;
+  for (; *bytes & 0x80; ++bytes, shift += 7)
+    value |= size_t(*bytes & 0x7F) << shift;
+  *len = value | (size_t(*bytes) << shift);
+  return reinterpret_cast<const char*>(bytes + 1);
+}
+
+class RecordNodes {
+ public:
+  typedef wchar_t Char;
+  // Whether the sorted indexes keep the nodes the server removed, see Update.h.
+  static const bool kKeepsRemoved = false;
+
+  explicit RecordNodes(const FFS_Header* header)
+      : base_(reinterpret_cast<const BYTE*>(header)), end_(base_ + header->bytes) {}
+
+  const WIN32_FIND_DATA* Record(DWORD node) const {
+    return reinterpret_cast<const WIN32_FIND_DATA*>(base_ + node);
+  }
+
+  const wchar_t* Name(DWORD node) const { return Record(node)->cFileName; }
+
+  // Prefetches what the lookups read first of |node|.
+  void Prefetch(DWORD node) const { ::Prefetch(Record(node)); }
+  DWORD Parent(DWORD node) const { return Record(node)->dwReserved0; }
+  DWORD Attributes(DWORD node) const { return Record(node)->dwFileAttributes; }
+  ULONGLONG WriteTime(DWORD node) const { return ToULL(Record(node)->ftLastWriteTime); }
+
+  ULONGLONG Size(DWORD node) const {
+    return (ULONGLONG(Record(node)->nFileSizeHigh) << 32) | Record(node)->nFileSizeLow;
+  }
+
+  struct Key {
+    const wchar_t* name;
+    size_t len;
+  };
+
+  // |name| has |len| units and is not zero terminated.
+  Key MakeKey(const wchar_t* name, size_t len) const {
+    Key key = {name, len};
+    return key;
+  }
+
+  // False if no node can match |key|.
+  bool MayMatch(const Key&) const { return true; }
+
+  bool Matches(DWORD node, const Key& key) const { return !Compare(node, key); }
+
+  // For names compared once, where making the key would cost more than the compare.
+  bool NameIs(DWORD node, const wchar_t* name, size_t len) const {
+    return !CompareName(Name(node), name, len);
+  }
+
+  // The order of the sorted indexes.
+  int Compare(DWORD node, const Key& key) const {
+    return CompareName(Name(node), key.name, key.len);
+  }
+
+  // The node after |node| in its listing, or 0.
+  DWORD Next(DWORD node) const {
+    auto next = AdvanceNext(Record(node));
+    if ((reinterpret_cast<const BYTE*>(next) >= end_) || (next->dwReserved0 != Parent(node)))
+      return 0;
+    return DWORD(reinterpret_cast<const BYTE*>(next) - base_);
+  }
+
+  // Fills |w32fd| up to and including the name. The links are left as they are in the section.
+  void Read(DWORD node, WIN32_FIND_DATA* w32fd) const {
+    auto rec = Record(node);
+    memcpy(w32fd, rec, reinterpret_cast<const BYTE*>(AdvanceNext(rec)) -
+                       reinterpret_cast<const BYTE*>(rec));
+  }
+
+ private:
+  const BYTE* base_;
+  const BYTE* end_;
+};
+
+// The name pools of the columns, see FFS_NameEncoding. The names are at a position in units.
+class WideNamePool {
+ public:
+  typedef wchar_t Char;
+
+  explicit WideNamePool(const wchar_t* pool) : pool_(pool) {}
+
+  bool Equals(DWORD pos, const wchar_t* name, size_t len) const {
+    return !CompareName(pool_ + pos, name, len);
+  }
+
+  int Compare(DWORD pos, const wchar_t* name, size_t len) const {
+    return CompareName(pool_ + pos, name, len);
+  }
+
+  void Read(DWORD pos, wchar_t* dest) const {
+    wmemcpy(dest, pool_ + pos, wcslen(pool_ + pos) + 1);
+  }
+
+ private:
+  const wchar_t* pool_;
+};
+
+class Utf8NamePool {
+ public:
+  typedef char Char;
+
+  explicit Utf8NamePool(const char* pool) : pool_(pool) {}
+
+  bool Equals(DWORD pos, const char* name, size_t len) const {
+    size_t pooled_len;
+    auto pooled = GetNameLength(pool_ + pos, &pooled_len);
+    return (pooled_len == len) && !memcmp(pooled, name, len);
+  }
+
+  int Compare(DWORD pos, const char* name, size_t len) const {
+    size_t pooled_len;
+    auto pooled = GetNameLength(pool_ + pos, &pooled_len);
+    return CompareName(pooled, pooled_len, name, len);
+  }
+
+  void Read(DWORD pos, wchar_t* dest) const {
+    size_t len;
+    auto name = GetNameLength(pool_ + pos, &len);
+    DecodeUtf8(name, len, dest);
+  }
+
+ private:
+  const char* pool_;
+};
+
+// The fields a section is built with, FFS_Fields, as a type so the code that writes the nodes is
+// compiled for the fields it stores and the ones it leaves out cost nothing.
+template <DWORD Fields>
+struct FieldSet {
+  static const DWORD kMask = Fields;
+  static const bool kCreationTime = (Fields & FFS_kFieldCreationTime) != 0;
+  static const bool kAccessTime = (Fields & FFS_kFieldAccessTime) != 0;
+};
+
+typedef FieldSet<FFS_kAllFields> AllFields;
+typedef FieldSet<FFS_kClientFields> ClientFields;
+
+// The arrays of the columns but the names.
+class ColumnArrays {
+ public:
+  explicit ColumnArrays(const FFS_Header* header) {
+    auto& columns = header->columns;
+    attributes_ = columns.attributes.Get(header);
+    size_ = columns.size.Get(header);
+    creation_time_ = columns.creation_time ? columns.creation_time.Get(header) : nullptr;
+    access_time_ = columns.access_time ? columns.access_time.Get(header) : nullptr;
+    write_time_ = columns.write_time.Get(header);
+    parent_ = columns.parent.Get(header);
+    next_ = columns.next.Get(header);
+    name_ = columns.name.Get(header);
+  }
+
+  DWORD Parent(DWORD node) const { return parent_[node]; }
+  DWORD Attributes(DWORD node) const { return attributes_[node]; }
+  ULONGLONG WriteTime(DWORD node) const { return write_time_[node]; }
+  ULONGLONG Size(DWORD node) const { return size_[node]; }
+  DWORD Next(DWORD node) const { return next_[node]; }
+
+  void Prefetch(DWORD node) const {
+    ::Prefetch(&attributes_[node]);
+    ::Prefetch(&parent_[node]);
+    ::Prefetch(&name_[node]);
+  }
+
+  // For the scans over a single field.
+  const ULONGLONG* write_times() const { return write_time_; }
+
+ protected:
+  // Fills |w32fd| but the name.
+  void ReadFields(DWORD node, WIN32_FIND_DATA* w32fd) const {
+    w32fd->dwFileAttributes = attributes_[node];
+    w32fd->ftCreationTime = ToFileTime(creation_time_ ? creation_time_[node] : 0);
+    w32fd->ftLastAccessTime = ToFileTime(access_time_ ? access_time_[node] : 0);
+    w32fd->ftLastWriteTime = ToFileTime(write_time_[node]);
+    w32fd->nFileSizeHigh = DWORD(size_[node] >> 32);
+    w32fd->nFileSizeLow = DWORD(size_[node]);
+    w32fd->dwReserved0 = parent_[node];
+    w32fd->dwReserved1 = 0;
+  }
+
+  const DWORD* name_;
+
+ private:
+  const DWORD* attributes_;
+  const ULONGLONG* size_;
+  const ULONGLONG* creation_time_;
+  const ULONGLONG* access_time_;
+  const ULONGLONG* write_time_;
+  const DWORD* parent_;
+  const DWORD* next_;
+};
+
+// The columns with interned names.
+template <typename NamePool>
+class ColumnNodes : public ColumnArrays {
+ public:
+  typedef typename NamePool::Char Char;
+  static const bool kKeepsRemoved = false;
+
+  explicit ColumnNodes(const FFS_Header* header)
+      : ColumnArrays(header),
+        names_(reinterpret_cast<const Char*>(header->columns.name_pool.Get(header))),
+        hash_policy_(header->hash_policy) {
+    name_table_ = header->columns.name_table.Get(header);
+    name_mask_ = header->columns.name_table_size - 1;
+  }
+
+  // The position of the name in the pool, or kNoName, and the name itself for the compares.
+  struct Key {
+    DWORD pos;
+    const Char* name;
+    size_t len;
+  };
+  static const DWORD kNoName = 0xFFFFFFFF;
+
+  Key MakeKey(const Char* name, size_t len) const {
+    Key key = {kNoName, name, len};
+    auto hash = NameHash(hash_policy_, name, len);
+    for (auto slot = hash & name_mask_; name_table_[slot].name; slot = (slot + 1) & name_mask_) {
+      auto pos = name_table_[slot].name - 1;
+      if ((name_table_[slot].hash == hash) && names_.Equals(pos, name, len)) {
+        key.pos = pos;
+        break;
+      }
+    }
+    return key;
+  }
+
+  bool MayMatch(const Key& key) const { return key.pos != kNoName; }
+  bool Matches(DWORD node, const Key& key) const { return name_[node] == key.pos; }
+
+  bool NameIs(DWORD node, const Char* name, size_t len) const {
+    return names_.Equals(name_[node], name, len);
+  }
+
+  int Compare(DWORD node, const Key& key) const {
+    if (name_[node] == key.pos)
+      return 0;
+    return names_.Compare(name_[node], key.name, key.len);
+  }
+
+  void Read(DWORD node, WIN32_FIND_DATA* w32fd) const {
+    ReadFields(node, w32fd);
+    names_.Read(name_[node], w32fd->cFileName);
+  }
+
+ private:
+  NamePool names_;
+  const FFS_NameSlot* name_table_;
+  DWORD name_mask_;
+  // FFS_Header::hash_policy, for MakeKey().
+  DWORD hash_policy_;
+};
+
+typedef ColumnNodes<WideNamePool> WideColumnNodes;
+typedef ColumnNodes<Utf8NamePool> Utf8ColumnNodes;
+
+// The entries of the front coded pool, see FFS_kNamesFrontCoded: how far back the restart entry
+// is, the length of the prefix shared with the previous entry and the rest of the name.
+inline size_t PutFrontCodedEntry(DWORD back, size_t shared, const char* suffix, size_t len,
+                                 char* dest) {
+  size_t out = PutNameLength(back, dest);
+  out += PutNameLength(shared, dest + out);
+  out += PutNameLength(len, dest + out);
+  memcpy(dest + out, suffix, len);
+  return out + len;
+}
+
+// The columns with front coded UTF-8 names. Decoding a name starts at the restart entry of its
+// group, which has the whole name, and applies the entries up to the node.
+class FrontCodedColumnNodes : public ColumnArrays {
+ public:
+  typedef char Char;
+  // The listings are binary searched as runs of nodes, so they cannot lose any.
+  static const bool kKeepsRemoved = true;
+
+  explicit FrontCodedColumnNodes(const FFS_Header* header)
+      : ColumnArrays(header),
+        pool_(reinterpret_cast<const char*>(header->columns.name_pool.Get(header))),
+        restart_interval_(header->columns.restart_interval) {}
+
+  // A name of |len| bytes, the names in the pool are not interned.
+  struct Key {
+    const char* name;
+    size_t len;
+  };
+
+  Key MakeKey(const char* name, size_t len) const {
+    Key key = {name, len};
+    return key;
+  }
+
+  bool MayMatch(const Key&) const { return true; }
+  bool Matches(DWORD node, const Key& key) const { return !Compare(node, key); }
+
+  bool NameIs(DWORD node, const char* name, size_t len) const {
+    Key key = {name, len};
+    return Matches(node, key);
+  }
+
+  int Compare(DWORD node, const Key& key) const {
+    char name[kMaxName];
+    auto len = Decode(node, name);
+    return CompareName(name, len, key.name, key.len);
+  }
+
+  // The position among the |count| sorted entries from node |first| of the first one that is
+  // not less than |key|. The binary search is over the restart entries, which are the first
+  // entry of each listing and then one in every |restart_interval| of the sorted entries and
+  // have the whole name, and then the group that can have |key| is decoded in one pass.
+  DWORD LowerBound(DWORD first, DWORD count, const Key& key) const {
+    auto interval = restart_interval_;
+    DWORD lo = 0;
+    DWORD hi = (count + interval - 1) / interval;
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      size_t back, shared, len;
+      auto name = GetNameLength(
+          GetNameLength(GetNameLength(pool_ + name_[first + mid * interval], &back), &shared),
+          &len);
+      if (CompareName(name, len, key.name, key.len) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    // The restart of group |lo| is not less than |key| and the one before is.
+    if (!lo)
+      return 0;
+    auto pos = (lo - 1) * interval;
+    auto end = std::min(count, pos + interval);
+    char name[kMaxName];
+    size_t len = 0;
+    auto entry = Apply(pool_ + name_[first + pos], name, &len);
+    for (++pos; pos != end; ++pos) {
+      entry = Apply(entry, name, &len);
+      if (CompareName(name, len, key.name, key.len) >= 0)
+        return pos;
+    }
+    return end;
+  }
+
+  void Read(DWORD node, WIN32_FIND_DATA* w32fd) const {
+    ReadFields(node, w32fd);
+    char name[kMaxName];
+    DecodeUtf8(name, Decode(node, name), w32fd->cFileName);
+  }
+
+ private:
+  // The names are at most MAX_PATH characters, as UTF-8.
+  static const size_t kMaxName = MAX_PATH * 4;
+
+  // Updates |name|, the name of the entry before |entry|, to the name of |entry|. Returns the
+  // entry after it.
+  static const char* Apply(const char* entry, char* name, size_t* len) {
+    size_t back, shared, suffix_len;
+    auto suffix = GetNameLength(GetNameLength(GetNameLength(entry, &back), &shared), &suffix_len);
+    memcpy(name + shared, suffix, suffix_len);
+    *len = shared + suffix_len;
+    return suffix + suffix_len;
+  }
+
+  // Writes the name of |node| to |name| and returns its length.
+  size_t Decode(DWORD node, char* name) const {
+    auto target = pool_ + name_[node];
+    size_t back;
+    GetNameLength(target, &back);
+    size_t len = 0;
+    for (auto entry = target - back; entry <= target;)
+      entry = Apply(entry, name, &len);
+    return len;
+  }
+
+  const char* pool_;
+  DWORD restart_interval_;
+};
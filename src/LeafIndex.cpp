@@ -0,0 +1,78 @@
+// The leaf index of the section.
+
+#include "stdafx.h"
+
+#include "Allocator.h"
+#include "LeafIndex.h"
+
+DWORD LeafSlotCount(DWORD leaves) {
+  DWORD slots = 16;
+  while (slots < leaves * 2)
+    slots *= 2;
+  return slots;
+}
+
+FFS_Offset LeafSlotsSize(DWORD slot_count) {
+  return sizeof(FFS_LeafSlots) + FFS_Offset(slot_count - 1) * sizeof(FFS_LeafSlot);
+}
+
+void InitLeafSlots(FFS_LeafSlots* table, DWORD slot_count) {
+  memset(table, 0, size_t(LeafSlotsSize(slot_count)));
+  table->slot_count = slot_count;
+}
+
+void InsertLeafSlot(FFS_LeafSlots* table, DWORD hash, DWORD dir_anchor, DWORD node) {
+  auto mask = table->slot_count - 1;
+  auto slot = hash & mask;
+  while (table->slots[slot].node)
+    slot = (slot + 1) & mask;
+  // The key has to be there by the time a client sees the node.
+  table->slots[slot].hash = hash;
+  table->slots[slot].dir = dir_anchor;
+  StoreRelease(&table->slots[slot].node, node);
+  ++table->leaf_count;
+}
+
+bool IndexLeaf(FFS_Header* header, size_t size, const FFS_Dir* dir, DWORD node, DWORD name_hash) {
+  if (!header->leaf_slots)
+    return true;
+  auto table = header->leaf_slots.Get(header);
+  if ((table->leaf_count + table->removed_count + 1) * 2 > table->slot_count) {
+    // Like IndexDir(), the old table stays as it is for the clients that are still in it, and
+    // the new one is the same size when the nodes left take a quarter of it at most.
+    auto slot_count = table->slot_count;
+    if ((table->leaf_count + 1) * 4 > slot_count)
+      slot_count *= 2;
+    auto offset = AllocateBlock(header, size, LeafSlotsSize(slot_count), kAnyOffset);
+    if (!offset)
+      return false;
+    auto rebuilt = reinterpret_cast<FFS_LeafSlots*>(reinterpret_cast<BYTE*>(header) + offset);
+    InitLeafSlots(rebuilt, slot_count);
+    for (DWORD ix = 0; ix != table->slot_count; ++ix) {
+      auto& slot = table->slots[ix];
+      if (slot.node && slot.dir)
+        InsertLeafSlot(rebuilt, slot.hash, slot.dir, slot.node);
+    }
+    StoreRelease(&header->leaf_slots.offset, offset);
+    table = rebuilt;
+  }
+  InsertLeafSlot(table, CombineHash(dir->hash, name_hash), dir->anchor, node);
+  return true;
+}
+
+void UnindexLeaf(FFS_Header* header, const FFS_Dir* dir, DWORD node, DWORD name_hash) {
+  if (!header->leaf_slots)
+    return;
+  auto table = header->leaf_slots.Get(header);
+  auto hash = CombineHash(dir->hash, name_hash);
+  auto mask = table->slot_count - 1;
+  for (auto slot = hash & mask; table->slots[slot].node; slot = (slot + 1) & mask) {
+    auto& leaf = table->slots[slot];
+    if ((leaf.node == node) && (leaf.dir == dir->anchor)) {
+      StoreRelease(&leaf.dir, 0);
+      --table->leaf_count;
+      ++table->removed_count;
+      return;
+    }
+  }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+// The leaf index of the section, see FFS_LeafSlots. It is optional and works like the directory
+// index of DirIndex.h: the server fills the first table at the end of the scan and adds the nodes
+// it learns about with IndexLeaf(), and the clients read it through LeafCandidates without
+// waiting for the server.
+
+#include "FastFileStats.h"
+#include "Hash.h"
+#include "PerfectHash.h"
+#include "Section.h"
+
+// The slots of a table for |leaves| nodes, a power of 2 at least twice as many.
+DWORD LeafSlotCount(DWORD leaves);
+
+// The bytes of a table of |slot_count| slots.
+FFS_Offset LeafSlotsSize(DWORD slot_count);
+
+// Writes an empty table of |slot_count| slots at |table|.
+void InitLeafSlots(FFS_LeafSlots* table, DWORD slot_count);
+
+// Adds |node|, in the directory with |dir_anchor| and |hash|, see FFS_LeafSlot, to |table|. The
+// table must stay at most half full.
+void InsertLeafSlot(FFS_LeafSlots* table, DWORD hash, DWORD dir_anchor, DWORD node);
+
+// Adds |node|, named with |name_hash| in |dir|, to the leaf index of the live section at
+// |header|, which is |size| bytes. Does nothing if the section has no leaf index. A full table is
+// replaced by a new one without the removed nodes, like in IndexDir(). Returns false if there is
+// no room; the node is not indexed then.
+bool IndexLeaf(FFS_Header* header, size_t size, const FFS_Dir* dir, DWORD node, DWORD name_hash);
+
+// Removes |node|, named with |name_hash| in |dir|, from the leaf index of the live section at
+// |header|. Its slot stays in the probe chains, with a directory no lookup matches, until the
+// table is replaced.
+void UnindexLeaf(FFS_Header* header, const FFS_Dir* dir, DWORD node, DWORD name_hash);
+
+// Prefetches the slot a lookup of the node named with |name_hash| in |dir| reads first, or its
+// pilot in a frozen section.
+inline void PrefetchLeafSlot(const FFS_Header* header, const FFS_Dir* dir, DWORD name_hash) {
+  auto hash = CombineHash(dir->hash, name_hash);
+  if (LoadAcquire(&header->frozen_leaves.key_count)) {
+    PrefetchPerfectHash(header, header->frozen_leaves, hash);
+    return;
+  }
+  FFS_OffsetPtr<FFS_LeafSlots> table = {LoadAcquire(&header->leaf_slots.offset)};
+  auto slots = table.Get(header);
+  Prefetch(&slots->slots[hash & (slots->slot_count - 1)]);
+}
+
+// The nodes of the leaf index in a directory with a given name hash, in probe order. They still
+// have to be compared by name. The table is read once, and a frozen section has the one slot to
+// look at, like in DirCandidates.
+class LeafCandidates {
+ public:
+  LeafCandidates(const FFS_Header* header, const FFS_Dir* dir, DWORD name_hash)
+      : slots_(nullptr), frozen_(), dir_(dir->anchor), hash_(CombineHash(dir->hash, name_hash)),
+        mask_(0), slot_(0) {
+    if (LoadAcquire(&header->frozen_leaves.key_count)) {
+      auto& perfect = header->frozen_leaves;
+      FFS_OffsetPtr<FFS_LeafSlot> slots = {perfect.slots};
+      frozen_ = slots.Get(header)[PerfectHashSlot(header, perfect, hash_)];
+      if (frozen_.node || (frozen_.hash != hash_)) {
+        if ((frozen_.hash != hash_) || (frozen_.dir != dir_))
+          frozen_.node = 0;
+        return;
+      }
+    }
+    FFS_OffsetPtr<FFS_LeafSlots> table = {LoadAcquire(&header->leaf_slots.offset)};
+    slots_ = table.Get(header)->slots;
+    mask_ = table.Get(header)->slot_count - 1;
+    slot_ = hash_ & mask_;
+  }
+
+  // Returns the next node, or 0 once an empty slot is reached.
+  DWORD Next() {
+    if (!slots_) {
+      auto node = frozen_.node;
+      frozen_.node = 0;
+      return node;
+    }
+    while (true) {
+      auto& slot = slots_[slot_];
+      auto node = LoadAcquire(&slot.node);
+      if (!node)
+        return 0;
+      slot_ = (slot_ + 1) & mask_;
+      if ((slot.hash == hash_) && (slot.dir == dir_))
+        return node;
+    }
+  }
+
+ private:
+  const FFS_LeafSlot* slots_;   // null with a frozen slot.
+  FFS_LeafSlot frozen_;
+  DWORD dir_;
+  DWORD hash_;
+  DWORD mask_;
+  DWORD slot_;
+};
@@ -0,0 +1,631 @@
+// Lookups in the shared section.
+//
+// Every lookup is a template over the node accessors of Layout.h, instantiated for each layout
+// and name encoding by the functions at the bottom. The paths and names are converted to the
+// encoding of the section first if they are not in it already.
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DirIndex.h"
+#include "Epoch.h"
+#include "FastFileStats.h"
+#include "Layout.h"
+#include "LeafIndex.h"
+#include "Lookup.h"
+#include "Section.h"
+#include "Utf8.h"
+
+namespace {
+
+enum Accessors {
+  kRecords,
+  kWideColumns,
+  kUtf8Columns,
+  kFrontCodedColumns,
+};
+
+Accessors AccessorsFor(const FFS_Header* header) {
+  if (header->layout != FFS_kLayoutColumns)
+    return kRecords;
+  switch (header->columns.names) {
+    case FFS_kNamesUtf8:
+      return kUtf8Columns;
+    case FFS_kNamesFrontCoded:
+      return kFrontCodedColumns;
+    default:
+      return kWideColumns;
+  }
+}
+
+// A path or a name converted to UTF-8, on the stack unless it is longer than kLookupStackUnits.
+class Utf8Copy {
+ public:
+  explicit Utf8Copy(WideView wide) : data_(stack_) {
+    if (wide.size > kLookupStackUnits) {
+      heap_.reset(new char[wide.size * kMaxUtf8PerUnit]);
+      data_ = heap_.get();
+    }
+    size_ = EncodeUtf8(wide.data, wide.size, data_);
+  }
+
+  Utf8View view() const { return Utf8View(data_, size_); }
+
+ private:
+  char stack_[kLookupStackUnits * kMaxUtf8PerUnit];
+  std::unique_ptr<char[]> heap_;
+  char* data_;
+  size_t size_;
+};
+
+// Same the other way.
+class WideCopy {
+ public:
+  explicit WideCopy(Utf8View utf8) : data_(stack_) {
+    if (utf8.size > kLookupStackUnits) {
+      heap_.reset(new wchar_t[utf8.size + 1]);
+      data_ = heap_.get();
+    }
+    size_ = DecodeUtf8(utf8.data, utf8.size, data_);
+  }
+
+  WideView view() const { return WideView(data_, size_); }
+
+ private:
+  wchar_t stack_[kLookupStackUnits + 1];
+  std::unique_ptr<wchar_t[]> heap_;
+  wchar_t* data_;
+  size_t size_;
+};
+
+// Returns the position of the last separator in the first |len| units of |path|, or |len|.
+template <typename Char>
+size_t LastSeparator(const Char* path, size_t len) {
+  for (auto pos = len; pos; --pos) {
+    if (path[pos - 1] == Char(kPathSep))
+      return pos - 1;
+  }
+  return len;
+}
+
+// Hashes the directories of |path| with |policy| as it finds the separators. Returns the
+// position of the last separator, or |len| if there is none, and sets |*hash| to the PathHash()
+// of the units before it.
+template <typename Char>
+size_t HashDirs(DWORD policy, const Char* path, size_t len, DWORD* hash) {
+  DWORD dirs = 0;
+  size_t begin = 0;
+  size_t trail = len;
+  for (size_t pos = 0; pos != len; ++pos) {
+    if (path[pos] == Char(kPathSep)) {
+      dirs = CombineHash(dirs, NameHash(policy, path + begin, pos - begin));
+      begin = pos + 1;
+      trail = pos;
+    }
+  }
+  *hash = dirs;
+  return trail;
+}
+
+// Tells if |node| is the entry for the directory |path|. The components of |path| are compared
+// from the last one up, one per level, the root node has the rest of the path as its name. If
+// |at_separator|, the path was cut before a separator, which the name of the root can end with
+// when it is "/" or "C:\".
+template <typename Nodes, typename Char>
+bool MatchesDirChain(const Nodes& nodes, DWORD node, const Char* path, size_t len,
+                     bool at_separator) {
+  for (; nodes.Parent(node); node = nodes.Parent(node)) {
+    auto sep = LastSeparator(path, len);
+    if (sep == len)
+      return false;
+    if (!nodes.NameIs(node, path + sep + 1, len - sep - 1))
+      return false;
+    len = sep;
+    at_separator = true;
+  }
+  // reached the root of our data. this is the fake node that contains the absolute path
+  // the the root of the enumeration.
+  return nodes.NameIs(node, path, len) || (at_separator && nodes.NameIs(node, path, len + 1));
+}
+
+template <typename Char>
+bool IsAbsolute(const Char* path, size_t len) {
+#if defined(_WIN32)
+  return (len >= 3) && (path[1] == Char(':'));
+#else
+  return len && (path[0] == Char(kPathSep));
+#endif
+}
+
+// Finds the directory |path| with the PathHash() |hash|. See MatchesDirChain() for
+// |at_separator|.
+template <typename Nodes, typename Char>
+const FFS_Dir* FindDirIn(const Nodes& nodes, const FFS_Header* header, const Char* path,
+                         size_t len, DWORD hash, bool at_separator) {
+  DirCandidates candidates(header, hash);
+  while (auto dir = candidates.Next()) {
+    if ((nodes.Attributes(dir->anchor) & FILE_ATTRIBUTE_DIRECTORY) == 0)
+      __debugbreak();
+
+    if (MatchesDirChain(nodes, nodes.Parent(dir->anchor), path, len, at_separator))
+      return dir;
+  }
+  // no more nodes with same hash.
+  return nullptr;
+}
+
+template <typename Nodes>
+DWORD LowerBoundIn(const Nodes& nodes, const FFS_Header* header, const FFS_Dir* dir,
+                   const typename Nodes::Key& key) {
+  auto index = dir->index.Get(header);
+  DWORD lo = 0;
+  DWORD hi = dir->count;
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (nodes.Compare(index[mid], key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// The front coded names are only binary searched at the restarts, see FFS_kNamesFrontCoded. The
+// sorted entries of a columns listing are the nodes after the "." one, so there is no need for
+// the index.
+DWORD LowerBoundIn(const FrontCodedColumnNodes& nodes, const FFS_Header* /*header*/,
+                   const FFS_Dir* dir, const FrontCodedColumnNodes::Key& key) {
+  return nodes.LowerBound(dir->anchor + 1, dir->count, key);
+}
+
+// With the leaf index, the nodes are only compared by name once their hash and directory match,
+// which is usually the first one.
+template <typename Nodes, typename Char>
+DWORD GetLeafIn(const Nodes& nodes, const FFS_Header* header, const FFS_Dir* dir,
+                const Char* name, size_t len) {
+  if (header->leaf_slots) {
+    LeafCandidates candidates(header, dir, NameHash(header->hash_policy, name, len));
+    while (auto node = candidates.Next()) {
+      if (nodes.NameIs(node, name, len))
+        return node;
+    }
+    return 0;
+  }
+  auto key = nodes.MakeKey(name, len);
+  if (!nodes.MayMatch(key))
+    return 0;
+  auto pos = LowerBoundIn(nodes, header, dir, key);
+  if (pos == dir->count)
+    return 0;
+  auto node = dir->index.Get(header)[pos];
+  if (!nodes.Matches(node, key))
+    return 0;
+  return (Nodes::kKeepsRemoved && !nodes.Parent(node)) ? 0 : node;
+}
+
+// Also sets |*listing| to the directory whose listing has the node, if it finds one.
+template <typename Nodes, typename Char>
+DWORD GetNodeIn(const Nodes& nodes, const FFS_Header* header, const Char* path, size_t len,
+                const FFS_Dir** listing) {
+  if (!IsAbsolute(path, len))
+    return 0;
+  DWORD hash;
+  auto trail = HashDirs(header->hash_policy, path, len, &hash);
+  if (trail == len)
+    return 0;
+  auto dir = FindDirIn(nodes, header, path, trail, hash, true);
+  if (!dir)
+    return 0;
+  *listing = dir;
+  if (trail == len - 1)
+    return dir->anchor;
+  return GetLeafIn(nodes, header, dir, path + trail + 1, len - trail - 1);
+}
+
+// BeginRead() until |generation| is even, as long as the server is there to end its write.
+// Returns false once it is gone.
+bool BeginServerRead(const FFS_Header* header, const DWORD* generation, DWORD* value) {
+  while (!BeginRead(generation, value)) {
+    if (!IsServerAlive(header))
+      return false;
+  }
+  return true;
+}
+
+// GetNodeIn() and Read() within the generations that cover them, see BeginRead(). The one of the
+// header covers the lookup, the one of the listing the fields of the node.
+template <typename Nodes, typename Char>
+ReadResult ReadPathIn(const Nodes& nodes, const FFS_Header* header, const Char* path, size_t len,
+                      WIN32_FIND_DATA* w32fd) {
+  while (true) {
+    DWORD relinks;
+    if (!BeginServerRead(header, &header->generation, &relinks))
+      return kServerGone;
+    const FFS_Dir* listing = nullptr;
+    auto node = GetNodeIn(nodes, header, path, len, &listing);
+    if (!node) {
+      if (EndRead(&header->generation, relinks))
+        return kPathNotFound;
+      continue;
+    }
+    DWORD fields;
+    if (!BeginServerRead(header, &listing->generation, &fields))
+      return kServerGone;
+    nodes.Read(node, w32fd);
+    if (EndRead(&listing->generation, fields) && EndRead(&header->generation, relinks))
+      return kPathRead;
+  }
+}
+
+// The paths GetNodesIn() looks up together. Enough for their misses to overlap, few enough for
+// their prefetched lines to stay in L1.
+const size_t kBatchPaths = 16;
+
+// GetNodeIn() for many paths, one step at a time for a batch of them. Each step prefetches what
+// the next one reads, so by the time a path gets there the line is on its way: the directory
+// slot, then the FFS_Dir, then its node, then the first leaf slot or the middle of the listing.
+// A directory whose first candidate is not the right one, which takes a hash collision, is looked
+// up again with FindDirIn().
+template <typename Nodes, typename View>
+void GetNodesIn(const Nodes& nodes, const FFS_Header* header, const View* paths, size_t count,
+                DWORD* found) {
+  struct Step {
+    bool active;                // until the path is found or known to be missing.
+    size_t trail;
+    DWORD hash;
+    const FFS_Dir* dir;
+  };
+  Step steps[kBatchPaths];
+  for (size_t first = 0; first < count; first += kBatchPaths) {
+    auto batch = std::min(kBatchPaths, count - first);
+    auto batch_paths = paths + first;
+    auto batch_found = found + first;
+    for (size_t ix = 0; ix != batch; ++ix) {
+      auto& path = batch_paths[ix];
+      auto& step = steps[ix];
+      batch_found[ix] = 0;
+      step.active = IsAbsolute(path.data, path.size);
+      if (!step.active)
+        continue;
+      step.trail = HashDirs(header->hash_policy, path.data, path.size, &step.hash);
+      step.active = (step.trail != path.size);
+      if (step.active)
+        PrefetchDirSlot(header, step.hash);
+    }
+    for (size_t ix = 0; ix != batch; ++ix) {
+      if (steps[ix].active)
+        DirCandidates(header, steps[ix].hash).Prefetch();
+    }
+    for (size_t ix = 0; ix != batch; ++ix) {
+      auto& step = steps[ix];
+      if (!step.active)
+        continue;
+      step.dir = DirCandidates(header, step.hash).Next();
+      step.active = (step.dir != nullptr);
+      if (step.active)
+        nodes.Prefetch(step.dir->anchor);
+    }
+    for (size_t ix = 0; ix != batch; ++ix) {
+      auto& path = batch_paths[ix];
+      auto& step = steps[ix];
+      if (!step.active)
+        continue;
+      if (!MatchesDirChain(nodes, nodes.Parent(step.dir->anchor), path.data, step.trail, true))
+        step.dir = FindDirIn(nodes, header, path.data, step.trail, step.hash, true);
+      step.active = step.dir && (step.trail != path.size - 1);
+      if (!step.active) {
+        batch_found[ix] = step.dir ? step.dir->anchor : 0;
+        continue;
+      }
+      auto name = path.data + step.trail + 1;
+      auto len = path.size - step.trail - 1;
+      if (header->leaf_slots)
+        PrefetchLeafSlot(header, step.dir, NameHash(header->hash_policy, name, len));
+      else if (step.dir->count)
+        Prefetch(step.dir->index.Get(header) + step.dir->count / 2);
+    }
+    for (size_t ix = 0; ix != batch; ++ix) {
+      auto& path = batch_paths[ix];
+      auto& step = steps[ix];
+      if (step.active) {
+        batch_found[ix] = GetLeafIn(nodes, header, step.dir, path.data + step.trail + 1,
+                                    path.size - step.trail - 1);
+      }
+    }
+  }
+}
+
+bool IsDot(const wchar_t* name) {
+  return (name[0] == L'.') && !name[1];
+}
+
+template <typename ColumnNodes>
+void FindModifiedAfterIn(const ColumnNodes& columns, const FFS_Header* header, ULONGLONG time,
+                         std::vector<DWORD>* nodes) {
+  // A straight pass over one array, which the compiler can vectorize. The names are only
+  // looked at for the matches, and "." is interned so that is an integer compare, or with front
+  // coding a restart entry that is compared as it is.
+  const typename ColumnNodes::Char dot_name[] = {'.', 0};
+  auto dot = columns.MakeKey(dot_name, 1);
+  auto write_times = columns.write_times();
+  auto count = header->columns.count;
+  for (DWORD node = 1; node < count; ++node) {
+    if ((write_times[node] > time) && !columns.Matches(node, dot) &&
+        (columns.Parent(node) || (node == header->root_offset)))
+      nodes->push_back(node);
+  }
+}
+
+// With records the server added, which are not in the runs of the scan, the listings are walked
+// instead: the directory index has each of them once.
+void FindModifiedInListings(const FFS_Header* header, ULONGLONG time, std::vector<DWORD>* nodes) {
+  auto start = reinterpret_cast<const BYTE*>(header);
+  auto table = header->dir_slots.Get(header);
+  for (DWORD ix = 0; ix != table->slot_count; ++ix) {
+    FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(table->slots[ix].packed)};
+    if (!dir)
+      continue;
+    auto index = dir.Get(header)->index.Get(header);
+    for (DWORD pos = 0; pos != dir.Get(header)->count; ++pos) {
+      auto w32fd = reinterpret_cast<const WIN32_FIND_DATA*>(start + index[pos]);
+      if ((ToULL(w32fd->ftLastWriteTime) > time) && !IsDot(w32fd->cFileName))
+        nodes->push_back(index[pos]);
+    }
+  }
+}
+
+}  // namespace
+
+const FFS_Dir* FindDir(const FFS_Header* header, WideView path) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+      return FindDirIn(RecordNodes(header), header, path.data, path.size,
+                       PathHash(header->hash_policy, path.data, path.size), false);
+    case kWideColumns:
+      return FindDirIn(WideColumnNodes(header), header, path.data, path.size,
+                       PathHash(header->hash_policy, path.data, path.size), false);
+    default:
+      return FindDir(header, Utf8Copy(path).view());
+  }
+}
+
+const FFS_Dir* FindDir(const FFS_Header* header, Utf8View path) {
+  switch (AccessorsFor(header)) {
+    case kUtf8Columns:
+      return FindDirIn(Utf8ColumnNodes(header), header, path.data, path.size,
+                       PathHash(header->hash_policy, path.data, path.size), false);
+    case kFrontCodedColumns:
+      return FindDirIn(FrontCodedColumnNodes(header), header, path.data, path.size,
+                       PathHash(header->hash_policy, path.data, path.size), false);
+    default:
+      return FindDir(header, WideCopy(path).view());
+  }
+}
+
+DWORD LowerBound(const FFS_Header* header, const FFS_Dir* dir, WideView name) {
+  switch (AccessorsFor(header)) {
+    case kRecords: {
+      RecordNodes nodes(header);
+      return LowerBoundIn(nodes, header, dir, nodes.MakeKey(name.data, name.size));
+    }
+    case kWideColumns: {
+      WideColumnNodes nodes(header);
+      return LowerBoundIn(nodes, header, dir, nodes.MakeKey(name.data, name.size));
+    }
+    case kUtf8Columns: {
+      Utf8ColumnNodes nodes(header);
+      Utf8Copy utf8(name);
+      return LowerBoundIn(nodes, header, dir, nodes.MakeKey(utf8.view().data, utf8.view().size));
+    }
+    default: {
+      FrontCodedColumnNodes nodes(header);
+      Utf8Copy utf8(name);
+      return LowerBoundIn(nodes, header, dir, nodes.MakeKey(utf8.view().data, utf8.view().size));
+    }
+  }
+}
+
+DWORD GetLeaf(const FFS_Header* header, const FFS_Dir* dir, WideView name) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+      return GetLeafIn(RecordNodes(header), header, dir, name.data, name.size);
+    case kWideColumns:
+      return GetLeafIn(WideColumnNodes(header), header, dir, name.data, name.size);
+    default:
+      return GetLeaf(header, dir, Utf8Copy(name).view());
+  }
+}
+
+DWORD GetLeaf(const FFS_Header* header, const FFS_Dir* dir, Utf8View name) {
+  switch (AccessorsFor(header)) {
+    case kUtf8Columns:
+      return GetLeafIn(Utf8ColumnNodes(header), header, dir, name.data, name.size);
+    case kFrontCodedColumns:
+      return GetLeafIn(FrontCodedColumnNodes(header), header, dir, name.data, name.size);
+    default:
+      return GetLeaf(header, dir, WideCopy(name).view());
+  }
+}
+
+DWORD GetNode(const FFS_Header* header, WideView path) {
+  const FFS_Dir* listing = nullptr;
+  return GetNode(header, path, &listing);
+}
+
+DWORD GetNode(const FFS_Header* header, Utf8View path) {
+  const FFS_Dir* listing = nullptr;
+  return GetNode(header, path, &listing);
+}
+
+DWORD GetNode(const FFS_Header* header, WideView path, const FFS_Dir** listing) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+      return GetNodeIn(RecordNodes(header), header, path.data, path.size, listing);
+    case kWideColumns:
+      return GetNodeIn(WideColumnNodes(header), header, path.data, path.size, listing);
+    default:
+      return GetNode(header, Utf8Copy(path).view(), listing);
+  }
+}
+
+DWORD GetNode(const FFS_Header* header, Utf8View path, const FFS_Dir** listing) {
+  switch (AccessorsFor(header)) {
+    case kUtf8Columns:
+      return GetNodeIn(Utf8ColumnNodes(header), header, path.data, path.size, listing);
+    case kFrontCodedColumns:
+      return GetNodeIn(FrontCodedColumnNodes(header), header, path.data, path.size, listing);
+    default:
+      return GetNode(header, WideCopy(path).view(), listing);
+  }
+}
+
+void GetNodes(const FFS_Header* header, const WideView* paths, size_t count, DWORD* nodes) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+      GetNodesIn(RecordNodes(header), header, paths, count, nodes);
+      return;
+    case kWideColumns:
+      GetNodesIn(WideColumnNodes(header), header, paths, count, nodes);
+      return;
+    default:
+      break;
+  }
+  // The paths are converted into one buffer for the whole call rather than one each.
+  std::string utf8;
+  std::vector<size_t> ends(count);
+  for (size_t ix = 0; ix != count; ++ix) {
+    AppendUtf8(paths[ix].data, paths[ix].size, &utf8);
+    ends[ix] = utf8.size();
+  }
+  std::vector<Utf8View> views;
+  views.reserve(count);
+  for (size_t ix = 0, begin = 0; ix != count; begin = ends[ix++])
+    views.push_back(Utf8View(utf8.data() + begin, ends[ix] - begin));
+  GetNodes(header, views.data(), count, nodes);
+}
+
+void GetNodes(const FFS_Header* header, const Utf8View* paths, size_t count, DWORD* nodes) {
+  switch (AccessorsFor(header)) {
+    case kUtf8Columns:
+      GetNodesIn(Utf8ColumnNodes(header), header, paths, count, nodes);
+      return;
+    case kFrontCodedColumns:
+      GetNodesIn(FrontCodedColumnNodes(header), header, paths, count, nodes);
+      return;
+    default:
+      break;
+  }
+  // DecodeUtf8() writes a terminator after each path.
+  size_t units = 0;
+  for (size_t ix = 0; ix != count; ++ix)
+    units += paths[ix].size + 1;
+  std::wstring wide(units, 0);
+  std::vector<WideView> views;
+  views.reserve(count);
+  for (size_t ix = 0, begin = 0; ix != count; ++ix) {
+    auto len = DecodeUtf8(paths[ix].data, paths[ix].size, &wide[begin]);
+    views.push_back(WideView(wide.data() + begin, len));
+    begin += len + 1;
+  }
+  GetNodes(header, views.data(), count, nodes);
+}
+
+DWORD NodeNameHash(const FFS_Header* header, WideView name) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+    case kWideColumns:
+      return NameHash(header->hash_policy, name.data, name.size);
+    default: {
+      Utf8Copy utf8(name);
+      return NameHash(header->hash_policy, utf8.view().data, utf8.view().size);
+    }
+  }
+}
+
+const FFS_Dir* FindSubdir(const FFS_Header* header, const FFS_Dir* dir, DWORD node) {
+  WIN32_FIND_DATA w32fd;
+  ReadNode(header, node, &w32fd);
+  DirCandidates candidates(header, CombineHash(dir->hash, NodeNameHash(header, w32fd.cFileName)));
+  while (auto subdir = candidates.Next()) {
+    WIN32_FIND_DATA anchor;
+    ReadNode(header, subdir->anchor, &anchor);
+    if (anchor.dwReserved0 == node)
+      return subdir;
+  }
+  return nullptr;
+}
+
+void ReadNode(const FFS_Header* header, DWORD node, WIN32_FIND_DATA* w32fd) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+      RecordNodes(header).Read(node, w32fd);
+      break;
+    case kWideColumns:
+      WideColumnNodes(header).Read(node, w32fd);
+      break;
+    case kUtf8Columns:
+      Utf8ColumnNodes(header).Read(node, w32fd);
+      break;
+    default:
+      FrontCodedColumnNodes(header).Read(node, w32fd);
+      break;
+  }
+}
+
+ReadResult ReadPath(const FFS_Header* header, WideView path, WIN32_FIND_DATA* w32fd) {
+  switch (AccessorsFor(header)) {
+    case kRecords:
+      return ReadPathIn(RecordNodes(header), header, path.data, path.size, w32fd);
+    case kWideColumns:
+      return ReadPathIn(WideColumnNodes(header), header, path.data, path.size, w32fd);
+    default:
+      return ReadPath(header, Utf8Copy(path).view(), w32fd);
+  }
+}
+
+ReadResult ReadPath(const FFS_Header* header, Utf8View path, WIN32_FIND_DATA* w32fd) {
+  switch (AccessorsFor(header)) {
+    case kUtf8Columns:
+      return ReadPathIn(Utf8ColumnNodes(header), header, path.data, path.size, w32fd);
+    case kFrontCodedColumns:
+      return ReadPathIn(FrontCodedColumnNodes(header), header, path.data, path.size, w32fd);
+    default:
+      return ReadPath(header, WideCopy(path).view(), w32fd);
+  }
+}
+
+void FindModifiedAfter(const FFS_Header* header, ULONGLONG time, std::vector<DWORD>* nodes) {
+  switch (AccessorsFor(header)) {
+    case kWideColumns:
+      FindModifiedAfterIn(WideColumnNodes(header), header, time, nodes);
+      return;
+    case kUtf8Columns:
+      FindModifiedAfterIn(Utf8ColumnNodes(header), header, time, nodes);
+      return;
+    case kFrontCodedColumns:
+      FindModifiedAfterIn(FrontCodedColumnNodes(header), header, time, nodes);
+      return;
+    default:
+      break;
+  }
+  if (header->nodes_added) {
+    FindModifiedInListings(header, time, nodes);
+    return;
+  }
+
+  // The records are variable sized so this goes through every name. The removed ones have no
+  // parent.
+  auto start = reinterpret_cast<const BYTE*>(header);
+  auto end = start + header->bytes;
+  auto w32fd = AdvanceNext(reinterpret_cast<const WIN32_FIND_DATA*>(start + header->root_offset));
+  while (reinterpret_cast<const BYTE*>(w32fd) < end) {
+    if ((ToULL(w32fd->ftLastWriteTime) > time) && !IsDot(w32fd->cFileName) &&
+        w32fd->dwReserved0)
+      nodes->push_back(DWORD(reinterpret_cast<const BYTE*>(w32fd) - start));
+    w32fd = AdvanceNext(w32fd);
+  }
+}
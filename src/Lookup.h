@@ -0,0 +1,93 @@
+#pragma once
+
+// Lookups in the shared section. They only read the section, so they work the same on the live
+// section of the server and on a snapshot mapped read-only, see SnapshotView. They work on both
+// layouts; the nodes are named by refs, see Layout.h.
+//
+// The paths and names can be given as wchar_t or as UTF-8. The lookups are quicker in the
+// encoding of the names in the section, UTF-8 for the columns with FFS_kNamesUtf8 or
+// FFS_kNamesFrontCoded and wchar_t otherwise; the other one is converted first.
+//
+// The lookups do not allocate: the paths and names are views, they are matched in place, and the
+// conversions go to the stack unless the path is longer than kLookupStackUnits. GetNodes()
+// allocates once per call for its conversions.
+
+#include <string>
+#include <vector>
+
+#include "Utf8.h"
+
+struct FFS_Dir;
+struct FFS_Header;
+
+// The longest path or name, in units of its encoding, that is converted on the stack.
+const size_t kLookupStackUnits = 1024;
+
+// Returns the directory at |path|, without the trailing separator.
+const FFS_Dir* FindDir(const FFS_Header* header, WideView path);
+const FFS_Dir* FindDir(const FFS_Header* header, Utf8View path);
+
+// Returns the position in the sorted index of |dir| of the first entry that is not less than
+// |name|. It is where an entry named |name| is or would be inserted.
+DWORD LowerBound(const FFS_Header* header, const FFS_Dir* dir, WideView name);
+
+// Returns the node named |name| in |dir|, or 0.
+DWORD GetLeaf(const FFS_Header* header, const FFS_Dir* dir, WideView name);
+DWORD GetLeaf(const FFS_Header* header, const FFS_Dir* dir, Utf8View name);
+
+// Returns the node for the absolute |path|, or 0. A trailing separator asks for the "." node of
+// the directory.
+DWORD GetNode(const FFS_Header* header, WideView path);
+DWORD GetNode(const FFS_Header* header, Utf8View path);
+
+// Same, and sets |*listing| to the directory whose listing has the node, which is the directory
+// itself for its "." node. The server needs it to update the node, see Update.h.
+DWORD GetNode(const FFS_Header* header, WideView path, const FFS_Dir** listing);
+DWORD GetNode(const FFS_Header* header, Utf8View path, const FFS_Dir** listing);
+
+// Sets |nodes|[i] to GetNode() of |paths|[i] for the |count| paths. The paths are looked up a
+// batch at a time, one step for all of them before the next, prefetching what the next step
+// reads, so that their cache misses overlap instead of following each other. That only pays
+// off when the section is mostly out of the cache: on one that fits in it there are few misses to
+// overlap, and the staging makes the batch as slow as a loop of GetNode() or slower. The paths in
+// the other encoding are converted into a buffer for the whole call.
+void GetNodes(const FFS_Header* header, const WideView* paths, size_t count, DWORD* nodes);
+void GetNodes(const FFS_Header* header, const Utf8View* paths, size_t count, DWORD* nodes);
+
+// Tells if the section stores all the FFS_Fields in |fields|. Clients that read more than
+// FFS_kClientFields check this first; the fields that are not stored read as 0.
+inline bool HasFields(const FFS_Header* header, DWORD fields) {
+  return (header->fields & fields) == fields;
+}
+
+// Returns the name hash of |name| as the section has it, in the encoding of its names, for
+// IndexLeaf() and CombineHash().
+DWORD NodeNameHash(const FFS_Header* header, WideView name);
+
+// Returns the directory whose entry is |node| in the listing of |dir|, or null if |node| has no
+// listing.
+const FFS_Dir* FindSubdir(const FFS_Header* header, const FFS_Dir* dir, DWORD node);
+
+// Copies the metadata and the name of |node| into |w32fd|.
+void ReadNode(const FFS_Header* header, DWORD node, WIN32_FIND_DATA* w32fd);
+
+// What ReadPath() found.
+enum ReadResult {
+  kPathNotFound,                // there is no node at the path.
+  kPathRead,                    // the node is in |w32fd|.
+  kServerGone,                  // the server died in the middle of a write, so the section can
+                                // be inconsistent for good. The client has to go to the file
+                                // system instead.
+};
+
+// GetNode() and ReadNode() in one, for the clients of the live section: the node is read
+// consistently while the server updates it, without locks. The lookup and the read are retried
+// when a write of the server overlapped them, see BeginRead(), and must be within an epoch, see
+// EnterEpoch(), so that the server does not reuse what they read.
+ReadResult ReadPath(const FFS_Header* header, WideView path, WIN32_FIND_DATA* w32fd);
+ReadResult ReadPath(const FFS_Header* header, Utf8View path, WIN32_FIND_DATA* w32fd);
+
+// Appends to |nodes| the files and directories modified after |time|, a FILETIME as a 64-bit
+// number. The "." nodes are left out, the directories are found by their entry in the parent.
+// So are the nodes the server removed.
+void FindModifiedAfter(const FFS_Header* header, ULONGLONG time, std::vector<DWORD>* nodes);
@@ -0,0 +1,220 @@
+// Include and exclude patterns for the paths in the tree.
+
+#include "stdafx.h"
+
+#include <algorithm>
+
+#include "PathFilter.h"
+#include "Section.h"
+
+namespace {
+
+bool IsSeparator(wchar_t c) {
+  return (c == L'/') || (c == L'\\');
+}
+
+DWORD NameHash(const wchar_t* name, size_t len) {
+  return Hash_FNV1a_32(reinterpret_cast<const BYTE*>(name), len * sizeof(wchar_t));
+}
+
+// '*' matches any run of characters and '?' any single one.
+bool GlobMatches(const wchar_t* pattern, const wchar_t* name) {
+  const wchar_t* star = nullptr;
+  const wchar_t* resume = nullptr;
+  while (*name) {
+    if (*pattern == L'*') {
+      star = pattern++;
+      resume = name;
+    } else if ((*pattern == L'?') || (*pattern == *name)) {
+      ++pattern;
+      ++name;
+    } else if (star) {
+      pattern = star + 1;
+      name = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == L'*')
+    ++pattern;
+  return !*pattern;
+}
+
+// "*.ext" with no other wildcard or dot.
+bool IsExtensionPattern(const std::wstring& text) {
+  return (text.size() > 2) && (text[0] == L'*') && (text[1] == L'.') &&
+         (text.find_first_of(L"*?.", 2) == std::wstring::npos);
+}
+
+}  // namespace
+
+PathFilter::PathFilter() : fingerprint_(0) {}
+
+void PathFilter::Add(const std::wstring& pattern, bool include) {
+  Rule rule = {include, false};
+  auto end = pattern.size();
+  while (end && IsSeparator(pattern[end - 1])) {
+    rule.dir_only = true;
+    --end;
+  }
+  bool anchored = false;
+  for (size_t pos = 0; pos < end;) {
+    auto next = pos;
+    while (next != end && !IsSeparator(pattern[next]))
+      ++next;
+    if (next != end)
+      anchored = true;
+    if (next != pos) {
+      Segment segment = {pattern.substr(pos, next - pos), kLiteral};
+      if (segment.text == L"**")
+        segment.kind = kAnyPath;
+      else if (segment.text.find_first_of(L"*?") != std::wstring::npos)
+        segment.kind = kGlob;
+      rule.segments.push_back(segment);
+    }
+    pos = next + 1;
+  }
+  if (rule.segments.empty())
+    return;
+
+  auto index = DWORD(rules_.size());
+  rules_.push_back(rule);
+  auto& first = rules_.back().segments[0];
+  if (anchored) {
+    anchored_.push_back(index);
+  } else if (first.kind == kLiteral) {
+    by_name_[NameHash(first.text.c_str(), first.text.size())].push_back(index);
+  } else if (IsExtensionPattern(first.text)) {
+    by_extension_[NameHash(first.text.c_str() + 1, first.text.size() - 1)].push_back(index);
+  } else {
+    globs_.push_back(index);
+  }
+
+  auto key = std::wstring(include ? L"+" : L"-") + pattern;
+  fingerprint_ = (fingerprint_ * 0x01000193) ^ FileHash(key);
+}
+
+bool PathFilter::SegmentMatches(const Segment& segment, const wchar_t* name) {
+  switch (segment.kind) {
+    case kLiteral:
+      return segment.text == name;
+    case kGlob:
+      return GlobMatches(segment.text.c_str(), name);
+    default:
+      return true;
+  }
+}
+
+// A "**" can match no component at all, so the position after it is live too.
+void PathFilter::AddPosition(DWORD rule, DWORD segment, State* state) const {
+  Position pos = {rule, segment};
+  state->push_back(pos);
+  auto& segments = rules_[rule].segments;
+  if ((segments[segment].kind == kAnyPath) && (segment + 1 < segments.size()))
+    AddPosition(rule, segment + 1, state);
+}
+
+void PathFilter::Consider(DWORD rule, bool is_dir, int* best) const {
+  if (rules_[rule].dir_only && !is_dir)
+    return;
+  *best = std::max(*best, int(rule));
+}
+
+PathFilter::State PathFilter::RootState() const {
+  State state;
+  for (auto rule : anchored_)
+    AddPosition(rule, 0, &state);
+  return state;
+}
+
+void PathFilter::Descend(const State& dir, const wchar_t* name, State* child) const {
+  child->clear();
+  for (auto& pos : dir) {
+    auto& segments = rules_[pos.rule].segments;
+    auto& segment = segments[pos.segment];
+    if (segment.kind == kAnyPath)
+      AddPosition(pos.rule, pos.segment, child);
+    else if ((pos.segment + 1 < segments.size()) && SegmentMatches(segment, name))
+      AddPosition(pos.rule, pos.segment + 1, child);
+  }
+  std::sort(child->begin(), child->end(), [](const Position& a, const Position& b) {
+    return (a.rule != b.rule) ? (a.rule < b.rule) : (a.segment < b.segment);
+  });
+  child->erase(std::unique(child->begin(), child->end(), [](const Position& a, const Position& b) {
+    return (a.rule == b.rule) && (a.segment == b.segment);
+  }), child->end());
+}
+
+bool PathFilter::Excludes(const State& dir, const wchar_t* name, bool is_dir) const {
+  int best = -1;
+  if (!by_name_.empty()) {
+    auto it = by_name_.find(NameHash(name, wcslen(name)));
+    if (it != by_name_.end()) {
+      for (auto rule : it->second) {
+        if (rules_[rule].segments[0].text == name)
+          Consider(rule, is_dir, &best);
+      }
+    }
+  }
+  auto dot = wcsrchr(name, L'.');
+  if (dot && !by_extension_.empty()) {
+    auto it = by_extension_.find(NameHash(dot, wcslen(dot)));
+    if (it != by_extension_.end()) {
+      for (auto rule : it->second) {
+        if (wcscmp(rules_[rule].segments[0].text.c_str() + 1, dot) == 0)
+          Consider(rule, is_dir, &best);
+      }
+    }
+  }
+  for (auto rule : globs_) {
+    if (SegmentMatches(rules_[rule].segments[0], name))
+      Consider(rule, is_dir, &best);
+  }
+  for (auto& pos : dir) {
+    auto& segments = rules_[pos.rule].segments;
+    if ((pos.segment + 1 == segments.size()) && SegmentMatches(segments[pos.segment], name))
+      Consider(pos.rule, is_dir, &best);
+  }
+  return (best >= 0) && !rules_[best].include;
+}
+
+PathFilter::State PathFilter::PathState(const wchar_t* path, size_t len) const {
+  auto state = RootState();
+  State child;
+  std::wstring name;
+  for (size_t pos = 0; pos < len;) {
+    auto next = pos;
+    while (next != len && !IsSeparator(path[next]))
+      ++next;
+    name.assign(path + pos, next - pos);
+    pos = next + 1;
+    if (name.empty())
+      continue;
+    Descend(state, name.c_str(), &child);
+    state.swap(child);
+  }
+  return state;
+}
+
+bool PathFilter::ExcludesPath(const wchar_t* path, size_t len, bool is_dir) const {
+  auto state = RootState();
+  State child;
+  std::wstring name;
+  for (size_t pos = 0; pos < len;) {
+    auto next = pos;
+    while (next != len && !IsSeparator(path[next]))
+      ++next;
+    name.assign(path + pos, next - pos);
+    pos = next + 1;
+    if (name.empty())
+      continue;
+    bool last = (next == len);
+    if (Excludes(state, name.c_str(), last ? is_dir : true))
+      return true;
+    if (!last) {
+      Descend(state, name.c_str(), &child);
+      state.swap(child);
+    }
+  }
+  return false;
+}
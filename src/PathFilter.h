@@ -0,0 +1,91 @@
+#pragma once
+
+// Include and exclude patterns for the paths in the tree.
+//
+// Build outputs and VCS internals are big and never queried, so they can be left out of the
+// section. The patterns work like a .gitignore:
+//   - they match paths relative to the top directory. Both '/' and '\' are separators.
+//   - a pattern without a separator matches a name at any depth: "out", "*.pyc".
+//   - a pattern with a separator is anchored at the top directory: "third_party/llvm-build",
+//     "/out", "native_client/toolchain/*".
+//   - '*' and '?' match within a name, "**" as a whole component matches any number of them.
+//   - a trailing separator matches directories only: "build/".
+//   - later patterns win over earlier ones, so an include can bring back some of what an earlier
+//     exclude matched. Excluded directories are not read at all though, so nothing under them
+//     can be brought back, same as git.
+//
+// The patterns are compiled once. Names without wildcards and "*.ext" patterns are looked up by
+// hash; the anchored patterns are tracked one component at a time with a State per directory,
+// so the cost of a lookup does not depend on the depth of the path.
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class PathFilter {
+ public:
+  // A pattern component that the anchored patterns can be at, see Descend().
+  struct Position {
+    DWORD rule;
+    DWORD segment;
+  };
+  typedef std::vector<Position> State;
+
+  PathFilter();
+
+  void Add(const std::wstring& pattern, bool include);
+
+  bool empty() const { return rules_.empty(); }
+
+  // Identifies the patterns, so a section built with other patterns is not reused.
+  DWORD fingerprint() const { return fingerprint_; }
+
+  // The state for the top directory.
+  State RootState() const;
+
+  // The state for the subdirectory |name| of the directory at |dir|.
+  void Descend(const State& dir, const wchar_t* name, State* child) const;
+
+  // The state for the directory at the |len| characters at |path|, relative to the top
+  // directory.
+  State PathState(const wchar_t* path, size_t len) const;
+
+  // Tells if the entry |name| of the directory at |dir| is left out.
+  bool Excludes(const State& dir, const wchar_t* name, bool is_dir) const;
+
+  // Same as Excludes() for the |len| characters at |path|, relative to the top directory. The
+  // path is left out if any of its ancestors is. |is_dir| applies to the last component.
+  bool ExcludesPath(const wchar_t* path, size_t len, bool is_dir) const;
+
+ private:
+  enum SegmentKind {
+    kLiteral,
+    kGlob,
+    kAnyPath,       // "**"
+  };
+
+  struct Segment {
+    std::wstring text;
+    SegmentKind kind;
+  };
+
+  struct Rule {
+    bool include;
+    bool dir_only;
+    std::vector<Segment> segments;
+  };
+
+  static bool SegmentMatches(const Segment& segment, const wchar_t* name);
+  void AddPosition(DWORD rule, DWORD segment, State* state) const;
+  void Consider(DWORD rule, bool is_dir, int* best) const;
+
+  std::vector<Rule> rules_;
+  // Rules of a single component, by the hash of the name or of the ".ext" they match.
+  std::unordered_map<DWORD, std::vector<DWORD>> by_name_;
+  std::unordered_map<DWORD, std::vector<DWORD>> by_extension_;
+  // The single component rules that need a full match.
+  std::vector<DWORD> globs_;
+  // Rules anchored at the top directory.
+  std::vector<DWORD> anchored_;
+  DWORD fingerprint_;
+};
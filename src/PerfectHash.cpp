@@ -0,0 +1,206 @@
+// The minimal perfect hashes of a frozen section.
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "DirIndex.h"
+#include "PerfectHash.h"
+
+namespace {
+
+const DWORD kKeysPerBucket = 4;
+// Seeds to try before giving up. One is almost always enough.
+const DWORD kMaxSeeds = 16;
+
+// Places the |keys|, which are distinct, with |seed|. Sets the pilot of every bucket and the slot
+// of every key. Returns false if a bucket runs out of pilots, which takes another seed.
+bool PlaceKeys(const std::vector<DWORD>& keys, DWORD seed, DWORD bucket_count,
+               std::vector<DWORD>* pilots, std::vector<DWORD>* slots) {
+  auto key_count = DWORD(keys.size());
+  std::vector<ULONGLONG> mixed(key_count);
+  std::vector<DWORD> bucket_start(bucket_count + 1);
+  for (DWORD ix = 0; ix != key_count; ++ix) {
+    mixed[ix] = PerfectHashMix((ULONGLONG(seed) << 32) | keys[ix]);
+    ++bucket_start[PerfectHashBucket(bucket_count, mixed[ix]) + 1];
+  }
+  DWORD largest = 0;
+  for (DWORD bucket = 0; bucket != bucket_count; ++bucket) {
+    largest = std::max(largest, bucket_start[bucket + 1]);
+    bucket_start[bucket + 1] += bucket_start[bucket];
+  }
+  // The keys grouped by bucket, and the buckets from the biggest one down.
+  std::vector<DWORD> by_bucket(key_count);
+  auto fill = bucket_start;
+  for (DWORD ix = 0; ix != key_count; ++ix)
+    by_bucket[fill[PerfectHashBucket(bucket_count, mixed[ix])]++] = ix;
+  std::vector<DWORD> order(bucket_count);
+  for (DWORD bucket = 0; bucket != bucket_count; ++bucket)
+    order[bucket] = bucket;
+  std::stable_sort(order.begin(), order.end(), [&bucket_start](DWORD a, DWORD b) {
+    return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+  });
+
+  // The last singletons see an almost full table, they take about |key_count| tries.
+  auto max_pilot = DWORD(std::min<ULONGLONG>(0xFFFFFFFFULL, 64 * ULONGLONG(key_count) + 1024));
+  std::vector<bool> taken(key_count);
+  std::vector<DWORD> positions(largest);
+  pilots->assign(bucket_count, 0);
+  slots->assign(key_count, 0);
+  for (auto bucket : order) {
+    auto first = bucket_start[bucket];
+    auto size = bucket_start[bucket + 1] - first;
+    if (!size)
+      break;
+    DWORD pilot = 0;
+    for (;; ++pilot) {
+      if (pilot == max_pilot)
+        return false;
+      DWORD placed = 0;
+      for (; placed != size; ++placed) {
+        auto pos = PerfectHashPosition(key_count, mixed[by_bucket[first + placed]], pilot);
+        if (taken[pos] ||
+            (std::find(positions.begin(), positions.begin() + placed, pos) !=
+             positions.begin() + placed))
+          break;
+        positions[placed] = pos;
+      }
+      if (placed == size)
+        break;
+    }
+    (*pilots)[bucket] = pilot;
+    for (DWORD ix = 0; ix != size; ++ix) {
+      taken[positions[ix]] = true;
+      (*slots)[by_bucket[first + ix]] = positions[ix];
+    }
+  }
+  return true;
+}
+
+// Builds the perfect hash of |keys|, sorted and distinct, and writes its pilots at
+// FFS_Header::used. Sets |hash| but for |key_count|, which is published once everything is
+// written, and |slots| to the slot of each key. Returns the offset of the slots, |slot_size|
+// bytes each, or 0 if they do not fit.
+FFS_Offset BuildPerfectHash(FFS_Header* header, size_t size, const std::vector<DWORD>& keys,
+                            size_t slot_size, FFS_PerfectHash* hash, std::vector<DWORD>* slots) {
+  auto bucket_count = std::max<DWORD>(1, DWORD(keys.size()) / kKeysPerBucket);
+  std::vector<DWORD> pilots;
+  DWORD seed = 0;
+  while (!PlaceKeys(keys, seed, bucket_count, &pilots, slots)) {
+    if (++seed == kMaxSeeds)
+      return 0;
+  }
+  auto pilots_offset = (header->used + 7) & ~FFS_Offset(7);
+  auto slots_offset = (pilots_offset + FFS_Offset(bucket_count) * sizeof(DWORD) + 7) &
+                      ~FFS_Offset(7);
+  auto end = slots_offset + FFS_Offset(keys.size()) * slot_size;
+  if ((end < slots_offset) || (end > size))
+    return 0;
+  memcpy(reinterpret_cast<BYTE*>(header) + pilots_offset, pilots.data(),
+         pilots.size() * sizeof(DWORD));
+  hash->bucket_count = bucket_count;
+  hash->seed = seed;
+  hash->pad0 = 0;
+  hash->pilots = pilots_offset;
+  hash->slots = slots_offset;
+  header->used = end;
+  return slots_offset;
+}
+
+// The distinct keys of |entries|, sorted by key, and for each one the index of its entry, or -1
+// if several entries have it.
+template <typename Value>
+void DistinctKeys(std::vector<std::pair<DWORD, Value>>* entries, std::vector<DWORD>* keys,
+                  std::vector<size_t>* owners) {
+  std::sort(entries->begin(), entries->end(),
+            [](const std::pair<DWORD, Value>& a, const std::pair<DWORD, Value>& b) {
+    return a.first < b.first;
+  });
+  for (size_t ix = 0; ix != entries->size(); ++ix) {
+    if (!keys->empty() && (keys->back() == (*entries)[ix].first)) {
+      owners->back() = size_t(-1);
+      continue;
+    }
+    keys->push_back((*entries)[ix].first);
+    owners->push_back(ix);
+  }
+}
+
+// Writes the perfect hash of the directories and sets |*key_count|. Returns false if it does not
+// fit.
+bool FreezeDirs(FFS_Header* header, size_t size, DWORD* key_count) {
+  std::vector<std::pair<DWORD, FFS_Offset>> dirs;
+  auto table = header->dir_slots.Get(header);
+  for (DWORD ix = 0; ix != table->slot_count; ++ix) {
+    FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(table->slots[ix].packed)};
+    if (dir)
+      dirs.push_back(std::make_pair(dir.Get(header)->hash, dir.offset));
+  }
+  std::vector<DWORD> keys;
+  std::vector<size_t> owners;
+  DistinctKeys(&dirs, &keys, &owners);
+  std::vector<DWORD> positions;
+  auto& frozen = header->frozen_dirs;
+  FFS_OffsetPtr<FFS_DirSlot> slots = {
+      BuildPerfectHash(header, size, keys, sizeof(FFS_DirSlot), &frozen, &positions)};
+  if (!slots)
+    return false;
+  for (size_t ix = 0; ix != keys.size(); ++ix) {
+    // The shared hashes only have the fingerprint.
+    auto dir = (owners[ix] == size_t(-1)) ? 0 : dirs[owners[ix]].second;
+    slots.Get(header)[positions[ix]].packed = DirSlotFingerprint(keys[ix]) | dir;
+  }
+  *key_count = DWORD(keys.size());
+  return true;
+}
+
+// Same for the leaf index. A tree without leaves has no perfect hash for them.
+bool FreezeLeaves(FFS_Header* header, size_t size, DWORD* key_count) {
+  std::vector<std::pair<DWORD, FFS_LeafSlot>> leaves;
+  auto table = header->leaf_slots.Get(header);
+  for (DWORD ix = 0; ix != table->slot_count; ++ix) {
+    if (table->slots[ix].node && table->slots[ix].dir)
+      leaves.push_back(std::make_pair(table->slots[ix].hash, table->slots[ix]));
+  }
+  *key_count = 0;
+  if (leaves.empty())
+    return true;
+  std::vector<DWORD> keys;
+  std::vector<size_t> owners;
+  DistinctKeys(&leaves, &keys, &owners);
+  std::vector<DWORD> positions;
+  auto& frozen = header->frozen_leaves;
+  FFS_OffsetPtr<FFS_LeafSlot> slots = {
+      BuildPerfectHash(header, size, keys, sizeof(FFS_LeafSlot), &frozen, &positions)};
+  if (!slots)
+    return false;
+  for (size_t ix = 0; ix != keys.size(); ++ix) {
+    FFS_LeafSlot shared = {keys[ix], 0, 0};
+    slots.Get(header)[positions[ix]] =
+        (owners[ix] == size_t(-1)) ? shared : leaves[owners[ix]].second;
+  }
+  *key_count = DWORD(keys.size());
+  return true;
+}
+
+}  // namespace
+
+bool FreezeFFS(FFS_Header* header, size_t size) {
+  if (header->status != FFS_kFinished)
+    return false;
+  auto used = header->used;
+  DWORD dir_keys = 0;
+  DWORD leaf_keys = 0;
+  if (!FreezeDirs(header, size, &dir_keys) ||
+      (header->leaf_slots && !FreezeLeaves(header, size, &leaf_keys))) {
+    header->used = used;
+    return false;
+  }
+  // The clients use the perfect hashes as soon as they see their keys.
+  StoreRelease(&header->frozen_dirs.key_count, dir_keys);
+  StoreRelease(&header->frozen_leaves.key_count, leaf_keys);
+  header->status = FFS_kFrozen;
+  return true;
+}
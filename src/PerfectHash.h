@@ -0,0 +1,57 @@
+#pragma once
+
+// The minimal perfect hashes of a frozen section, see FFS_PerfectHash.
+//
+// They are built in the style of PTHash. The keys are the 32-bit hashes the section has already,
+// mixed with a seed and spread over buckets of 4 keys on average, skewed so that 60% of the keys
+// go to 30% of the buckets. The buckets are placed from the biggest one down, while the table is
+// still mostly empty, by trying pilots until all the keys of the bucket land on free slots. A
+// lookup is then a read of the pilot of its bucket and a read of its slot, with nothing to probe.
+// A key that was not in the set lands on an arbitrary slot, so the slot still has to be checked.
+
+#include "FastFileStats.h"
+#include "Section.h"
+
+// The finalizer of SplitMix64.
+inline ULONGLONG PerfectHashMix(ULONGLONG x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// The bucket of a key that mixed to |mixed|.
+inline DWORD PerfectHashBucket(DWORD bucket_count, ULONGLONG mixed) {
+  auto dense = DWORD(ULONGLONG(bucket_count) * 3 / 10);
+  auto pick = ULONGLONG(DWORD(mixed));
+  if (DWORD(mixed >> 32) < 0x9999999AUL)
+    return DWORD((pick * dense) >> 32);
+  return dense + DWORD((pick * (bucket_count - dense)) >> 32);
+}
+
+// The slot of a key that mixed to |mixed| in a bucket with |pilot|. The key is mixed already, so
+// one multiply is enough to spread the pilot over the bits the slot is taken from.
+inline DWORD PerfectHashPosition(DWORD key_count, ULONGLONG mixed, DWORD pilot) {
+  auto spread = (mixed ^ (ULONGLONG(pilot) * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+  return DWORD((ULONGLONG(DWORD(spread >> 32)) * key_count) >> 32);
+}
+
+// The slot of |key| in |hash|, a perfect hash of the section at |header|.
+inline DWORD PerfectHashSlot(const FFS_Header* header, const FFS_PerfectHash& hash, DWORD key) {
+  auto mixed = PerfectHashMix((ULONGLONG(hash.seed) << 32) | key);
+  auto pilot = hash.pilots.Get(header)[PerfectHashBucket(hash.bucket_count, mixed)];
+  return PerfectHashPosition(hash.key_count, mixed, pilot);
+}
+
+// Prefetches the pilot PerfectHashSlot() reads first for |key|.
+inline void PrefetchPerfectHash(const FFS_Header* header, const FFS_PerfectHash& hash, DWORD key) {
+  auto mixed = PerfectHashMix((ULONGLONG(hash.seed) << 32) | key);
+  Prefetch(hash.pilots.Get(header) + PerfectHashBucket(hash.bucket_count, mixed));
+}
+
+// Builds the perfect hashes of the directories, and of the nodes if the section has a leaf
+// index, of the finished section at |header|, which is |size| bytes. They are written at
+// FFS_Header::used, and the section is then FFS_kFrozen: the server must not update it anymore.
+// Returns false if they do not fit, and leaves the section as it was then.
+bool FreezeFFS(FFS_Header* header, size_t size);
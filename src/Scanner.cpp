@@ -0,0 +1,827 @@
+// Initial scan of the tree.
+//
+// Reading directories is bound by the syscall latency (see DirReader.h) so the scan is
+// spread over a pool of worker threads. Each worker owns a queue of pending directories and
+// takes work from the back of its own queue; when it runs dry it steals from the front of the
+// other queues, which is where the directories closer to the root (and so with more work under
+// them) are.
+//
+// Workers never touch the shared section, which on Windows is demand-paged via SEH on the main
+// thread. Each worker reads the listings into its own arena with the section record format and sorts
+// them by name, and once every queue is empty the main thread lays out the listings in the
+// section with the layout asked for, fixing up the parent links and building the directory
+// table, the sorted entry indexes and the directory and leaf indexes.
+//
+// The same machinery revalidates a snapshot of the section (see Snapshot.h). Each job then also
+// carries the directory in the snapshot, and if the directory modification time has not changed
+// the listing is copied from the snapshot instead of reading the directory. The snapshot can have
+// either layout. Only the directories are stat'ed, so files that were modified in place while the
+// server was not running keep their old size and times.
+//
+// With a PathFilter, the excluded entries are dropped as the directories are read and the
+// excluded directories are never read. Each job carries the filter state of its directory. A
+// snapshot is only revalidated if it was built with the same filter, since its listings are
+// already filtered.
+
+#include "stdafx.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "Arena.h"
+#include "DirIndex.h"
+#include "DirReader.h"
+#include "Epoch.h"
+#include "FastFileStats.h"
+#include "Layout.h"
+#include "LeafIndex.h"
+#include "Lookup.h"
+#include "PathFilter.h"
+#include "Scanner.h"
+#include "Section.h"
+#include "Utf8.h"
+
+namespace {
+
+// A directory listing as read by a worker. The records are in the section format except for
+// dwReserved0, which is only known after the merge.
+struct DirBlock {
+  const BYTE* data;
+  DWORD bytes;
+  // Entries without the "." record.
+  DWORD count;
+  // Characters in the names, with the terminators.
+  DWORD name_chars;
+  DWORD hash;
+  DWORD depth;
+  // The block that has the entry for this directory, and the offset and the position of the
+  // entry within it. The top directory does not have one, its parent is the fake root node.
+  const DirBlock* parent;
+  DWORD parent_rel;
+  DWORD parent_pos;
+  // The ref of the "." node in the shared section, assigned by the merge.
+  DWORD anchor;
+};
+
+struct ScanJob {
+  std::wstring path;
+  // The FFS_Dir::hash of the directory.
+  DWORD hash;
+  const DirBlock* parent;
+  DWORD parent_rel;
+  DWORD parent_pos;
+  DWORD depth;
+  // The directory in the snapshot being revalidated, if any.
+  const FFS_Dir* old;
+  PathFilter::State filter_state;
+};
+
+struct Worker {
+  std::mutex lock;
+  std::deque<ScanJob> jobs;
+  Arena arena;
+  // A deque so the blocks don't move; jobs point to their parent block.
+  std::deque<DirBlock> blocks;
+  DWORD all_count;
+  DWORD dir_count;
+  DWORD pending_fixes;
+  DWORD reparse_count;
+  DWORD filtered_count;
+  // Scratch space for SortListing().
+  std::vector<const WIN32_FIND_DATA*> sorted;
+  std::vector<BYTE> scratch;
+
+  Worker()
+      : all_count(0), dir_count(0), pending_fixes(0), reparse_count(0), filtered_count(0) {}
+};
+
+struct ScanState {
+  std::vector<std::unique_ptr<Worker>> workers;
+  // Jobs queued or being read. The scan is done when it drops to zero.
+  std::atomic<long> outstanding;
+  const PathFilter* filter;
+  // The directory hashes are over the UTF-8 names, see FFS_kNamesUtf8.
+  bool utf8_names;
+  DWORD hash_policy;
+  // The snapshot being revalidated, if any, and its directories keyed by the ref of the
+  // directory entry in the parent listing.
+  const FFS_Header* old_header;
+  std::unordered_map<DWORD, const FFS_Dir*> old_dirs;
+
+  explicit ScanState(DWORD threads)
+      : outstanding(0), filter(nullptr), utf8_names(false), hash_policy(FFS_kHashFnv1a),
+        old_header(nullptr) {
+    for (DWORD ix = 0; ix != threads; ++ix)
+      workers.emplace_back(new Worker);
+  }
+};
+
+void PushJob(ScanState* ss, Worker* w, ScanJob&& job) {
+  ++ss->outstanding;
+  std::lock_guard<std::mutex> guard(w->lock);
+  w->jobs.push_back(std::move(job));
+}
+
+bool PopJob(Worker* w, ScanJob* job) {
+  std::lock_guard<std::mutex> guard(w->lock);
+  if (w->jobs.empty())
+    return false;
+  *job = std::move(w->jobs.back());
+  w->jobs.pop_back();
+  return true;
+}
+
+bool StealJob(ScanState* ss, size_t thief, ScanJob* job) {
+  auto count = ss->workers.size();
+  for (size_t ix = 1; ix != count; ++ix) {
+    auto victim = ss->workers[(thief + ix) % count].get();
+    std::lock_guard<std::mutex> guard(victim->lock);
+    if (victim->jobs.empty())
+      continue;
+    *job = std::move(victim->jobs.front());
+    victim->jobs.pop_front();
+    return true;
+  }
+  return false;
+}
+
+bool SameTime(const FILETIME& a, const FILETIME& b) {
+  return (a.dwLowDateTime == b.dwLowDateTime) && (a.dwHighDateTime == b.dwHighDateTime);
+}
+
+// Copies the listing of |old| from the snapshot into a new run of |arena|, the same way
+// ReadDirectory() would read it. The snapshot is sorted already.
+void CopyListing(const FFS_Header* old_header, const FFS_Dir* old, Arena* arena,
+                 DirListing* listing) {
+  auto index = old->index.Get(old_header);
+
+  arena->BeginRun();
+  for (DWORD ix = 0; ix <= old->count; ++ix) {
+    auto w32fd = arena->Next();
+    ReadNode(old_header, ix ? index[ix - 1] : old->anchor, w32fd);
+    // The front coded listings keep the nodes the server removed, see Update.h.
+    if (ix && !w32fd->dwReserved0)
+      continue;
+    w32fd->dwReserved0 = 0;
+    if (w32fd->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+      ++listing->reparse_points;
+    ++listing->entries;
+    arena->Advance(AdvanceNext(w32fd));
+  }
+}
+
+// Returns the subdirectory |name| of |old| in the snapshot.
+const FFS_Dir* FindOldDir(const ScanState* ss, const FFS_Dir* old, const std::wstring& name) {
+  if (!old)
+    return nullptr;
+  auto node = GetLeaf(ss->old_header, old, name);
+  if (!node)
+    return nullptr;
+  auto it = ss->old_dirs.find(node);
+  return (it == ss->old_dirs.end()) ? nullptr : it->second;
+}
+
+// Sorts the records of the current run of |w|'s arena by name, except for the "." record which
+// stays first, and fills |listing|'s subdirectories and |name_chars|.
+void SortListing(Worker* w, DirListing* listing, DWORD* name_chars) {
+  auto run = const_cast<BYTE*>(w->arena.run());
+  auto end = reinterpret_cast<const WIN32_FIND_DATA*>(run + w->arena.run_size());
+  auto dot = reinterpret_cast<const WIN32_FIND_DATA*>(run);
+
+  auto& sorted = w->sorted;
+  sorted.clear();
+  for (auto curr = AdvanceNext(dot); curr < end; curr = AdvanceNext(curr))
+    sorted.push_back(curr);
+  auto by_name = [](const WIN32_FIND_DATA* a, const WIN32_FIND_DATA* b) {
+    return wcscmp(a->cFileName, b->cFileName) < 0;
+  };
+  if (!std::is_sorted(sorted.begin(), sorted.end(), by_name)) {
+    std::sort(sorted.begin(), sorted.end(), by_name);
+
+    auto& scratch = w->scratch;
+    scratch.resize(w->arena.run_size());
+    auto first = reinterpret_cast<const BYTE*>(AdvanceNext(dot)) - run;
+    auto out = scratch.data() + first;
+    for (auto rec : sorted) {
+      auto size = reinterpret_cast<const BYTE*>(AdvanceNext(rec)) -
+                  reinterpret_cast<const BYTE*>(rec);
+      memcpy(out, rec, size);
+      out += size;
+    }
+    memcpy(run + first, scratch.data() + first, scratch.size() - first);
+  }
+
+  listing->dirs.clear();
+  *name_chars = 0;
+  DWORD pos = 0;
+  for (auto curr = dot; curr < end; curr = AdvanceNext(curr), ++pos) {
+    *name_chars += DWORD(wcslen(curr->cFileName)) + 1;
+    auto attributes = curr->dwFileAttributes;
+    if ((attributes & FILE_ATTRIBUTE_REPARSE_POINT) || !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+      continue;
+    if (AddDir(curr->cFileName)) {
+      listing->dirs.emplace_back(curr->cFileName,
+                                 DWORD(reinterpret_cast<const BYTE*>(curr) - run), pos);
+    }
+  }
+}
+
+// The NameHash() of |name| as the section stores it.
+DWORD StoredNameHash(const ScanState* ss, const std::wstring& name) {
+  if (!ss->utf8_names)
+    return NameHash(ss->hash_policy, name.c_str(), name.size());
+  auto utf8 = ToUtf8(name);
+  return NameHash(ss->hash_policy, utf8.c_str(), utf8.size());
+}
+
+// The FFS_Dir::hash of the subdirectory |name| of the directory with |parent_hash|, see
+// CombineHash().
+DWORD SubdirHash(const ScanState* ss, DWORD parent_hash, const std::wstring& name) {
+  return CombineHash(parent_hash, StoredNameHash(ss, name));
+}
+
+// The FFS_Dir::hash of the top directory.
+DWORD TopDirHash(const ScanState* ss, const std::wstring& top_dir) {
+  if (!ss->utf8_names)
+    return PathHash(ss->hash_policy, top_dir.c_str(), top_dir.size());
+  auto utf8 = ToUtf8(top_dir);
+  return PathHash(ss->hash_policy, utf8.c_str(), utf8.size());
+}
+
+void ScanDirectory(ScanState* ss, Worker* w, const ScanJob& job) {
+  DirListing listing = {ss->filter, &job.filter_state};
+  bool copied = false;
+  if (job.old) {
+    WIN32_FIND_DATA now, then;
+    ReadNode(ss->old_header, job.old->anchor, &then);
+    if (StatPath(job.path, &now) && SameTime(now.ftLastWriteTime, then.ftLastWriteTime)) {
+      CopyListing(ss->old_header, job.old, &w->arena, &listing);
+      copied = true;
+    }
+  }
+  if (!copied && !ReadDirectory(job.path, &w->arena, &listing)) {
+    ++w->pending_fixes;
+    return;
+  }
+  DWORD name_chars;
+  SortListing(w, &listing, &name_chars);
+  w->all_count += listing.entries;
+  w->dir_count += DWORD(listing.dirs.size());
+  w->reparse_count += listing.reparse_points;
+  w->filtered_count += listing.filtered;
+
+  w->blocks.push_back(DirBlock{w->arena.run(), w->arena.run_size(), listing.entries - 1,
+                               name_chars, job.hash, job.depth, job.parent,
+                               job.parent_rel, job.parent_pos, 0});
+  auto block = &w->blocks.back();
+
+  for (auto& dir : listing.dirs) {
+    auto& name = std::get<0>(dir);
+    PathFilter::State filter_state;
+    if (ss->filter)
+      ss->filter->Descend(job.filter_state, name.c_str(), &filter_state);
+    PushJob(ss, w, ScanJob{(job.path + kPathSep) + name, SubdirHash(ss, job.hash, name), block,
+                           std::get<1>(dir), std::get<2>(dir), job.depth + 1,
+                           FindOldDir(ss, job.old, name), std::move(filter_state)});
+  }
+}
+
+void WorkerMain(ScanState* ss, size_t id) {
+  auto w = ss->workers[id].get();
+  ScanJob job;
+  while (true) {
+    if (PopJob(w, &job) || StealJob(ss, id, &job)) {
+      ScanDirectory(ss, w, job);
+      --ss->outstanding;
+      continue;
+    }
+    if (!ss->outstanding)
+      break;
+    std::this_thread::yield();
+  }
+}
+
+FFS_Offset Align(FFS_Offset offset, DWORD alignment) {
+  return (offset + alignment - 1) & ~FFS_Offset(alignment - 1);
+}
+
+// Copies the listings into the section as records after the root node, which is at |mem|.
+// Returns the end of the records. The refs of the records are their DWORD offsets, so they have
+// to end below 4 GB whatever the width of FFS_Offset.
+FFS_Offset MergeRecords(BYTE* const start, BYTE* mem, const wchar_t* top_dir,
+                        const std::vector<DirBlock*>& blocks, size_t size) {
+  // The first node is a fake node with the root so we don't have special cases.
+  auto header = reinterpret_cast<FFS_Header*>(start);
+  auto w32fd = reinterpret_cast<WIN32_FIND_DATA*>(mem);
+  w32fd->dwFileAttributes = -1;
+  w32fd->dwReserved0 = 0;
+  w32fd->dwReserved1 = 0;
+  wcscpy_s(w32fd->cFileName, top_dir);
+  header->root_offset = DWORD(mem - start);
+  mem = reinterpret_cast<BYTE*>(AdvanceNext(w32fd));
+
+  auto offset = FFS_Offset(mem - start);
+  for (auto block : blocks) {
+    block->anchor = DWORD(offset);
+    offset += block->bytes;
+  }
+  if ((offset > size) || (ULONGLONG(offset) > 0xFFFFFFFFull))
+    return 0;
+
+  for (auto block : blocks) {
+    auto dest = start + block->anchor;
+    memcpy(dest, block->data, block->bytes);
+    // stuff the offset to the parent directory.
+    auto parent = block->parent ? block->parent->anchor + block->parent_rel : header->root_offset;
+    auto end = dest + block->bytes;
+    while (dest != end) {
+      w32fd = reinterpret_cast<WIN32_FIND_DATA*>(dest);
+      w32fd->dwReserved0 = parent;
+      dest = reinterpret_cast<BYTE*>(&w32fd->cFileName[0]) + w32fd->dwReserved1;
+    }
+  }
+  return offset;
+}
+
+// The names of the columns layout are written by a name writer as the nodes are laid out, in
+// node order. A writer is made with the start of the pool, the number of nodes and the
+// FFS_HashPolicy of the section, and has:
+//   - MaxBytes(), the room the pool needs at most for the names of the tree.
+//   - Add(), which writes the name of a node and returns its FFS_Columns::name. The position of
+//     the node in its listing comes along, 0 being ".".
+//   - Finish(), which fills the rest of FFS_Columns for the names and returns the end of what it
+//     wrote, or 0 if it does not fit.
+
+// Interns the names of the columns layout in a pool read by |Pool|, see Layout.h. The distinct
+// names are written to the pool as they come, and the table that finds them in the section is
+// written at the end, once its size is known.
+template <typename Pool>
+class NameInterner {
+ public:
+  typedef typename Pool::Char Char;
+
+  // |pool| must have room for all the names, |max_names| is how many there are.
+  NameInterner(BYTE* pool, DWORD max_names, DWORD hash_policy)
+      : pool_(reinterpret_cast<Char*>(pool)), reader_(pool_), size_(0), count_(0),
+        hash_policy_(hash_policy), table_(TableSize(max_names)) {}
+
+  // A character takes up to 4 bytes of UTF-8, and a short name a 1 byte length instead of the
+  // terminator.
+  static size_t MaxBytes(DWORD name_chars, DWORD /*count*/) {
+    return size_t(name_chars) * ((sizeof(Char) == 1) ? 4 : sizeof(Char));
+  }
+
+  // Slots for |names| names, so that half of them at least are empty.
+  static DWORD TableSize(DWORD names) {
+    DWORD slots = 2;
+    while (slots < names * 2)
+      slots *= 2;
+    return slots;
+  }
+
+  // Returns the position of |name| in the pool.
+  DWORD Add(const wchar_t* name, DWORD /*pos*/) {
+    const Char* units;
+    size_t len;
+    Encode(name, &units, &len);
+    auto hash = NameHash(hash_policy_, units, len);
+    auto mask = DWORD(table_.size() - 1);
+    auto slot = hash & mask;
+    for (; table_[slot].name; slot = (slot + 1) & mask) {
+      auto pos = table_[slot].name - 1;
+      if ((table_[slot].hash == hash) && reader_.Equals(pos, units, len))
+        return pos;
+    }
+    auto pos = size_;
+    size_ += DWORD(Append(pool_ + pos, units, len));
+    ++count_;
+    table_[slot].hash = hash;
+    table_[slot].name = pos + 1;
+    return pos;
+  }
+
+  // Writes the name table after the pool.
+  FFS_Offset Finish(BYTE* const start, FFS_Columns* columns, size_t size) const {
+    columns->names = (sizeof(Char) == 1) ? FFS_kNamesUtf8 : FFS_kNamesWide;
+    columns->restart_interval = 0;
+    columns->name_pool_size = size_;
+    columns->name_count = count_;
+    columns->name_table_size = TableSize(count_);
+    columns->name_table = Align(columns->name_pool + FFS_Offset(size_) * sizeof(Char), 8);
+    auto offset =
+        columns->name_table + FFS_Offset(columns->name_table_size) * sizeof(FFS_NameSlot);
+    if (offset > size)
+      return 0;
+    WriteTable(columns->name_table.Get(start), columns->name_table_size);
+    return offset;
+  }
+
+ private:
+  // Fills |table|, which has TableSize(count_) slots.
+  void WriteTable(FFS_NameSlot* table, DWORD slots) const {
+    memset(table, 0, slots * sizeof(FFS_NameSlot));
+    auto mask = slots - 1;
+    for (auto& entry : table_) {
+      if (!entry.name)
+        continue;
+      auto slot = entry.hash & mask;
+      while (table[slot].name)
+        slot = (slot + 1) & mask;
+      table[slot] = entry;
+    }
+  }
+
+  void Encode(const wchar_t* name, const wchar_t** units, size_t* len) {
+    *units = name;
+    *len = wcslen(name);
+  }
+
+  void Encode(const wchar_t* name, const char** units, size_t* len) {
+    utf8_.clear();
+    AppendUtf8(name, wcslen(name), &utf8_);
+    *units = utf8_.c_str();
+    *len = utf8_.size();
+  }
+
+  static size_t Append(wchar_t* dest, const wchar_t* name, size_t len) {
+    wmemcpy(dest, name, len);
+    dest[len] = 0;
+    return len + 1;
+  }
+
+  static size_t Append(char* dest, const char* name, size_t len) {
+    auto prefix = PutNameLength(len, dest);
+    memcpy(dest + prefix, name, len);
+    return prefix + len;
+  }
+
+  Char* pool_;
+  Pool reader_;
+  DWORD size_;
+  DWORD count_;
+  DWORD hash_policy_;
+  std::vector<FFS_NameSlot> table_;
+  std::string utf8_;
+};
+
+// Front codes the names of each listing in UTF-8, see FFS_kNamesFrontCoded. Every name is
+// written, so there is no table, but most only take the bytes they do not share with the name
+// before them.
+class FrontCoder {
+ public:
+  // Listings this long and shorter have a single restart after ".".
+  static const DWORD kRestartInterval = 16;
+
+  FrontCoder(BYTE* pool, DWORD /*count*/, DWORD /*hash_policy*/)
+      : pool_(reinterpret_cast<char*>(pool)), size_(0), restart_(0) {}
+
+  // The names, and three lengths of a byte each but for the long names or the far restarts.
+  static size_t MaxBytes(DWORD name_chars, DWORD count) {
+    return size_t(name_chars) * 4 + size_t(count) * 4;
+  }
+
+  DWORD Add(const wchar_t* name, DWORD pos) {
+    utf8_.clear();
+    AppendUtf8(name, wcslen(name), &utf8_);
+    auto entry = size_;
+    size_t shared = 0;
+    if (!pos || ((pos - 1) % kRestartInterval == 0)) {
+      restart_ = entry;
+    } else {
+      auto limit = std::min(utf8_.size(), last_.size());
+      while ((shared < limit) && (utf8_[shared] == last_[shared]))
+        ++shared;
+    }
+    size_ += DWORD(PutFrontCodedEntry(entry - restart_, shared, utf8_.c_str() + shared,
+                                      utf8_.size() - shared, pool_ + entry));
+    last_.swap(utf8_);
+    return entry;
+  }
+
+  FFS_Offset Finish(BYTE* const /*start*/, FFS_Columns* columns, size_t size) const {
+    columns->names = FFS_kNamesFrontCoded;
+    columns->restart_interval = kRestartInterval;
+    columns->name_pool_size = size_;
+    columns->name_count = 0;
+    columns->name_table_size = 0;
+    columns->name_table = Align(columns->name_pool + size_, 8);
+    return (columns->name_table <= size) ? columns->name_table : 0;
+  }
+
+ private:
+  char* pool_;
+  DWORD size_;
+  DWORD restart_;
+  std::string utf8_;
+  std::string last_;
+};
+
+// Lays out the listings as columns, see FFS_Columns, with the fields of the FieldSet |Fields| and
+// the names written by a |Writer|. The root node is node 1. Returns the end of the names.
+template <typename Fields, typename Writer>
+FFS_Offset MergeColumns(BYTE* const start, BYTE* mem, const wchar_t* top_dir,
+                        const std::vector<DirBlock*>& blocks, size_t size) {
+  auto header = reinterpret_cast<FFS_Header*>(start);
+  auto& columns = header->columns;
+  DWORD count = 2;
+  DWORD name_chars = DWORD(wcslen(top_dir)) + 1;
+  for (auto block : blocks) {
+    block->anchor = count;
+    count += block->count + 1;
+    name_chars += block->name_chars;
+  }
+
+  auto offset = FFS_Offset(mem - start);
+  auto column = [&offset, count](DWORD item_size) {
+    offset = Align(offset, 64);
+    auto column_offset = offset;
+    offset += FFS_Offset(count) * item_size;
+    return column_offset;
+  };
+  columns.count = count;
+  columns.attributes = column(sizeof(DWORD));
+  columns.size = column(sizeof(ULONGLONG));
+  columns.creation_time = Fields::kCreationTime ? column(sizeof(ULONGLONG)) : 0;
+  columns.access_time = Fields::kAccessTime ? column(sizeof(ULONGLONG)) : 0;
+  columns.write_time = column(sizeof(ULONGLONG));
+  columns.parent = column(sizeof(DWORD));
+  columns.next = column(sizeof(DWORD));
+  columns.name = column(sizeof(DWORD));
+  // The pool is sized for all the names, it shrinks once they are written.
+  columns.name_pool = Align(offset, 64);
+  if (columns.name_pool + Writer::MaxBytes(name_chars, count) > size)
+    return 0;
+
+  auto attributes = columns.attributes.Get(start);
+  auto sizes = columns.size.Get(start);
+  auto creation_times = columns.creation_time.Get(start);
+  auto access_times = columns.access_time.Get(start);
+  auto write_times = columns.write_time.Get(start);
+  auto parents = columns.parent.Get(start);
+  auto nexts = columns.next.Get(start);
+  auto names = columns.name.Get(start);
+  Writer pool(columns.name_pool.Get(start), count, header->hash_policy);
+
+  // Node 0 is not used, so a 0 ref means none.
+  attributes[0] = 0;
+  sizes[0] = write_times[0] = 0;
+  parents[0] = nexts[0] = names[0] = 0;
+  // The fake root node.
+  attributes[1] = DWORD(-1);
+  sizes[1] = write_times[1] = 0;
+  if (Fields::kCreationTime)
+    creation_times[0] = creation_times[1] = 0;
+  if (Fields::kAccessTime)
+    access_times[0] = access_times[1] = 0;
+  parents[1] = nexts[1] = 0;
+  names[1] = pool.Add(top_dir, 0);
+  header->root_offset = 1;
+
+  for (auto block : blocks) {
+    auto parent = block->parent ? block->parent->anchor + block->parent_pos : header->root_offset;
+    auto node = block->anchor;
+    auto last = node + block->count;
+    auto rec = block->data;
+    for (; node <= last; ++node) {
+      auto w32fd = reinterpret_cast<const WIN32_FIND_DATA*>(rec);
+      attributes[node] = w32fd->dwFileAttributes;
+      sizes[node] = (ULONGLONG(w32fd->nFileSizeHigh) << 32) | w32fd->nFileSizeLow;
+      if (Fields::kCreationTime)
+        creation_times[node] = ToULL(w32fd->ftCreationTime);
+      if (Fields::kAccessTime)
+        access_times[node] = ToULL(w32fd->ftLastAccessTime);
+      write_times[node] = ToULL(w32fd->ftLastWriteTime);
+      parents[node] = parent;
+      nexts[node] = (node != last) ? node + 1 : 0;
+      names[node] = pool.Add(w32fd->cFileName, node - block->anchor);
+      rec = reinterpret_cast<const BYTE*>(AdvanceNext(w32fd));
+    }
+  }
+
+  return pool.Finish(start, &columns, size);
+}
+
+// The field sets that are compiled in, see FFS_Fields.
+template <typename Writer>
+FFS_Offset MergeColumnsWith(BYTE* const start, BYTE* mem, const wchar_t* top_dir,
+                            const std::vector<DirBlock*>& blocks, size_t size, DWORD fields) {
+  switch (fields) {
+    case AllFields::kMask:
+      return MergeColumns<AllFields, Writer>(start, mem, top_dir, blocks, size);
+    case ClientFields::kMask:
+      return MergeColumns<ClientFields, Writer>(start, mem, top_dir, blocks, size);
+    default:
+      return 0;
+  }
+}
+
+// Builds the section. If |old_header| is not null, it is a snapshot with the same top directory
+// and its listings are reused for the directories that did not change.
+bool BuildFFS(BYTE* const start, size_t size, const wchar_t* top_dir, const ScanOptions& options,
+              const FFS_Header* old_header) {
+  auto header = reinterpret_cast<FFS_Header*>(start);
+  *header = FFS_Header{FFS_kMagic, FFS_kVersion, sizeof(FFS_Offset), FFS_kBooting};
+  SetServerProcess(header);
+  // The offsets cannot reach further, and the directory index only keeps the low
+  // FFS_kDirSlotOffsetBits of them.
+  auto max_size = ULONGLONG(FFS_Offset(-1)) >> (sizeof(FFS_Offset) * 8 - FFS_kDirSlotOffsetBits);
+  if (ULONGLONG(size) > max_size)
+    size = size_t(max_size);
+  header->filter = options.filter ? options.filter->fingerprint() : 0;
+  header->layout = options.layout;
+  // Only the columns can leave fields out.
+  header->fields = (options.layout == FFS_kLayoutColumns) ? options.fields : DWORD(FFS_kAllFields);
+  header->hash_policy = options.hash_policy;
+
+  ScanState ss(std::max<DWORD>(1, options.threads));
+  ss.filter = (options.filter && !options.filter->empty()) ? options.filter : nullptr;
+  ss.utf8_names = (options.layout == FFS_kLayoutColumns) && (options.names != FFS_kNamesWide);
+  ss.hash_policy = options.hash_policy;
+  const FFS_Dir* old_top = nullptr;
+  if (old_header) {
+    ss.old_header = old_header;
+    // The directory index has the listings as the server updated them, see Update.h, and not
+    // the removed ones.
+    auto old_slots = old_header->dir_slots.Get(old_header);
+    ss.old_dirs.reserve(old_slots->dir_count);
+    WIN32_FIND_DATA anchor;
+    for (DWORD ix = 0; ix != old_slots->slot_count; ++ix) {
+      FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(old_slots->slots[ix].packed)};
+      if (!dir)
+        continue;
+      ReadNode(old_header, dir.Get(old_header)->anchor, &anchor);
+      ss.old_dirs[anchor.dwReserved0] = dir.Get(old_header);
+    }
+    auto it = ss.old_dirs.find(old_header->root_offset);
+    if (it != ss.old_dirs.end())
+      old_top = it->second;
+  }
+
+  // Read the tree. The calling thread is worker 0.
+  PushJob(&ss, ss.workers[0].get(),
+          ScanJob{top_dir, TopDirHash(&ss, top_dir), nullptr, 0, 0, 0, old_top,
+                  ss.filter ? ss.filter->RootState() : PathFilter::State()});
+  std::vector<std::thread> pool;
+  for (size_t ix = 1; ix < ss.workers.size(); ++ix)
+    pool.emplace_back(WorkerMain, &ss, ix);
+  WorkerMain(&ss, 0);
+  for (auto& t : pool)
+    t.join();
+
+  DWORD all_count = 0;
+  DWORD dir_count = 0;
+  DWORD pending_fixes = 0;
+  DWORD reparse_count = 0;
+  DWORD filtered_count = 0;
+
+  std::vector<DirBlock*> blocks;
+  for (auto& w : ss.workers) {
+    for (auto& block : w->blocks)
+      blocks.push_back(&block);
+    all_count += w->all_count;
+    dir_count += w->dir_count;
+    pending_fixes += w->pending_fixes;
+    reparse_count += w->reparse_count;
+    filtered_count += w->filtered_count;
+  }
+  // The top directory could not be read: there is no tree, rather than an empty one.
+  if (blocks.empty()) {
+    header->status = FFS_kError;
+    return false;
+  }
+
+  // Lay out the listings breadth-first, like a single threaded scan would.
+  std::stable_sort(blocks.begin(), blocks.end(), [](const DirBlock* a, const DirBlock* b) {
+    return a->depth < b->depth;
+  });
+
+  auto mem = start + sizeof(*header);
+  FFS_Offset offset;
+  if (options.layout != FFS_kLayoutColumns)
+    offset = MergeRecords(start, mem, top_dir, blocks, size);
+  else if (options.names == FFS_kNamesFrontCoded)
+    offset = MergeColumnsWith<FrontCoder>(start, mem, top_dir, blocks, size, header->fields);
+  else if (options.names == FFS_kNamesUtf8)
+    offset = MergeColumnsWith<NameInterner<Utf8NamePool>>(start, mem, top_dir, blocks, size,
+                                                          header->fields);
+  else
+    offset = MergeColumnsWith<NameInterner<WideNamePool>>(start, mem, top_dir, blocks, size,
+                                                          header->fields);
+
+  // After the nodes go a sentinel, the directory table, the sorted indexes with one entry per
+  // node but the "." ones, the directory index and the leaf index if there is one.
+  DWORD indexed = 0;
+  for (auto block : blocks)
+    indexed += block->count;
+  auto sentinel = (offset + 16) & ~FFS_Offset(15);
+  auto dir_table = sentinel + 16;
+  auto dir_index = dir_table + FFS_Offset(blocks.size()) * sizeof(FFS_Dir);
+  auto dir_slots = Align(dir_index + FFS_Offset(indexed) * sizeof(DWORD), 8);
+  auto slot_count = DirSlotCount(DWORD(blocks.size()));
+  auto needed = dir_slots + DirSlotsSize(slot_count);
+  FFS_Offset leaf_slots = 0;
+  auto leaf_slot_count = LeafSlotCount(indexed);
+  if (options.leaf_index) {
+    leaf_slots = Align(needed, 8);
+    needed = leaf_slots + LeafSlotsSize(leaf_slot_count);
+  }
+  if (!offset || (needed > size)) {
+    header->status = FFS_kError;
+    return false;
+  }
+
+  header->bytes = offset;
+  auto slots = reinterpret_cast<FFS_DirSlots*>(start + dir_slots);
+  InitDirSlots(slots, slot_count);
+  auto dir = reinterpret_cast<FFS_Dir*>(start + dir_table);
+  auto index = reinterpret_cast<DWORD*>(start + dir_index);
+
+  for (auto block : blocks) {
+    dir->anchor = block->anchor;
+    dir->hash = block->hash;
+    dir->count = block->count;
+    dir->generation = 0;
+    dir->index = FFS_Offset(reinterpret_cast<BYTE*>(index) - start);
+    // The listings are sorted already so the index is in layout order.
+    if (options.layout == FFS_kLayoutColumns) {
+      for (DWORD ix = 1; ix <= block->count; ++ix)
+        *index++ = block->anchor + ix;
+    } else {
+      RecordNodes records(header);
+      for (auto node = records.Next(block->anchor); node; node = records.Next(node))
+        *index++ = node;
+    }
+    InsertDirSlot(slots, block->hash, FFS_Offset(reinterpret_cast<BYTE*>(dir) - start));
+    ++dir;
+  }
+
+  if (leaf_slots) {
+    auto leaves = reinterpret_cast<FFS_LeafSlots*>(start + leaf_slots);
+    InitLeafSlots(leaves, leaf_slot_count);
+    auto dirs = reinterpret_cast<const FFS_Dir*>(start + dir_table);
+    WIN32_FIND_DATA w32fd;
+    for (size_t ix = 0; ix != blocks.size(); ++ix) {
+      auto entries = dirs[ix].index.Get(header);
+      for (DWORD entry = 0; entry != dirs[ix].count; ++entry) {
+        ReadNode(header, entries[entry], &w32fd);
+        auto hash = CombineHash(dirs[ix].hash, StoredNameHash(&ss, w32fd.cFileName));
+        InsertLeafSlot(leaves, hash, dirs[ix].anchor, entries[entry]);
+      }
+    }
+  }
+
+  header->num_dirs = dir_count;
+  header->num_nodes = all_count;
+  // The listings copied from the snapshot don't say what was left out of them.
+  header->num_filtered = old_header ? old_header->num_filtered : filtered_count;
+  header->dir_table = dir_table;
+  header->dir_count = DWORD(blocks.size());
+  header->dir_index = dir_index;
+  header->dir_slots_start = dir_slots;
+  header->dir_slots = dir_slots;
+  header->leaf_slots = leaf_slots;
+  // 0 is for the client slots that are not in an epoch, see Epoch.h.
+  header->epoch = 1;
+  header->status = FFS_kUpdating;
+
+  *reinterpret_cast<DWORD*>(start + sentinel) = 0xAA55AA55;
+
+  // The rest of the section is free, the indexes grow into it.
+  header->used = needed;
+  header->status = FFS_kFinished;
+  return true;
+}
+
+}  // namespace
+
+DWORD DefaultScanThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool CreateFFS(BYTE* const start, size_t size, const wchar_t* top_dir,
+               const ScanOptions& options) {
+  return BuildFFS(start, size, top_dir, options, nullptr);
+}
+
+bool RevalidateFFS(BYTE* const start, size_t size, const wchar_t* top_dir,
+                   const ScanOptions& options, const FFS_Header* old_header) {
+  WIN32_FIND_DATA root;
+  ReadNode(old_header, old_header->root_offset, &root);
+  if (wcscmp(root.cFileName, top_dir) != 0)
+    return false;
+  if (old_header->filter != (options.filter ? options.filter->fingerprint() : 0))
+    return false;
+  // The listings that are reused need the fields of the new section.
+  auto fields = (options.layout == FFS_kLayoutColumns) ? options.fields : DWORD(FFS_kAllFields);
+  if ((old_header->fields & fields) != fields)
+    return false;
+  return BuildFFS(start, size, top_dir, options, old_header);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// Initial scan of the tree. The directories are read by a pool of worker threads, each one
+// writing the listings it reads into its own arena. Once the pool drains, the calling thread
+// merges the listings into the shared section.
+
+struct FFS_Header;
+class PathFilter;
+
+// Number of scan threads to use when none is given.
+DWORD DefaultScanThreads();
+
+struct ScanOptions {
+  // Number of directory readers.
+  DWORD threads;
+  // The paths to leave out of the section, or null to have everything.
+  const PathFilter* filter;
+  // How the nodes are laid out in the section, an FFS_Layout.
+  DWORD layout;
+  // How the names of the columns layout are stored, an FFS_NameEncoding.
+  DWORD names;
+  // The FFS_Fields the columns layout stores, FFS_kAllFields or FFS_kClientFields. The records
+  // have them all.
+  DWORD fields;
+  // How the names are hashed, an FFS_HashPolicy.
+  DWORD hash_policy;
+  // Whether to build the leaf index, FFS_LeafSlots. It makes the file lookups independent of
+  // the size of the directories for 24 to 48 bytes per node.
+  bool leaf_index;
+};
+
+// Fills the shared section at |start| with the tree rooted at |top_dir|. Returns false if
+// |top_dir| cannot be read or the tree does not fit in |size| bytes.
+bool CreateFFS(BYTE* const start, size_t size, const wchar_t* top_dir,
+               const ScanOptions& options);
+
+// Same as CreateFFS() but reuses the listings of |old_header|, a snapshot of the section for
+// the same |top_dir| and filter, for the directories that were not modified since. |old_header|
+// must not be inside the [start, start + size) range.
+bool RevalidateFFS(BYTE* const start, size_t size, const wchar_t* top_dir,
+                   const ScanOptions& options, const FFS_Header* old_header);
@@ -0,0 +1,204 @@
+#pragma once
+
+// Helpers shared by the code that writes and reads the shared section. See the comment at the
+// top of FastFileStats.cpp for the layout.
+
+#include <string>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <xmmintrin.h>
+#endif
+
+// The size of the shared section unless the server is told otherwise with --section-mb. It is
+// reserved up front and committed as it fills. A 64-bit server can go over 4 GB, see FFS_Offset.
+const size_t kMaxSharedSize = 1024 * 1024 * 300;
+
+#if defined(_WIN32)
+const wchar_t kPathSep = L'\\';
+#else
+const wchar_t kPathSep = L'/';
+#endif
+
+// Loads and stores of the section that another process can be reading or writing at the same
+// time. A release store publishes everything written before it, and an acquire load that sees
+// the stored value sees those writes too.
+#if defined(_MSC_VER)
+// On x86 and x64 volatile accesses are acquire and release, see /volatile:ms, but 64 bit ones
+// are only atomic on x64.
+inline DWORD LoadAcquire(const DWORD* value) {
+  return *static_cast<const volatile DWORD*>(value);
+}
+
+inline void StoreRelease(DWORD* dest, DWORD value) {
+  *static_cast<volatile DWORD*>(dest) = value;
+}
+
+inline ULONGLONG LoadAcquire(const ULONGLONG* value) {
+#if defined(_M_X64)
+  return *static_cast<const volatile ULONGLONG*>(value);
+#else
+  auto shared = const_cast<volatile LONGLONG*>(reinterpret_cast<const volatile LONGLONG*>(value));
+  return ULONGLONG(::InterlockedCompareExchange64(shared, 0, 0));
+#endif
+}
+
+inline void StoreRelease(ULONGLONG* dest, ULONGLONG value) {
+#if defined(_M_X64)
+  *static_cast<volatile ULONGLONG*>(dest) = value;
+#else
+  ::InterlockedExchange64(reinterpret_cast<volatile LONGLONG*>(dest), LONGLONG(value));
+#endif
+}
+#else
+inline DWORD LoadAcquire(const DWORD* value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+inline void StoreRelease(DWORD* dest, DWORD value) {
+  __atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+
+inline ULONGLONG LoadAcquire(const ULONGLONG* value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+inline void StoreRelease(ULONGLONG* dest, ULONGLONG value) {
+  __atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+#endif
+
+// Atomic read-modify-writes of the section, for what several processes write, see Epoch.h. They
+// are full barriers: no load or store moves across them.
+#if defined(_MSC_VER)
+inline DWORD Exchange(DWORD* dest, DWORD value) {
+  return DWORD(::InterlockedExchange(reinterpret_cast<volatile LONG*>(dest), LONG(value)));
+}
+
+// Stores |value| if |*dest| is |expected|. Returns what |*dest| was.
+inline DWORD CompareExchange(DWORD* dest, DWORD expected, DWORD value) {
+  return DWORD(::InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(dest), LONG(value),
+                                            LONG(expected)));
+}
+#else
+inline DWORD Exchange(DWORD* dest, DWORD value) {
+  return __atomic_exchange_n(dest, value, __ATOMIC_SEQ_CST);
+}
+
+inline DWORD CompareExchange(DWORD* dest, DWORD expected, DWORD value) {
+  __atomic_compare_exchange_n(dest, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return expected;
+}
+#endif
+
+// Fences for the generations below. AcquireFence() keeps the loads before it from moving after
+// the loads that follow it, ReleaseFence() the stores before it from moving after the stores that
+// follow it. x86 and x64 keep those orders anyway, so with MSVC only the compiler needs telling.
+inline void AcquireFence() {
+#if defined(_MSC_VER)
+  _ReadWriteBarrier();
+#else
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void ReleaseFence() {
+#if defined(_MSC_VER)
+  _ReadWriteBarrier();
+#else
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+}
+
+// The generations of the section, FFS_Header::generation and FFS_Dir::generation, are seqlocks.
+// The server makes one odd before it writes what it covers and even again after. A client reads
+// it before and after it reads what it covers, without taking any lock, and reads again if it
+// was odd or changed in between: a write overlapped and what it read may be torn.
+inline void BeginWrite(DWORD* generation) {
+  StoreRelease(generation, *generation + 1);
+  // The writes that follow must not be seen before the generation is odd.
+  ReleaseFence();
+}
+
+inline void EndWrite(DWORD* generation) {
+  StoreRelease(generation, *generation + 1);
+}
+
+// The tries of BeginRead(), a millisecond or so. A write takes microseconds, unless the server
+// died in the middle of it.
+const DWORD kReadSpins = 1 << 20;
+
+// Sets |*value| to the generation to give EndRead() once it is even, and returns true. Returns
+// false if it is still odd after kReadSpins tries; the caller checks that the server is still
+// there, see IsServerAlive(), before it tries again.
+inline bool BeginRead(const DWORD* generation, DWORD* value) {
+  for (DWORD tries = 0; tries != kReadSpins; ++tries) {
+    *value = LoadAcquire(generation);
+    if (!(*value & 1))
+      return true;
+  }
+  return false;
+}
+
+// Tells if what was read since BeginRead() returned |value| is consistent.
+inline bool EndRead(const DWORD* generation, DWORD value) {
+  AcquireFence();
+  return LoadAcquire(generation) == value;
+}
+
+// Starts loading the cache line at |address| without waiting for it, for the lookups that know
+// what they will read next while they work on something else.
+inline void Prefetch(const void* address) {
+#if defined(_MSC_VER)
+  _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+  __builtin_prefetch(address);
+#endif
+}
+
+// adapted to start from the back.
+inline DWORD Hash_FNV1a_32(const BYTE* bp, size_t len) {
+  auto be = bp + len - 1;
+  DWORD hval = 0x811c9dc5UL;
+  while (bp <= be) {
+    hval ^= (DWORD)*be--;
+    hval += (hval << 1) + (hval << 4) + (hval << 7) +
+            (hval << 8) + (hval << 24);
+  }
+  return hval;
+}
+
+inline DWORD FileHash(const std::wstring& fname) {
+  return Hash_FNV1a_32(reinterpret_cast<const BYTE*>(&fname[0]), fname.size() * sizeof(wchar_t));
+}
+
+inline bool AddDir(const wchar_t* name) {
+  if (name[0] != '.')
+    return true;
+  if (name[1] == 0)
+    return false;
+  if (name[1] != '.')
+    return true;
+  return false;
+}
+
+// Sets the size of the record, whose name has |name_len| characters, and returns the record
+// after it. For when the length is known already, which saves the wcslen().
+inline WIN32_FIND_DATA* AdvanceNext(WIN32_FIND_DATA* current, size_t name_len) {
+  DWORD len = DWORD(name_len + 1) * sizeof(wchar_t);
+  len = (len + 8 ) & ~7;
+  current->dwReserved1 = len;
+  return reinterpret_cast<WIN32_FIND_DATA*>(
+      reinterpret_cast<BYTE*>(&current->cFileName[0]) + len);
+}
+
+inline WIN32_FIND_DATA* AdvanceNext(WIN32_FIND_DATA* current) {
+  return AdvanceNext(current, wcslen(current->cFileName));
+}
+
+inline const WIN32_FIND_DATA* AdvanceNext(const WIN32_FIND_DATA* current) {
+  if (!current->dwReserved1)
+    __debugbreak();
+  return reinterpret_cast<const WIN32_FIND_DATA*>(
+      reinterpret_cast<const BYTE*>(&current->cFileName[0]) + current->dwReserved1);
+}
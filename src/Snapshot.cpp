@@ -0,0 +1,413 @@
+// Snapshots of the shared section on disk.
+
+#include "stdafx.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <string>
+
+#include "DirIndex.h"
+#include "FastFileStats.h"
+#include "Hash.h"
+#include "Scanner.h"
+#include "Snapshot.h"
+#include "Utf8.h"
+
+namespace {
+
+// A part of the file to write.
+struct Span {
+  const BYTE* data;
+  size_t size;
+};
+
+#if defined(_WIN32)
+
+const BYTE* MapFile(const wchar_t* path, size_t* mapped_size) {
+  const BYTE* data = nullptr;
+  auto file = ::CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return nullptr;
+  LARGE_INTEGER size;
+  if (::GetFileSizeEx(file, &size) && size.QuadPart) {
+    auto mmap = ::CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mmap) {
+      data = reinterpret_cast<const BYTE*>(::MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, 0));
+      *mapped_size = data ? size_t(size.QuadPart) : 0;
+      ::CloseHandle(mmap);
+    }
+  }
+  ::CloseHandle(file);
+  return data;
+}
+
+void UnmapFile(const BYTE* data, size_t) {
+  ::UnmapViewOfFile(data);
+}
+
+bool WriteFileAtomically(const std::wstring& path, const Span* spans, size_t count) {
+  auto temp = path + L".tmp";
+  auto file = ::CreateFileW(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  bool ok = true;
+  for (size_t ix = 0; ok && ix != count; ++ix) {
+    auto data = spans[ix].data;
+    auto size = spans[ix].size;
+    while (ok && size) {
+      DWORD written = 0;
+      DWORD chunk = DWORD(std::min<size_t>(size, 1024 * 1024 * 16));
+      ok = ::WriteFile(file, data, chunk, &written, NULL) && written == chunk;
+      data += chunk;
+      size -= chunk;
+    }
+  }
+  ok = ok && ::FlushFileBuffers(file);
+  ::CloseHandle(file);
+  return ok && ::MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+#else
+
+const BYTE* MapFile(const wchar_t* path, size_t* mapped_size) {
+  const BYTE* data = nullptr;
+  int fd = ::open(ToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (::fstat(fd, &st) == 0 && st.st_size) {
+    auto mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping != MAP_FAILED) {
+      data = reinterpret_cast<const BYTE*>(mapping);
+      *mapped_size = st.st_size;
+    }
+  }
+  ::close(fd);
+  return data;
+}
+
+void UnmapFile(const BYTE* data, size_t size) {
+  ::munmap(const_cast<BYTE*>(data), size);
+}
+
+bool WriteFileAtomically(const std::wstring& path, const Span* spans, size_t count) {
+  auto native = ToUtf8(path);
+  auto temp = native + ".tmp";
+  int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = true;
+  for (size_t ix = 0; ok && ix != count; ++ix) {
+    auto data = spans[ix].data;
+    auto size = spans[ix].size;
+    while (ok && size) {
+      auto written = ::write(fd, data, size);
+      ok = written > 0;
+      if (ok) {
+        data += written;
+        size -= written;
+      }
+    }
+  }
+  ok = ok && (::fsync(fd) == 0);
+  ::close(fd);
+  return ok && (::rename(temp.c_str(), native.c_str()) == 0);
+}
+
+#endif
+
+DWORD HeaderChecksum(const FFS_FileHeader* file_header) {
+  FFS_FileHeader copy = *file_header;
+  copy.header_crc32c = 0;
+  return Crc32c(reinterpret_cast<const BYTE*>(&copy), sizeof(copy));
+}
+
+void AddSection(FFS_FileHeader* file_header, DWORD kind, const FFS_Header* header,
+                FFS_Offset begin, FFS_Offset end) {
+  auto section = &file_header->sections[file_header->section_count++];
+  section->kind = kind;
+  section->crc32c = Crc32c(reinterpret_cast<const BYTE*>(header) + begin, size_t(end - begin));
+  section->offset = file_header->image_offset + begin;
+  section->size = end - begin;
+}
+
+// Checks that the pilots and the slots of |hash|, |slot_size| bytes each, are within the index
+// tables of the section at |header|.
+bool IsValidPerfectHash(const FFS_Header* header, const FFS_PerfectHash& hash, size_t slot_size) {
+  if (!hash.bucket_count || (hash.bucket_count > hash.key_count) ||
+      (hash.pilots < header->dir_slots_start) || (hash.pilots % 8) ||
+      (hash.slots < header->dir_slots_start) || (hash.slots % 8) ||
+      (header->used < hash.pilots) || (header->used < hash.slots))
+    return false;
+  return (hash.bucket_count <= (header->used - hash.pilots) / sizeof(DWORD)) &&
+         (hash.key_count <= (header->used - hash.slots) / slot_size);
+}
+
+// Checks that the FFS_Dir at |dir| is in the table of the section at |header|, or was added by
+// the server after it, see Update.h, and that its anchor and index are in the image.
+bool IsValidDir(const FFS_Header* header, FFS_OffsetPtr<FFS_Dir> dir, ULONGLONG refs_end) {
+  if ((dir >= header->dir_table) && (dir < header->dir_index))
+    return (dir - header->dir_table) % sizeof(FFS_Dir) == 0;
+  if ((dir < header->dir_index) || (dir % 8) || (dir > header->used) ||
+      (header->used - dir < sizeof(FFS_Dir)))
+    return false;
+  auto added = dir.Get(header);
+  return (added->anchor < refs_end) && (added->index >= header->dir_index) &&
+         (added->index <= header->used) &&
+         (added->count <= (header->used - added->index) / sizeof(DWORD));
+}
+
+// Checks that the section is complete and that its offsets are within the image.
+bool IsValidImage(const BYTE* data, size_t size) {
+  if (size < sizeof(FFS_Header))
+    return false;
+  auto header = reinterpret_cast<const FFS_Header*>(data);
+  if ((header->magic != FFS_kMagic) || (header->version != FFS_kVersion) ||
+      (header->offset_size != sizeof(FFS_Offset)))
+    return false;
+  if ((header->status != FFS_kFinished) && (header->status != FFS_kFrozen))
+    return false;
+  if ((header->fields & FFS_kClientFields) != FFS_kClientFields ||
+      (header->fields & ~DWORD(FFS_kAllFields)))
+    return false;
+  if (header->hash_policy > FFS_kHashCrc32c)
+    return false;
+  // The refs are offsets with the records and indexes with the columns.
+  ULONGLONG nodes_end = header->bytes;
+  if (header->layout == FFS_kLayoutColumns) {
+    auto& columns = header->columns;
+    struct { FFS_Offset offset; DWORD item_size; bool stored; } arrays[] = {
+      {columns.attributes, sizeof(DWORD), true},
+      {columns.size, sizeof(ULONGLONG), true},
+      {columns.creation_time, sizeof(ULONGLONG),
+       (header->fields & FFS_kFieldCreationTime) != 0},
+      {columns.access_time, sizeof(ULONGLONG), (header->fields & FFS_kFieldAccessTime) != 0},
+      {columns.write_time, sizeof(ULONGLONG), true},
+      {columns.parent, sizeof(DWORD), true},
+      {columns.next, sizeof(DWORD), true},
+      {columns.name, sizeof(DWORD), true},
+    };
+    for (auto& array : arrays) {
+      if (!array.stored) {
+        if (array.offset)
+          return false;
+        continue;
+      }
+      if ((array.offset < sizeof(FFS_Header)) || (array.offset > columns.name_pool) ||
+          (columns.count > (columns.name_pool - array.offset) / array.item_size))
+        return false;
+    }
+    if ((columns.names != FFS_kNamesWide) && (columns.names != FFS_kNamesUtf8) &&
+        (columns.names != FFS_kNamesFrontCoded))
+      return false;
+    size_t unit = (columns.names == FFS_kNamesWide) ? sizeof(wchar_t) : 1;
+    if ((columns.name_pool > columns.name_table) || (columns.name_table > header->bytes) ||
+        (columns.name_pool_size > (columns.name_table - columns.name_pool) / unit))
+      return false;
+    if (columns.names == FFS_kNamesFrontCoded) {
+      // No name table, the restarts are found from the interval.
+      if (!columns.restart_interval || columns.name_table_size ||
+          (columns.name_table != header->bytes))
+        return false;
+    } else {
+      // The probes rely on empty slots.
+      auto slots = columns.name_table_size;
+      if ((slots & (slots - 1)) || (slots <= columns.name_count) ||
+          (slots != (header->bytes - columns.name_table) / sizeof(FFS_NameSlot)))
+        return false;
+    }
+    nodes_end = columns.count;
+  } else if ((header->layout != FFS_kLayoutRecords) || (header->fields != FFS_kAllFields) ||
+             (nodes_end > 0xFFFFFFFFull)) {
+    return false;
+  }
+  if ((header->used > size) || (header->root_offset >= nodes_end) ||
+      (header->dir_table < header->bytes) || (header->dir_table % 16) ||
+      (header->dir_index != header->dir_table + header->dir_count * sizeof(FFS_Dir)) ||
+      (header->dir_slots_start < header->dir_index) || (header->dir_slots_start % 8) ||
+      (header->dir_slots < header->dir_slots_start) || (header->dir_slots % 8) ||
+      (header->used < header->dir_slots) ||
+      (header->used - header->dir_slots < sizeof(FFS_DirSlots)))
+    return false;
+  // The records the server added are after the FFS_Dir table.
+  auto refs_end = (header->layout == FFS_kLayoutRecords) ? ULONGLONG(header->used) : nodes_end;
+  auto dirs = header->dir_table.Get(header);
+  for (DWORD ix = 0; ix != header->dir_count; ++ix) {
+    if ((dirs[ix].anchor >= refs_end) || (dirs[ix].index < header->dir_index) ||
+        (dirs[ix].count > (header->dir_slots_start - dirs[ix].index) / sizeof(DWORD)))
+      return false;
+  }
+  // The probes stop at an empty slot, and the slots must point to an FFS_Dir or be removed. The
+  // counts decide when the table is replaced, so they have to be right for it to keep one.
+  auto table = header->dir_slots.Get(header);
+  auto slot_count = table->slot_count;
+  if (!slot_count || (slot_count & (slot_count - 1)) ||
+      (slot_count > (header->used - header->dir_slots) / sizeof(FFS_DirSlot)))
+    return false;
+  DWORD empty = 0;
+  DWORD removed = 0;
+  for (DWORD ix = 0; ix != slot_count; ++ix) {
+    auto packed = table->slots[ix].packed;
+    if (!packed) {
+      ++empty;
+      continue;
+    }
+    FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(packed)};
+    if (!dir) {
+      if (packed != kDirSlotFingerprintMask)
+        return false;
+      ++removed;
+      continue;
+    }
+    if (!IsValidDir(header, dir, refs_end) ||
+        (DirSlotFingerprint(dir.Get(header)->hash) != (packed ^ dir)))
+      return false;
+  }
+  if (!empty || (table->removed_count != removed) ||
+      (table->dir_count != slot_count - empty - removed))
+    return false;
+  // The perfect hashes only have the slots, which are 0 for the shared hashes.
+  auto& frozen_dirs = header->frozen_dirs;
+  if (frozen_dirs.key_count) {
+    if ((header->status != FFS_kFrozen) ||
+        !IsValidPerfectHash(header, frozen_dirs, sizeof(FFS_DirSlot)))
+      return false;
+    auto slots = FFS_OffsetPtr<FFS_DirSlot>{frozen_dirs.slots}.Get(header);
+    for (DWORD ix = 0; ix != frozen_dirs.key_count; ++ix) {
+      FFS_OffsetPtr<FFS_Dir> dir = {DirSlotOffset(slots[ix].packed)};
+      if (dir && !IsValidDir(header, dir, refs_end))
+        return false;
+    }
+  }
+  if (!header->leaf_slots)
+    return !header->frozen_leaves.key_count;
+  // Same for the leaf index, whose slots have node refs.
+  if ((header->leaf_slots < header->dir_slots_start) || (header->leaf_slots % 8) ||
+      (header->used < header->leaf_slots) ||
+      (header->used - header->leaf_slots < sizeof(FFS_LeafSlots)))
+    return false;
+  auto leaves = header->leaf_slots.Get(header);
+  slot_count = leaves->slot_count;
+  if (!slot_count || (slot_count & (slot_count - 1)) ||
+      (slot_count > (header->used - header->leaf_slots) / sizeof(FFS_LeafSlot)))
+    return false;
+  empty = 0;
+  removed = 0;
+  for (DWORD ix = 0; ix != slot_count; ++ix) {
+    auto& slot = leaves->slots[ix];
+    if (!slot.node) {
+      ++empty;
+      continue;
+    }
+    if ((slot.node >= refs_end) || (slot.dir >= refs_end))
+      return false;
+    if (!slot.dir)
+      ++removed;
+  }
+  if (!empty || (leaves->removed_count != removed) ||
+      (leaves->leaf_count != slot_count - empty - removed))
+    return false;
+  auto& frozen_leaves = header->frozen_leaves;
+  if (frozen_leaves.key_count) {
+    if ((header->status != FFS_kFrozen) ||
+        !IsValidPerfectHash(header, frozen_leaves, sizeof(FFS_LeafSlot)))
+      return false;
+    auto slots = FFS_OffsetPtr<FFS_LeafSlot>{frozen_leaves.slots}.Get(header);
+    for (DWORD ix = 0; ix != frozen_leaves.key_count; ++ix) {
+      if ((slots[ix].node >= refs_end) || (slots[ix].dir >= refs_end))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Returns the section in the snapshot file at |data|, or null if the file is not valid.
+const FFS_Header* ValidateSnapshot(const BYTE* data, size_t size, bool verify) {
+  if (size < sizeof(FFS_FileHeader))
+    return nullptr;
+  auto file_header = reinterpret_cast<const FFS_FileHeader*>(data);
+  if ((file_header->magic != FFS_kFileMagic) || (file_header->version != FFS_kFileVersion) ||
+      (file_header->header_size != sizeof(FFS_FileHeader)))
+    return nullptr;
+  if (file_header->header_crc32c != HeaderChecksum(file_header))
+    return nullptr;
+  // A truncated file has the right header but not all of the image.
+  auto image_end = file_header->image_offset + file_header->image_size;
+  if ((file_header->file_size != size) || (image_end > size) ||
+      (file_header->image_offset % FFS_kFileAlignment) ||
+      (file_header->section_count > FFS_kMaxFileSections))
+    return nullptr;
+
+  for (DWORD ix = 0; ix != file_header->section_count; ++ix) {
+    auto section = &file_header->sections[ix];
+    if ((section->offset < file_header->image_offset) ||
+        (section->offset + section->size > image_end))
+      return nullptr;
+    if (verify && (section->crc32c != Crc32c(data + section->offset, size_t(section->size))))
+      return nullptr;
+  }
+
+  auto image = data + file_header->image_offset;
+  if (!IsValidImage(image, size_t(file_header->image_size)))
+    return nullptr;
+  return reinterpret_cast<const FFS_Header*>(image);
+}
+
+}  // namespace
+
+bool SaveSnapshot(const FFS_Header* header, const wchar_t* path) {
+  if ((header->status != FFS_kFinished) && (header->status != FFS_kFrozen))
+    return false;
+
+  // The file header is padded to a page so the image can be mapped in place.
+  ULONGLONG first_page[FFS_kFileAlignment / sizeof(ULONGLONG)] = {};
+  auto file_header = reinterpret_cast<FFS_FileHeader*>(first_page);
+  file_header->magic = FFS_kFileMagic;
+  file_header->version = FFS_kFileVersion;
+  file_header->header_size = sizeof(FFS_FileHeader);
+  file_header->image_offset = FFS_kFileAlignment;
+  file_header->image_size = header->used;
+  file_header->file_size = file_header->image_offset + file_header->image_size;
+  AddSection(file_header, FFS_kSectionHeader, header, 0, sizeof(FFS_Header));
+  AddSection(file_header, FFS_kSectionNodes, header, sizeof(FFS_Header), header->dir_table);
+  AddSection(file_header, FFS_kSectionDirs, header, header->dir_table, header->dir_index);
+  AddSection(file_header, FFS_kSectionDirIndex, header, header->dir_index,
+             header->dir_slots_start);
+  AddSection(file_header, FFS_kSectionDirSlots, header, header->dir_slots_start, header->used);
+  file_header->header_crc32c = HeaderChecksum(file_header);
+
+  Span spans[] = {
+    {reinterpret_cast<const BYTE*>(first_page), sizeof(first_page)},
+    {reinterpret_cast<const BYTE*>(header), size_t(header->used)},
+  };
+  return WriteFileAtomically(path, spans, sizeof(spans) / sizeof(spans[0]));
+}
+
+bool LoadSnapshot(BYTE* const start, size_t size, const wchar_t* top_dir, const wchar_t* path,
+                  const ScanOptions& options) {
+  SnapshotView view(path, true);
+  if (!view.header())
+    return false;
+  return RevalidateFFS(start, size, top_dir, options, view.header());
+}
+
+SnapshotView::SnapshotView(const wchar_t* path, bool verify)
+    : data_(nullptr), size_(0), header_(nullptr) {
+  data_ = MapFile(path, &size_);
+  if (data_)
+    header_ = ValidateSnapshot(data_, size_, verify);
+}
+
+SnapshotView::~SnapshotView() {
+  if (data_)
+    UnmapFile(data_, size_);
+}
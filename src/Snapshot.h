@@ -0,0 +1,47 @@
+#pragma once
+
+// Snapshots of the shared section on disk.
+//
+// A full scan of a big tree takes minutes, so the server saves the section when it exits and
+// periodically while it runs. On the next start the snapshot is revalidated instead: only the
+// directories are stat'ed and just the ones whose modification time changed are read again, see
+// RevalidateFFS().
+//
+// The section only has offsets relative to FFS_Header so the snapshot file is the section bytes
+// as they are, up to FFS_Header::used, after an FFS_FileHeader. See FastFileStats.h for the
+// format. Tools that only query the tree map the file with SnapshotView and use the functions in
+// Lookup.h on it directly.
+
+#include <stddef.h>
+
+struct FFS_Header;
+struct ScanOptions;
+
+// Writes the section at |header| to |path|, replacing the previous snapshot atomically.
+bool SaveSnapshot(const FFS_Header* header, const wchar_t* path);
+
+// Fills the section at |start| for |top_dir| from the snapshot at |path|. Returns false if there
+// is no usable snapshot; the caller should do a full scan then.
+bool LoadSnapshot(BYTE* const start, size_t size, const wchar_t* top_dir, const wchar_t* path,
+                  const ScanOptions& options);
+
+// A snapshot file mapped read-only. Nothing is copied; header() points into the mapping and is
+// valid for the lifetime of the view.
+class SnapshotView {
+ public:
+  // The file headers and the offsets in FFS_Header are always checked. |verify| also checks the
+  // checksums of all the sections, which reads the whole file.
+  SnapshotView(const wchar_t* path, bool verify);
+  ~SnapshotView();
+
+  // Null if the file is missing or is not a valid snapshot.
+  const FFS_Header* header() const { return header_; }
+
+ private:
+  SnapshotView(const SnapshotView&);
+  void operator=(const SnapshotView&);
+
+  const BYTE* data_;
+  size_t size_;
+  const FFS_Header* header_;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+// Batched stat for the Linux directory reader.
+//
+// Stat'ing every entry is what dominates a scan on a cold cache, and doing it with one blocking
+// statx per entry means the disk only ever sees one request at a time. The engine submits a
+// whole batch of statx requests to an io_uring and reaps the completions, so the requests are
+// in flight together. If io_uring is not available (old kernel, seccomp) it falls back to
+// synchronous statx calls.
+//
+// An engine is not thread safe, each scan worker has its own.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct StatRequest {
+  // The entry to stat, |name| is relative to |dirfd|. AT_FDCWD and absolute names are fine too.
+  int dirfd;
+  const char* name;
+  // Filled by the engine. |error| is 0 or an errno value.
+  struct statx stx;
+  int error;
+};
+
+class StatEngine {
+ public:
+  StatEngine();
+  ~StatEngine();
+
+  // Stats the |count| requests. Symbolic links are not followed.
+  void Stat(StatRequest* requests, size_t count);
+
+  bool uses_uring() const { return ring_fd_ >= 0; }
+
+  // Makes engines created afterwards use synchronous statx. For benchmarking.
+  static void ForceSync(bool force_sync);
+
+ private:
+  StatEngine(const StatEngine&);
+  void operator=(const StatEngine&);
+
+  bool SetupRing();
+  void CloseRing();
+  // Returns the number of requests that completed, which might be less than |count| if the
+  // ring stops working.
+  size_t StatWithRing(StatRequest* requests, size_t count);
+
+  int ring_fd_;
+  unsigned sq_entries_;
+  unsigned cq_entries_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_sqe* sqes_;
+  struct io_uring_cqe* cqes_;
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+};
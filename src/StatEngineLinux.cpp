@@ -0,0 +1,172 @@
+// io_uring stat engine. There is no liburing on the build hosts, so this talks to the kernel
+// directly: io_uring_setup, the three mmaped regions and io_uring_enter.
+
+#include "stdafx.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "StatEngine.h"
+
+namespace {
+
+const unsigned kRingEntries = 256;
+const unsigned kStatxMask = STATX_BASIC_STATS | STATX_BTIME;
+
+bool force_sync = false;
+
+int SyncStat(StatRequest* req) {
+  if (::statx(req->dirfd, req->name, AT_SYMLINK_NOFOLLOW, kStatxMask, &req->stx) != 0)
+    return errno;
+  return 0;
+}
+
+template <typename T>
+T* RingPtr(void* ring, unsigned offset) {
+  return reinterpret_cast<T*>(reinterpret_cast<BYTE*>(ring) + offset);
+}
+
+}  // namespace
+
+StatEngine::StatEngine()
+    : ring_fd_(-1), sqes_(nullptr), sq_ring_(MAP_FAILED), sq_ring_size_(0),
+      cq_ring_(MAP_FAILED), cq_ring_size_(0) {
+  if (!force_sync && !SetupRing())
+    CloseRing();
+}
+
+StatEngine::~StatEngine() {
+  CloseRing();
+}
+
+void StatEngine::ForceSync(bool sync) {
+  force_sync = sync;
+}
+
+bool StatEngine::SetupRing() {
+  io_uring_params params = {};
+  ring_fd_ = int(::syscall(__NR_io_uring_setup, kRingEntries, &params));
+  if (ring_fd_ < 0)
+    return false;
+
+  sq_entries_ = params.sq_entries;
+  cq_entries_ = params.cq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+  sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED)
+    return false;
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED)
+      return false;
+  }
+  auto sqes = ::mmap(nullptr, sq_entries_ * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+  sqes_ = reinterpret_cast<io_uring_sqe*>(sqes);
+
+  sq_head_ = RingPtr<unsigned>(sq_ring_, params.sq_off.head);
+  sq_tail_ = RingPtr<unsigned>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = RingPtr<unsigned>(sq_ring_, params.sq_off.ring_mask);
+  sq_array_ = RingPtr<unsigned>(sq_ring_, params.sq_off.array);
+  cq_head_ = RingPtr<unsigned>(cq_ring_, params.cq_off.head);
+  cq_tail_ = RingPtr<unsigned>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = RingPtr<unsigned>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = RingPtr<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+  return true;
+}
+
+void StatEngine::CloseRing() {
+  if (sqes_)
+    ::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    ::munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != MAP_FAILED)
+    ::munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0)
+    ::close(ring_fd_);
+  sqes_ = nullptr;
+  sq_ring_ = cq_ring_ = MAP_FAILED;
+  ring_fd_ = -1;
+}
+
+size_t StatEngine::StatWithRing(StatRequest* requests, size_t count) {
+  size_t next = 0;
+  size_t done = 0;
+  unsigned in_flight = 0;
+  unsigned to_submit = 0;
+
+  while (done != count) {
+    // Queue as many requests as the rings have room for.
+    unsigned tail = *sq_tail_;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    while (next != count && in_flight != cq_entries_ && tail - head != sq_entries_) {
+      auto req = &requests[next];
+      unsigned index = tail & *sq_mask_;
+      auto sqe = &sqes_[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = req->dirfd;
+      sqe->addr = reinterpret_cast<ULONG_PTR>(req->name);
+      sqe->len = kStatxMask;
+      sqe->off = reinterpret_cast<ULONG_PTR>(&req->stx);
+      sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+      sqe->user_data = next;
+      sq_array_[index] = index;
+      ++tail;
+      ++next;
+      ++in_flight;
+      ++to_submit;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    auto submitted = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, 1,
+                               IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (submitted < 0) {
+      if (errno == EINTR)
+        continue;
+      // The queued requests are lost with the ring; the caller redoes what did not complete.
+      CloseRing();
+      return done;
+    }
+    to_submit -= unsigned(submitted);
+
+    unsigned cq_head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; cq_head != cq_tail; ++cq_head) {
+      auto cqe = &cqes_[cq_head & *cq_mask_];
+      auto req = &requests[cqe->user_data];
+      // Kernels before 5.6 don't know IORING_OP_STATX.
+      req->error = (cqe->res == -EINVAL) ? SyncStat(req) : -cqe->res;
+      ++done;
+      --in_flight;
+    }
+    __atomic_store_n(cq_head_, cq_head, __ATOMIC_RELEASE);
+  }
+  return done;
+}
+
+void StatEngine::Stat(StatRequest* requests, size_t count) {
+  if (uses_uring()) {
+    // With the ring gone mid-batch there is no telling which requests made it.
+    if (StatWithRing(requests, count) == count)
+      return;
+  }
+  for (size_t ix = 0; ix != count; ++ix)
+    requests[ix].error = SyncStat(&requests[ix]);
+}
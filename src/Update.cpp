@@ -0,0 +1,521 @@
+// Updates of the live section by the server.
+
+#include "stdafx.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Allocator.h"
+#include "Arena.h"
+#include "DirIndex.h"
+#include "DirReader.h"
+#include "FastFileStats.h"
+#include "Hash.h"
+#include "Layout.h"
+#include "LeafIndex.h"
+#include "Lookup.h"
+#include "Section.h"
+#include "Update.h"
+
+namespace {
+
+// The bytes the server allocates for a record with a name of |len| units, see AdvanceNext().
+FFS_Offset RecordBytes(size_t len) {
+  auto bytes = offsetof(WIN32_FIND_DATA, cFileName) + ((DWORD(len + 1) * sizeof(wchar_t) + 8) & ~7);
+  return FFS_Offset((bytes + 7) & ~size_t(7));
+}
+
+bool HasListing(DWORD attributes) {
+  return (attributes & FILE_ATTRIBUTE_DIRECTORY) && !(attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+}
+
+// The front coded listings are runs of nodes, which cannot lose any, see kKeepsRemoved.
+bool KeepsRemoved(const FFS_Header* header) {
+  return (header->layout == FFS_kLayoutColumns) &&
+         (header->columns.names == FFS_kNamesFrontCoded);
+}
+
+// The name at the end of |path|.
+std::wstring LastName(const std::wstring& path) {
+  auto sep = path.rfind(kPathSep);
+  return (sep == std::wstring::npos) ? path : path.substr(sep + 1);
+}
+
+// The memory of the listing of |dir| that goes once it is replaced or removed. The FFS_Dir table
+// stays as the scan wrote it, only the index of an FFS_Dir there goes. The others are blocks the
+// server allocated.
+SectionBlock ListingBlock(const FFS_Header* header, const FFS_Dir* dir) {
+  auto offset = FFS_Offset(reinterpret_cast<const BYTE*>(dir) -
+                           reinterpret_cast<const BYTE*>(header));
+  FFS_Offset index_bytes = FFS_Offset(dir->count) * sizeof(DWORD);
+  if ((offset >= header->dir_table) && (offset < header->dir_index)) {
+    SectionBlock block = {dir->index, index_bytes};
+    return block;
+  }
+  SectionBlock block = {offset, BlockSize(FFS_Offset(sizeof(FFS_Dir)) + index_bytes)};
+  return block;
+}
+
+FFS_Dir* Mutable(const FFS_Dir* dir) {
+  return const_cast<FFS_Dir*>(dir);
+}
+
+}  // namespace
+
+void WriteNodeFields(FFS_Header* header, FFS_Dir* dir, DWORD node, const WIN32_FIND_DATA& w32fd) {
+  BeginWrite(&dir->generation);
+  if (header->layout == FFS_kLayoutColumns) {
+    auto& columns = header->columns;
+    columns.attributes.Get(header)[node] = w32fd.dwFileAttributes;
+    columns.size.Get(header)[node] =
+        (ULONGLONG(w32fd.nFileSizeHigh) << 32) | w32fd.nFileSizeLow;
+    if (columns.creation_time)
+      columns.creation_time.Get(header)[node] = ToULL(w32fd.ftCreationTime);
+    if (columns.access_time)
+      columns.access_time.Get(header)[node] = ToULL(w32fd.ftLastAccessTime);
+    columns.write_time.Get(header)[node] = ToULL(w32fd.ftLastWriteTime);
+  } else {
+    // The fields come before the links and the name in the record.
+    auto rec = reinterpret_cast<WIN32_FIND_DATA*>(reinterpret_cast<BYTE*>(header) + node);
+    rec->dwFileAttributes = w32fd.dwFileAttributes;
+    rec->ftCreationTime = w32fd.ftCreationTime;
+    rec->ftLastAccessTime = w32fd.ftLastAccessTime;
+    rec->ftLastWriteTime = w32fd.ftLastWriteTime;
+    rec->nFileSizeHigh = w32fd.nFileSizeHigh;
+    rec->nFileSizeLow = w32fd.nFileSizeLow;
+  }
+  EndWrite(&dir->generation);
+}
+
+bool RefreshNodeFields(FFS_Header* header, FFS_Dir* dir, DWORD node, const WIN32_FIND_DATA& w32fd) {
+  // Only the server writes the fields, so it reads them without the generation.
+  WIN32_FIND_DATA old;
+  ReadNode(header, node, &old);
+  if ((old.dwFileAttributes == w32fd.dwFileAttributes) &&
+      (old.nFileSizeLow == w32fd.nFileSizeLow) && (old.nFileSizeHigh == w32fd.nFileSizeHigh) &&
+      (ToULL(old.ftLastWriteTime) == ToULL(w32fd.ftLastWriteTime)) &&
+      (!HasFields(header, FFS_kFieldCreationTime) ||
+       (ToULL(old.ftCreationTime) == ToULL(w32fd.ftCreationTime))))
+    return false;
+  WriteNodeFields(header, dir, node, w32fd);
+  return true;
+}
+
+Updater::Updater(FFS_Header* header, size_t size)
+    : header_(header), size_(size), reclaimer_(header), retired_bytes_(0), reused_bytes_(0) {}
+
+bool Updater::RemoveNode(const std::wstring& path) {
+  const FFS_Dir* listing = nullptr;
+  auto node = GetNode(header_, path, &listing);
+  // The root and the "." nodes go with their directory.
+  if (!node || (node == listing->anchor))
+    return false;
+  BeginWrite(&header_->generation);
+  Unlink(Mutable(listing), node);
+  EndWrite(&header_->generation);
+  return true;
+}
+
+bool Updater::AddNode(const std::wstring& path, const WIN32_FIND_DATA& w32fd) {
+  const FFS_Dir* listing = nullptr;
+  auto node = GetNode(header_, path, &listing);
+  if (!listing)
+    return false;
+  if (node) {
+    RefreshNodeFields(header_, Mutable(listing), node, w32fd);
+    return true;
+  }
+  if (header_->layout == FFS_kLayoutColumns)
+    return false;
+  BeginWrite(&header_->generation);
+  auto added = Link(Mutable(listing), LastName(path), w32fd, true);
+  EndWrite(&header_->generation);
+  return added != 0;
+}
+
+bool Updater::AddTree(const std::wstring& path, const WIN32_FIND_DATA& w32fd,
+                      const PathFilter* filter, size_t relative) {
+  bool is_new = !GetNode(header_, path);
+  if (!AddNode(path, w32fd))
+    return false;
+  if (!is_new || !HasListing(w32fd.dwFileAttributes))
+    return true;
+  // A directory the filter excludes by name has no listing.
+  auto dir = FindDir(header_, path);
+  if (!dir)
+    return true;
+  PathFilter::State state;
+  if (filter)
+    state = filter->PathState(path.c_str() + path.size() - relative, relative);
+  FillListing(Mutable(dir), path, filter, state);
+  return true;
+}
+
+bool Updater::RenameNode(const std::wstring& from, const std::wstring& to,
+                         const WIN32_FIND_DATA& w32fd) {
+  // A node that is replaced by the rename goes first.
+  if (GetNode(header_, to))
+    RemoveNode(to);
+  const FFS_Dir* listing = nullptr;
+  auto node = GetNode(header_, from, &listing);
+  if (!node || (node == listing->anchor))
+    return AddNode(to, w32fd);
+  const FFS_Dir* target = nullptr;
+  GetNode(header_, to, &target);
+
+  BeginWrite(&header_->generation);
+  WIN32_FIND_DATA old;
+  ReadNode(header_, node, &old);
+  auto subdir = HasListing(old.dwFileAttributes) ? FindSubdir(header_, listing, node) : nullptr;
+  DWORD added = 0;
+  if (target && (header_->layout != FFS_kLayoutColumns)) {
+    auto name = LastName(to);
+    auto hash = CombineHash(target->hash, NodeNameHash(header_, name));
+    added = Link(Mutable(target), name, w32fd, !subdir);
+    if (added && subdir) {
+      // The listing moves under the new entry, so the entry of the old path has none to remove.
+      SetParent(subdir->anchor, added);
+      auto index = subdir->index.Get(header_);
+      for (DWORD ix = 0; ix != subdir->count; ++ix)
+        SetParent(index[ix], added);
+      RehashListing(Mutable(subdir), hash);
+    }
+    // Linking to the same directory replaced its listing.
+    GetNode(header_, from, &listing);
+  }
+  Unlink(Mutable(listing), node);
+  EndWrite(&header_->generation);
+  return added != 0;
+}
+
+void Updater::Reclaim() {
+  std::vector<SectionBlock> freed;
+  reclaimer_.Reclaim(&freed);
+  if (freed.empty())
+    return;
+  for (auto& block : freed) {
+    retired_bytes_ -= block.bytes;
+    FreeBlock(header_, block.offset, block.bytes);
+  }
+}
+
+FFS_Offset Updater::Allocate(FFS_Offset bytes, bool record) {
+  // A record is named by its offset, which is a DWORD.
+  auto free_bytes = header_->free_lists.free_bytes;
+  auto offset = AllocateBlock(header_, size_, bytes, record ? 0xFFFFFFFF : kAnyOffset);
+  if (header_->free_lists.free_bytes < free_bytes)
+    reused_bytes_ += free_bytes - header_->free_lists.free_bytes;
+  return offset;
+}
+
+void Updater::Retire(FFS_Offset offset, FFS_Offset bytes) {
+  // The indexes the scan wrote are only 4 byte aligned, the blocks handed out are 8.
+  auto begin = (offset + 7) & ~FFS_Offset(7);
+  auto end = (offset + bytes) & ~FFS_Offset(7);
+  if (begin >= end)
+    return;
+  reclaimer_.Retire(begin, end - begin);
+  retired_bytes_ += end - begin;
+}
+
+bool Updater::IndexListing(FFS_Offset dir) {
+  auto table = header_->dir_slots;
+  auto slot_count = table.Get(header_)->slot_count;
+  if (!IndexDir(header_, size_, dir))
+    return false;
+  if (header_->dir_slots != table)
+    Retire(table, DirSlotsSize(slot_count));
+  return true;
+}
+
+bool Updater::IndexNode(const FFS_Dir* dir, DWORD node, DWORD name_hash) {
+  auto table = header_->leaf_slots;
+  if (!table)
+    return true;
+  auto slot_count = table.Get(header_)->slot_count;
+  if (!IndexLeaf(header_, size_, dir, node, name_hash))
+    return false;
+  if (header_->leaf_slots != table)
+    Retire(table, LeafSlotsSize(slot_count));
+  return true;
+}
+
+DWORD Updater::WriteRecord(const wchar_t* name, size_t len, const WIN32_FIND_DATA& w32fd,
+                           DWORD parent) {
+  auto bytes = RecordBytes(len);
+  auto offset = Allocate(bytes, true);
+  if (!offset)
+    return 0;
+  auto rec = reinterpret_cast<WIN32_FIND_DATA*>(reinterpret_cast<BYTE*>(header_) + offset);
+  memset(rec, 0, size_t(bytes));
+  memcpy(rec, &w32fd, offsetof(WIN32_FIND_DATA, cFileName));
+  rec->dwReserved0 = parent;
+  wmemcpy(rec->cFileName, name, len);
+  AdvanceNext(rec, len);
+  return DWORD(offset);
+}
+
+DWORD Updater::WriteNode(const FFS_Dir* dir, const std::wstring& name, DWORD name_hash,
+                         const WIN32_FIND_DATA& w32fd, bool new_listing, FFS_Offset* subdir) {
+  *subdir = 0;
+  WIN32_FIND_DATA anchor;
+  ReadNode(header_, dir->anchor, &anchor);
+  auto node = WriteRecord(name.c_str(), name.size(), w32fd, anchor.dwReserved0);
+  if (!node || !new_listing || !HasListing(w32fd.dwFileAttributes) || !AddDir(name.c_str()))
+    return node;
+  auto dot = WriteRecord(L".", 1, w32fd, node);
+  auto offset = dot ? Allocate(sizeof(FFS_Dir), false) : 0;
+  if (!offset) {
+    // The last one goes back first, for the bump region to shrink.
+    if (dot)
+      FreeBlock(header_, dot, BlockSize(RecordBytes(1)));
+    FreeBlock(header_, node, BlockSize(RecordBytes(name.size())));
+    return 0;
+  }
+  auto listing = reinterpret_cast<FFS_Dir*>(reinterpret_cast<BYTE*>(header_) + offset);
+  listing->anchor = dot;
+  listing->hash = CombineHash(dir->hash, name_hash);
+  listing->count = 0;
+  listing->generation = 0;
+  listing->index = header_->dir_index;
+  *subdir = offset;
+  return node;
+}
+
+bool Updater::IndexNew(const FFS_Dir* dir, DWORD node, DWORD name_hash, FFS_Offset subdir) {
+  if (subdir && !IndexListing(subdir))
+    return false;
+  return IndexNode(dir, node, name_hash);
+}
+
+void Updater::DropNode(const FFS_Dir* dir, DWORD node, DWORD name_hash, FFS_Offset subdir,
+                       bool indexed) {
+  WIN32_FIND_DATA w32fd;
+  ReadNode(header_, node, &w32fd);
+  auto node_bytes = BlockSize(RecordBytes(wcslen(w32fd.cFileName)));
+  auto listing = subdir ? reinterpret_cast<FFS_Dir*>(reinterpret_cast<BYTE*>(header_) + subdir)
+                       : nullptr;
+  if (!indexed) {
+    if (subdir) {
+      auto dot = listing->anchor;
+      FreeBlock(header_, subdir, BlockSize(sizeof(FFS_Dir)));
+      FreeBlock(header_, dot, BlockSize(RecordBytes(1)));
+    }
+    FreeBlock(header_, node, node_bytes);
+    return;
+  }
+  UnindexLeaf(header_, dir, node, name_hash);
+  if (subdir) {
+    UnindexDir(header_, listing->hash, subdir);
+    Retire(subdir, BlockSize(sizeof(FFS_Dir)));
+    Retire(listing->anchor, BlockSize(RecordBytes(1)));
+  }
+  Retire(node, node_bytes);
+}
+
+DWORD Updater::Link(FFS_Dir* dir, const std::wstring& name, const WIN32_FIND_DATA& w32fd,
+                    bool new_listing) {
+  auto name_hash = NodeNameHash(header_, name);
+  FFS_Offset subdir = 0;
+  auto node = WriteNode(dir, name, name_hash, w32fd, new_listing, &subdir);
+  if (!node)
+    return 0;
+  // The indexes have the node before the listing does, which the clients do not see, the header
+  // generation covering both. The listing goes last, as it is the one that cannot be undone.
+  if (!IndexNew(dir, node, name_hash, subdir) ||
+      !ReplaceListing(dir, 0, &node, 1, LowerBound(header_, dir, name))) {
+    DropNode(dir, node, name_hash, subdir, true);
+    return 0;
+  }
+  if (subdir) {
+    ++header_->num_nodes;
+    ++header_->num_dirs;
+    ++header_->nodes_added;
+  }
+  ++header_->num_nodes;
+  ++header_->nodes_added;
+  return node;
+}
+
+void Updater::FillListing(FFS_Dir* dir, const std::wstring& path, const PathFilter* filter,
+                          const PathFilter::State& state) {
+  // The directory is read before the write starts, so the clients do not wait for the disk.
+  Arena arena;
+  DirListing listing = {filter, &state};
+  if (!ReadDirectory(path, &arena, &listing))
+    return;
+  // Sorted like the scan sorts them, after the "." record, which is the directory itself.
+  std::vector<const WIN32_FIND_DATA*> entries;
+  auto end = reinterpret_cast<const WIN32_FIND_DATA*>(arena.run() + arena.run_size());
+  auto dot = reinterpret_cast<const WIN32_FIND_DATA*>(arena.run());
+  for (auto rec = AdvanceNext(dot); rec < end; rec = AdvanceNext(rec))
+    entries.push_back(rec);
+  std::sort(entries.begin(), entries.end(), [](const WIN32_FIND_DATA* a,
+                                               const WIN32_FIND_DATA* b) {
+    return wcscmp(a->cFileName, b->cFileName) < 0;
+  });
+
+  // All the nodes go to one listing, rather than to a new listing per node added. Once the
+  // section is full, the rest is left out.
+  std::vector<DWORD> nodes, name_hashes;
+  std::vector<FFS_Offset> subdirs;
+  BeginWrite(&header_->generation);
+  for (auto rec : entries) {
+    std::wstring name(rec->cFileName);
+    auto name_hash = NodeNameHash(header_, name);
+    FFS_Offset subdir = 0;
+    auto node = WriteNode(dir, name, name_hash, *rec, true, &subdir);
+    if (!node)
+      break;
+    if (!IndexNew(dir, node, name_hash, subdir)) {
+      DropNode(dir, node, name_hash, subdir, true);
+      break;
+    }
+    nodes.push_back(node);
+    name_hashes.push_back(name_hash);
+    subdirs.push_back(subdir);
+  }
+  if (!nodes.empty() && !ReplaceListing(dir, 0, nodes.data(), DWORD(nodes.size()), 0)) {
+    for (auto ix = nodes.size(); ix--;)
+      DropNode(dir, nodes[ix], name_hashes[ix], subdirs[ix], true);
+    nodes.clear();
+  }
+  for (size_t ix = 0; ix != nodes.size(); ++ix) {
+    if (subdirs[ix]) {
+      ++header_->num_nodes;
+      ++header_->num_dirs;
+      ++header_->nodes_added;
+    }
+    ++header_->num_nodes;
+    ++header_->nodes_added;
+  }
+  EndWrite(&header_->generation);
+
+  PathFilter::State child;
+  for (size_t ix = 0; ix != nodes.size(); ++ix) {
+    if (!subdirs[ix])
+      continue;
+    WIN32_FIND_DATA w32fd;
+    ReadNode(header_, nodes[ix], &w32fd);
+    if (filter)
+      filter->Descend(state, w32fd.cFileName, &child);
+    auto subdir = reinterpret_cast<FFS_Dir*>(reinterpret_cast<BYTE*>(header_) + subdirs[ix]);
+    FillListing(subdir, (path + kPathSep) + w32fd.cFileName, filter, child);
+  }
+}
+
+FFS_Dir* Updater::ReplaceListing(FFS_Dir* dir, DWORD removed, const DWORD* added,
+                                 DWORD added_count, DWORD pos) {
+  auto count = dir->count - (removed ? 1 : 0) + added_count;
+  auto offset = Allocate(FFS_Offset(sizeof(FFS_Dir)) + FFS_Offset(count) * sizeof(DWORD), false);
+  if (!offset)
+    return nullptr;
+  auto listing = reinterpret_cast<FFS_Dir*>(reinterpret_cast<BYTE*>(header_) + offset);
+  *listing = *dir;
+  listing->count = count;
+  listing->index = offset + sizeof(FFS_Dir);
+  auto old_index = dir->index.Get(header_);
+  auto index = listing->index.Get(header_);
+  DWORD out = 0;
+  for (DWORD ix = 0; ix <= dir->count; ++ix) {
+    if (ix == pos) {
+      for (DWORD ax = 0; ax != added_count; ++ax)
+        index[out++] = added[ax];
+    }
+    if ((ix != dir->count) && (old_index[ix] != removed))
+      index[out++] = old_index[ix];
+  }
+  auto dir_offset = FFS_Offset(reinterpret_cast<BYTE*>(dir) - reinterpret_cast<BYTE*>(header_));
+  ReplaceDir(header_, dir_offset, offset);
+  auto block = ListingBlock(header_, dir);
+  Retire(block.offset, block.bytes);
+  return listing;
+}
+
+bool Updater::Unlink(FFS_Dir* dir, DWORD node) {
+  WIN32_FIND_DATA w32fd;
+  ReadNode(header_, node, &w32fd);
+  auto subdir = HasListing(w32fd.dwFileAttributes) ? FindSubdir(header_, dir, node) : nullptr;
+  // The replaced listing stays readable until the next Reclaim().
+  if (!KeepsRemoved(header_) && !ReplaceListing(dir, node, nullptr, 0, 0))
+    return false;
+  UnindexLeaf(header_, dir, node, NodeNameHash(header_, w32fd.cFileName));
+  if (subdir)
+    RemoveListing(Mutable(subdir));
+  SetParent(node, 0);
+  RetireRecord(node, w32fd);
+  --header_->num_nodes;
+  return true;
+}
+
+void Updater::SetParent(DWORD node, DWORD parent) {
+  if (header_->layout == FFS_kLayoutColumns) {
+    StoreRelease(&header_->columns.parent.Get(header_)[node], parent);
+    return;
+  }
+  auto rec = reinterpret_cast<WIN32_FIND_DATA*>(reinterpret_cast<BYTE*>(header_) + node);
+  StoreRelease(&rec->dwReserved0, parent);
+}
+
+void Updater::RetireRecord(DWORD node, const WIN32_FIND_DATA& w32fd) {
+  if ((header_->layout != FFS_kLayoutColumns) && (node >= header_->bytes))
+    Retire(node, BlockSize(RecordBytes(wcslen(w32fd.cFileName))));
+}
+
+void Updater::RemoveListing(FFS_Dir* dir) {
+  auto index = dir->index.Get(header_);
+  for (DWORD ix = 0; ix != dir->count; ++ix) {
+    auto node = index[ix];
+    WIN32_FIND_DATA w32fd;
+    ReadNode(header_, node, &w32fd);
+    // Removed already, from a front coded listing.
+    if (!w32fd.dwReserved0)
+      continue;
+    UnindexLeaf(header_, dir, node, NodeNameHash(header_, w32fd.cFileName));
+    if (HasListing(w32fd.dwFileAttributes)) {
+      if (auto subdir = FindSubdir(header_, dir, node))
+        RemoveListing(Mutable(subdir));
+    }
+    SetParent(node, 0);
+    RetireRecord(node, w32fd);
+    --header_->num_nodes;
+  }
+  WIN32_FIND_DATA anchor;
+  ReadNode(header_, dir->anchor, &anchor);
+  SetParent(dir->anchor, 0);
+  RetireRecord(dir->anchor, anchor);
+  --header_->num_nodes;
+  --header_->num_dirs;
+  auto dir_offset = FFS_Offset(reinterpret_cast<BYTE*>(dir) - reinterpret_cast<BYTE*>(header_));
+  UnindexDir(header_, dir->hash, dir_offset);
+  auto block = ListingBlock(header_, dir);
+  Retire(block.offset, block.bytes);
+}
+
+void Updater::RehashListing(FFS_Dir* dir, DWORD hash) {
+  // The listings under |dir| are found with the old hashes, before they change.
+  std::vector<DWORD> name_hashes(dir->count);
+  std::vector<std::pair<FFS_Dir*, DWORD>> subdirs;
+  auto index = dir->index.Get(header_);
+  for (DWORD ix = 0; ix != dir->count; ++ix) {
+    WIN32_FIND_DATA w32fd;
+    ReadNode(header_, index[ix], &w32fd);
+    name_hashes[ix] = NodeNameHash(header_, w32fd.cFileName);
+    UnindexLeaf(header_, dir, index[ix], name_hashes[ix]);
+    if (HasListing(w32fd.dwFileAttributes)) {
+      if (auto subdir = FindSubdir(header_, dir, index[ix]))
+        subdirs.push_back(std::make_pair(Mutable(subdir), name_hashes[ix]));
+    }
+  }
+  auto dir_offset = FFS_Offset(reinterpret_cast<BYTE*>(dir) - reinterpret_cast<BYTE*>(header_));
+  UnindexDir(header_, dir->hash, dir_offset);
+  StoreRelease(&dir->hash, hash);
+  IndexListing(dir_offset);
+  for (DWORD ix = 0; ix != dir->count; ++ix)
+    IndexNode(dir, index[ix], name_hashes[ix]);
+  for (auto& subdir : subdirs)
+    RehashListing(subdir.first, CombineHash(hash, subdir.second));
+}
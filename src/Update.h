@@ -0,0 +1,146 @@
+#pragma once
+
+// Updates of the live section by the server, as it learns about changes to the tree.
+//
+// The server is the only writer and the clients keep reading while it writes, without locks. So
+// every write is covered by a generation, see BeginWrite(): the fields of the nodes by the one of
+// their listing, and the moves and relinks of nodes by the one of the header. The clients that
+// read through ReadPath() retry when a write overlapped them and never see a node half written.
+//
+// The listings are never changed in place. A node is added or removed by writing a new FFS_Dir
+// and index for its listing and pointing the directory index to them, and a removed node is
+// marked by setting its parent to 0, see Layout.h. The memory this leaves behind, the old FFS_Dir
+// and index, the records of the removed nodes that the server had added, the listings under a
+// removed directory and the index tables that were replaced, is retired through the epochs, see
+// Epoch.h, and goes to the allocator of the section once no client can be reading it, see
+// Allocator.h. What the scan laid out, the runs of records and the FFS_Dir table, is never
+// reused: FindModifiedAfter() and the snapshots walk them.
+//
+// Only the records have room for new nodes: the columns are arrays of the size of the scan. So
+// the server does not watch the tree of a section with the columns, which stays as the scan found
+// it until the next one, rather than lose the nodes that are added or renamed.
+
+#include <string>
+
+#include "Epoch.h"
+#include "FastFileStats.h"
+#include "PathFilter.h"
+
+// Writes the metadata of |w32fd|, the fields the section stores but the name and the links, to
+// |node|, whose entry is in the listing of |dir|. The clients see either all the old fields or all
+// the new ones.
+void WriteNodeFields(FFS_Header* header, FFS_Dir* dir, DWORD node, const WIN32_FIND_DATA& w32fd);
+
+// WriteNodeFields() if |w32fd| differs from what |node| has, in the attributes, the size, the
+// write time or the creation time if it is stored. The access time alone does not change on the
+// notifications the server asks for, and is only written along with the others. Returns whether
+// it wrote.
+bool RefreshNodeFields(FFS_Header* header, FFS_Dir* dir, DWORD node, const WIN32_FIND_DATA& w32fd);
+
+// Adds, removes and renames the nodes of the live section at |header|, which is |size| bytes.
+// The paths are absolute. Only used by the server, on one thread.
+class Updater {
+ public:
+  Updater(FFS_Header* header, size_t size);
+
+  // Removes the node at |path|, and everything under it if it is a directory. Returns false if
+  // there is no node at |path|.
+  bool RemoveNode(const std::wstring& path);
+
+  // Adds the node at |path|, with the metadata of |w32fd|, to the listing of its directory,
+  // which must be in the section. A directory gets an empty listing. A node that is there already
+  // only gets the new metadata, see RefreshNodeFields(). Returns false if the node cannot be
+  // added: the section has the columns or is full.
+  bool AddNode(const std::wstring& path, const WIN32_FIND_DATA& w32fd);
+
+  // AddNode(), and for a directory that was not in the section the nodes under it too, read from
+  // the tree like the scan reads them, so that a directory moved in from outside the tree comes
+  // with its content. What |filter| excludes is left out, if not null, the last |relative| units
+  // of |path| being relative to the top directory. Returns false if the node cannot be added; the
+  // nodes under it that cannot be read or added are left out.
+  bool AddTree(const std::wstring& path, const WIN32_FIND_DATA& w32fd, const PathFilter* filter,
+               size_t relative);
+
+  // Moves the node at |from| to |to| and gives it the metadata of |w32fd|. A directory takes its
+  // listing along, and everything under it is found at the new path. Returns false if the node
+  // could not be added at |to|; it is removed from |from| anyway.
+  bool RenameNode(const std::wstring& from, const std::wstring& to,
+                  const WIN32_FIND_DATA& w32fd);
+
+  // Ends a batch of changes: advances the epoch and takes back the memory the clients are done
+  // with, for the next changes.
+  void Reclaim();
+
+  // The bytes retired and not reclaimed yet, and the bytes reclaimed and handed out again so far.
+  FFS_Offset retired_bytes() const { return retired_bytes_; }
+  FFS_Offset reused_bytes() const { return reused_bytes_; }
+
+ private:
+  // Returns the offset of a block of |bytes|, that a record can start at if |record|, or 0 if
+  // the section is full.
+  FFS_Offset Allocate(FFS_Offset bytes, bool record);
+  void Retire(FFS_Offset offset, FFS_Offset bytes);
+
+  // IndexDir() and IndexLeaf(), retiring the table they replace.
+  bool IndexListing(FFS_Offset dir);
+  bool IndexNode(const FFS_Dir* dir, DWORD node, DWORD name_hash);
+
+  // Writes a record for |name| with the metadata of |w32fd| and the parent |parent|. Returns its
+  // ref, or 0 if the section is full.
+  DWORD WriteRecord(const wchar_t* name, size_t len, const WIN32_FIND_DATA& w32fd, DWORD parent);
+
+  // Writes the record of a node for |name|, named with |name_hash|, with the metadata of |w32fd|,
+  // for the listing of |dir|, and sets |*subdir| to a new empty listing for it if it is a
+  // directory and |new_listing|, or to 0. Nothing is indexed yet. Returns its ref, or 0 if the
+  // section is full.
+  DWORD WriteNode(const FFS_Dir* dir, const std::wstring& name, DWORD name_hash,
+                  const WIN32_FIND_DATA& w32fd, bool new_listing, FFS_Offset* subdir);
+
+  // Adds |node| from WriteNode() and its listing |subdir|, if not 0, to the indexes. Returns
+  // false if the section is full; DropNode() takes out what was indexed.
+  bool IndexNew(const FFS_Dir* dir, DWORD node, DWORD name_hash, FFS_Offset subdir);
+
+  // Releases |node| from WriteNode() and its listing |subdir|, if not 0, when they cannot be
+  // linked. If |indexed|, they are taken out of the indexes first and retired, since a client
+  // may have found them; otherwise they are freed at once.
+  void DropNode(const FFS_Dir* dir, DWORD node, DWORD name_hash, FFS_Offset subdir, bool indexed);
+
+  // Adds the node for |name| with the metadata of |w32fd| to the listing of |dir|, with a new
+  // empty listing if it is a directory and |new_listing|. Returns its ref, or 0 if the section
+  // is full.
+  DWORD Link(FFS_Dir* dir, const std::wstring& name, const WIN32_FIND_DATA& w32fd,
+             bool new_listing);
+
+  // Links the nodes read from the directory at |path| to its empty listing |dir|, all at once,
+  // and fills the listings under it the same way. |state| is the state of |filter| for |path|.
+  void FillListing(FFS_Dir* dir, const std::wstring& path, const PathFilter* filter,
+                   const PathFilter::State& state);
+
+  // Replaces the listing of |dir| by one without |removed| if it is not 0, and with the
+  // |added_count| nodes of |added|, in order, at |pos| in the index. Returns the new FFS_Dir, or
+  // null if the section is full.
+  FFS_Dir* ReplaceListing(FFS_Dir* dir, DWORD removed, const DWORD* added, DWORD added_count,
+                          DWORD pos);
+
+  // Unlinks |node| from the listing of |dir|, and removes the listing of the node if it is a
+  // directory. Returns false if the section is full.
+  bool Unlink(FFS_Dir* dir, DWORD node);
+
+  // Sets the parent of |node| to |parent|.
+  void SetParent(DWORD node, DWORD parent);
+
+  // Retires the record of the removed |node|, read into |w32fd|, if the server added it.
+  void RetireRecord(DWORD node, const WIN32_FIND_DATA& w32fd);
+
+  // Takes the listing of |dir|, and the ones under it, out of the indexes and retires them.
+  void RemoveListing(FFS_Dir* dir);
+
+  // Gives |dir| and the listings under it the hash of their new path, |dir| having |hash|.
+  void RehashListing(FFS_Dir* dir, DWORD hash);
+
+  FFS_Header* header_;
+  size_t size_;
+  EpochReclaimer reclaimer_;
+  FFS_Offset retired_bytes_;
+  FFS_Offset reused_bytes_;
+};
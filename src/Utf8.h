@@ -0,0 +1,128 @@
+#pragma once
+
+// Conversions between the wchar_t names used in the section and UTF-8. wchar_t is UTF-16 on
+// Windows and UTF-32 everywhere else.
+
+#include <string.h>
+#include <wchar.h>
+
+#include <string>
+
+// A UTF-8 string that is not owned, for the APIs that take UTF-8 names and paths.
+struct Utf8View {
+  Utf8View(const char* str) : data(str), size(strlen(str)) {}
+  Utf8View(const std::string& str) : data(str.data()), size(str.size()) {}
+  Utf8View(const char* str, size_t len) : data(str), size(len) {}
+
+  const char* data;
+  size_t size;
+};
+
+// Same for wchar_t, so that the callers with a literal or a buffer do not make a std::wstring.
+struct WideView {
+  WideView(const wchar_t* str) : data(str), size(wcslen(str)) {}
+  WideView(const std::wstring& str) : data(str.data()), size(str.size()) {}
+  WideView(const wchar_t* str, size_t len) : data(str), size(len) {}
+
+  const wchar_t* data;
+  size_t size;
+};
+
+// The most UTF-8 bytes a wchar_t unit takes: a surrogate pair is 2 units for 4 bytes.
+const size_t kMaxUtf8PerUnit = (sizeof(wchar_t) == 2) ? 3 : 4;
+
+// Encodes the |len| units at |src| as UTF-8 into |dest|, which needs room for |len| *
+// kMaxUtf8PerUnit bytes. Returns the number of bytes written.
+inline size_t EncodeUtf8(const wchar_t* src, size_t len, char* dest) {
+  size_t out = 0;
+  for (size_t ix = 0; ix != len; ++ix) {
+    unsigned long cp = static_cast<unsigned long>(src[ix]);
+    if (sizeof(wchar_t) == 2 && cp >= 0xD800 && cp < 0xDC00 && ix + 1 != len) {
+      unsigned long lo = static_cast<unsigned long>(src[ix + 1]);
+      if (lo >= 0xDC00 && lo < 0xE000) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        ++ix;
+      }
+    }
+    if (cp < 0x80) {
+      dest[out++] = char(cp);
+    } else if (cp < 0x800) {
+      dest[out++] = char(0xC0 | (cp >> 6));
+      dest[out++] = char(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      dest[out++] = char(0xE0 | (cp >> 12));
+      dest[out++] = char(0x80 | ((cp >> 6) & 0x3F));
+      dest[out++] = char(0x80 | (cp & 0x3F));
+    } else {
+      dest[out++] = char(0xF0 | (cp >> 18));
+      dest[out++] = char(0x80 | ((cp >> 12) & 0x3F));
+      dest[out++] = char(0x80 | ((cp >> 6) & 0x3F));
+      dest[out++] = char(0x80 | (cp & 0x3F));
+    }
+  }
+  return out;
+}
+
+// Appends the UTF-8 form of the |len| units at |src| to |dest|.
+inline void AppendUtf8(const wchar_t* src, size_t len, std::string* dest) {
+  auto size = dest->size();
+  dest->resize(size + len * kMaxUtf8PerUnit);
+  dest->resize(size + EncodeUtf8(src, len, &(*dest)[0] + size));
+}
+
+inline std::string ToUtf8(const std::wstring& str) {
+  std::string utf8;
+  utf8.reserve(str.size());
+  AppendUtf8(str.c_str(), str.size(), &utf8);
+  return utf8;
+}
+
+// Decodes the |len| bytes of UTF-8 at |src| into |dest|, which needs room for |len| + 1 units.
+// Invalid sequences become U+FFFD. Returns the number of units written, without the final 0.
+inline size_t DecodeUtf8(const char* src, size_t len, wchar_t* dest) {
+  auto bytes = reinterpret_cast<const unsigned char*>(src);
+  size_t out = 0;
+  size_t ix = 0;
+  while (ix != len) {
+    unsigned long cp = bytes[ix++];
+    int extra = 0;
+    if (cp < 0x80) {
+      // ascii.
+    } else if (cp < 0xC0 || cp >= 0xF8) {
+      cp = 0xFFFD;
+    } else if (cp >= 0xF0) {
+      cp &= 0x07;
+      extra = 3;
+    } else if (cp >= 0xE0) {
+      cp &= 0x0F;
+      extra = 2;
+    } else {
+      cp &= 0x1F;
+      extra = 1;
+    }
+    for (; extra; --extra) {
+      if (ix == len || (bytes[ix] & 0xC0) != 0x80) {
+        cp = 0xFFFD;
+        break;
+      }
+      cp = (cp << 6) | (bytes[ix++] & 0x3F);
+    }
+    if (cp > 0x10FFFF)
+      cp = 0xFFFD;
+    if (sizeof(wchar_t) == 2 && cp >= 0x10000) {
+      cp -= 0x10000;
+      dest[out++] = wchar_t(0xD800 + (cp >> 10));
+      dest[out++] = wchar_t(0xDC00 + (cp & 0x3FF));
+    } else {
+      dest[out++] = wchar_t(cp);
+    }
+  }
+  dest[out] = 0;
+  return out;
+}
+
+inline std::wstring FromUtf8(Utf8View str) {
+  std::wstring wide(str.size + 1, 0);
+  wide.resize(DecodeUtf8(str.data, str.size, &wide[0]));
+  return wide;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// The subset of the Windows types and macros that the portable parts of the server use, for the
+// non-Windows builds. The section format depends on these, so the sizes must match Windows.
+
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+
+struct FILETIME {
+  DWORD dwLowDateTime;
+  DWORD dwHighDateTime;
+};
+
+#define MAX_PATH 260
+
+// Only the fields up to cFileName are used by the section, but the full record is needed as
+// scratch space while reading a directory.
+struct WIN32_FIND_DATA {
+  DWORD dwFileAttributes;
+  FILETIME ftCreationTime;
+  FILETIME ftLastAccessTime;
+  FILETIME ftLastWriteTime;
+  DWORD nFileSizeHigh;
+  DWORD nFileSizeLow;
+  DWORD dwReserved0;
+  DWORD dwReserved1;
+  wchar_t cFileName[MAX_PATH];
+  wchar_t cAlternateFileName[14];
+};
+
+#define FILE_ATTRIBUTE_READONLY       0x00000001
+#define FILE_ATTRIBUTE_HIDDEN         0x00000002
+#define FILE_ATTRIBUTE_DIRECTORY      0x00000010
+#define FILE_ATTRIBUTE_NORMAL         0x00000080
+#define FILE_ATTRIBUTE_REPARSE_POINT  0x00000400
+
+#define __debugbreak() __builtin_trap()
+
+template <size_t N>
+int wcscpy_s(wchar_t (&dest)[N], const wchar_t* src) {
+  auto len = wcslen(src);
+  if (len >= N)
+    __debugbreak();
+  wmemcpy(dest, src, len + 1);
+  return 0;
+}
@@ -5,12 +5,15 @@
 
 #pragma once
 
+#if defined(_WIN32)
+
 // If you wish to build your application for a previous Windows platform, include WinSDKVer.h and
 // set the _WIN32_WINNT macro to the platform you wish to support before including SDKDDKVer.h.
 
 #include <SDKDDKVer.h>
 
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
+#define NOMINMAX                        // Use std::min and std::max
 // Windows Header Files:
 #include <windows.h>
 
@@ -20,5 +23,15 @@
 #include <memory.h>
 #include <tchar.h>
 
+#else
+
+// Non-Windows builds only have the portable parts of the server, see Makefile.
+#include <stdlib.h>
+#include <string.h>
+
+#include "Win32Compat.h"
+
+#endif
+
 
 // TODO: reference additional headers your program requires here